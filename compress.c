@@ -0,0 +1,543 @@
+#include "xcfs.h"
+
+#include <linux/lz4.h>
+#include <linux/crc32c.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/falloc.h>
+
+/*
+ * Compression.  A compressed file is cut into extents of
+ * 1 << hdr.extent_shift bytes, each kept at its own offset in the lower
+ * file, so lower offsets and sizes stay the upper ones.  An extent that
+ * saves at least a page is stored as a frame at the start of its slot,
+ * a struct xcfs_frame followed by the encrypted LZ4 data, with the rest
+ * of the slot punched out; any other extent is stored whole, exactly
+ * like in an uncompressed file.
+ *
+ * The frame is what tells the two apart, so how an extent is stored
+ * reaches the lower file in the same write as its data: after a crash an
+ * extent reads back as it was last written, never decoded as the other
+ * kind.  A write torn by the crash leaves a frame that fails its crc and
+ * a slot read as whole, as torn data would be in any file.
+ */
+
+/* scratch space for one extent */
+struct xcfs_extent_buf {
+	char *ext;		/* plaintext of the extent */
+	char *cbuf;		/* its frame and compressed form */
+	void *wrkmem;		/* LZ4 state, writes only */
+	bool framed;		/* as loaded: stored compressed */
+};
+
+static inline size_t xcfs_extent_size(const struct inode *inode)
+{
+	return (size_t)1 << XCFS_I(inode)->hdr.extent_shift;
+}
+
+static int xcfs_ext_buf_alloc(struct inode *inode,
+			      struct xcfs_extent_buf *eb, bool write)
+{
+	size_t size = xcfs_extent_size(inode);
+
+	eb->ext = kvmalloc(size, GFP_NOFS);
+	eb->cbuf = kvmalloc(sizeof(struct xcfs_frame) +
+			    LZ4_compressBound(size), GFP_NOFS);
+	eb->wrkmem = write ? kvmalloc(LZ4_MEM_COMPRESS, GFP_NOFS) : NULL;
+	if (!eb->ext || !eb->cbuf || (write && !eb->wrkmem))
+		return -ENOMEM;
+	return 0;
+}
+
+static void xcfs_ext_buf_free(struct xcfs_extent_buf *eb)
+{
+	kvfree(eb->ext);
+	kvfree(eb->cbuf);
+	kvfree(eb->wrkmem);
+}
+
+/*
+ * this function returns how many bytes of slot n the frame at the start
+ * of buf (len bytes of it) claims, 0 if there is no frame
+ */
+static size_t xcfs_frame_len(const char *buf, size_t len, unsigned long n)
+{
+	const struct xcfs_frame *f = (const struct xcfs_frame *)buf;
+
+	if (len < sizeof(*f) || le32_to_cpu(f->magic) != XCFS_FRAME_MAGIC ||
+	    le32_to_cpu(f->index) != (u32)n || !f->clen)
+		return 0;
+	return sizeof(*f) + le32_to_cpu(f->clen);
+}
+
+/* this function returns the compressed length of a good frame, else 0 */
+static u32 xcfs_frame_check(const char *buf, size_t len, unsigned long n)
+{
+	const struct xcfs_frame *f = (const struct xcfs_frame *)buf;
+	size_t flen = xcfs_frame_len(buf, len, n);
+
+	if (!flen || flen > len ||
+	    crc32c(~0U, buf + sizeof(*f), flen - sizeof(*f)) !=
+	    le32_to_cpu(f->crc))
+		return 0;
+	return flen - sizeof(*f);
+}
+
+/*
+ * this function reads the plaintext of extent n into eb->ext, zero
+ * filled past what the lower file holds.  It returns the number of
+ * bytes of the extent below eof.
+ */
+static ssize_t xcfs_load_extent(struct inode *inode, struct file *lower_file,
+				unsigned long n, struct xcfs_extent_buf *eb)
+{
+	size_t size = xcfs_extent_size(inode);
+	loff_t start = (loff_t)n << XCFS_I(inode)->hdr.extent_shift;
+	loff_t isize = i_size_read(file_inode(lower_file));
+	size_t valid, len, want;
+	u32 clen;
+	int rc;
+
+	eb->framed = false;
+	if (isize <= start) {
+		memset(eb->ext, 0, size);
+		return 0;
+	}
+	valid = min_t(loff_t, size, isize - start);
+
+	/* a frame says how much of the slot to read, the rest is a hole */
+	rc = kernel_read(lower_file, start, eb->ext,
+			 min_t(size_t, valid, PAGE_SIZE));
+	if (rc < 0)
+		return rc;
+	len = rc;
+	want = xcfs_frame_len(eb->ext, len, n);
+	if (!want || want > valid)
+		want = valid;
+	if (len < want) {
+		rc = kernel_read(lower_file, start + len, eb->ext + len,
+				 want - len);
+		if (rc < 0)
+			return rc;
+		len += rc;
+	}
+	clen = xcfs_frame_check(eb->ext, len, n);
+	/* whole data that happened to start like a frame */
+	if (!clen && len < valid) {
+		rc = kernel_read(lower_file, start + len, eb->ext + len,
+				 valid - len);
+		if (rc < 0)
+			return rc;
+		len += rc;
+	}
+	xcfs_stat_add(inode->i_sb, lower_read_bytes, len);
+
+	if (!clen) {
+		xcfs_decrypt(inode, eb->ext, len, start);
+		memset(eb->ext + len, 0, size - len);
+		return valid;
+	}
+
+	memcpy(eb->cbuf, eb->ext + sizeof(struct xcfs_frame), clen);
+	xcfs_decrypt(inode, eb->cbuf, clen, start);
+	rc = LZ4_decompress_safe(eb->cbuf, eb->ext, clen, size);
+	if (rc < 0) {
+		printk_ratelimited(KERN_ERR "xcfs: inode %lu: bad compressed "
+				   "extent %lu\n", inode->i_ino, n);
+		return -EIO;
+	}
+	eb->framed = true;
+	memset(eb->ext + rc, 0, size - rc);
+	return valid;
+}
+
+/*
+ * this function stores the first valid bytes of eb->ext as extent n,
+ * compressed if that saves at least a page.  eb->ext is clobbered.
+ */
+static int xcfs_store_extent(struct inode *inode, struct file *lower_file,
+			     unsigned long n, struct xcfs_extent_buf *eb,
+			     size_t valid)
+{
+	struct xcfs_frame *f = (struct xcfs_frame *)eb->cbuf;
+	char *cdata = eb->cbuf + sizeof(*f);
+	size_t size = xcfs_extent_size(inode);
+	loff_t start = (loff_t)n << XCFS_I(inode)->hdr.extent_shift;
+	size_t flen;
+	int clen = 0;
+	int rc;
+
+	if (valid > PAGE_SIZE) {
+		clen = LZ4_compress_default(eb->ext, cdata, valid, valid,
+					    eb->wrkmem);
+		if (clen <= 0 || round_up(sizeof(*f) + clen, PAGE_SIZE) >=
+				 round_up(valid, PAGE_SIZE))
+			clen = 0;
+	}
+
+	if (!clen) {
+		xcfs_encrypt(inode, eb->ext, valid, start);
+		rc = kernel_write(lower_file, eb->ext, valid, start);
+		if (rc != valid)
+			return rc < 0 ? rc : -EIO;
+		xcfs_stat_add(inode->i_sb, lower_write_bytes, rc);
+		return 0;
+	}
+
+	xcfs_encrypt(inode, cdata, clen, start);
+	f->magic = cpu_to_le32(XCFS_FRAME_MAGIC);
+	f->clen = cpu_to_le32(clen);
+	f->index = cpu_to_le32((u32)n);
+	f->crc = cpu_to_le32(crc32c(~0U, cdata, clen));
+	flen = sizeof(*f) + clen;
+	rc = kernel_write(lower_file, eb->cbuf, flen, start);
+	if (rc != flen)
+		return rc < 0 ? rc : -EIO;
+	xcfs_stat_add(inode->i_sb, lower_write_bytes, rc);
+
+	/* the rest of the slot is not needed; without punching it stays */
+	vfs_fallocate(lower_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      start + flen, size - flen);
+	return 0;
+}
+
+/*
+ * this function fills a page of a compressed file.  The whole extent is
+ * decompressed, so the other pages of it are filled on the way, which
+ * is where readahead of compressed files comes from.
+ */
+int xcfs_compress_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	unsigned int shift = XCFS_I(inode)->hdr.extent_shift;
+	unsigned long n = page->index >> (shift - PAGE_SHIFT);
+	pgoff_t first = (pgoff_t)n << (shift - PAGE_SHIFT);
+	struct xcfs_extent_buf eb;
+	unsigned long dropped;
+	struct page *p;
+	pgoff_t index, last;
+	ssize_t valid;
+	char *virt;
+
+	valid = xcfs_ext_buf_alloc(inode, &eb, false);
+	if (valid)
+		goto out;
+
+	mutex_lock(&XCFS_I(inode)->extent_lock);
+	valid = xcfs_load_extent(inode, lower_file, n, &eb);
+	mutex_unlock(&XCFS_I(inode)->extent_lock);
+	if (valid < 0)
+		goto out;
+
+	virt = kmap(page);
+	memcpy(virt, eb.ext + ((page->index - first) << PAGE_SHIFT),
+	       PAGE_SIZE);
+	kunmap(page);
+	flush_dcache_page(page);
+	xcfs_stat_add(inode->i_sb, readpages, 1);
+
+	/* the rest of the extent, where nobody else is filling it */
+	last = valid ? first + ((valid - 1) >> PAGE_SHIFT) : first;
+	for (index = first; index <= last; index++) {
+		if (index == page->index)
+			continue;
+		p = grab_cache_page_nowait(page->mapping, index);
+		if (!p)
+			continue;
+		if (!PageUptodate(p)) {
+			virt = kmap(p);
+			memcpy(virt, eb.ext + ((index - first) << PAGE_SHIFT),
+			       PAGE_SIZE);
+			kunmap(p);
+			flush_dcache_page(p);
+			SetPageUptodate(p);
+			xcfs_stat_add(inode->i_sb, readpages, 1);
+		}
+		unlock_page(p);
+		put_page(p);
+	}
+
+	if (xcfs_use_upper_cache(inode)) {
+		dropped = invalidate_mapping_pages(lower_file->f_mapping,
+						   first, last);
+		xcfs_stat_add(inode->i_sb, lower_dropped, dropped);
+	}
+	valid = 0;
+out:
+	xcfs_ext_buf_free(&eb);
+	return valid;
+}
+
+/*
+ * this function writes count bytes of plaintext at pos through the
+ * compression stage, rewriting every extent it touches.  It returns the
+ * number of bytes written or an error.
+ */
+ssize_t xcfs_compress_write(struct inode *inode, struct file *lower_file,
+			    const char *buf, size_t count, loff_t pos)
+{
+	unsigned int shift = XCFS_I(inode)->hdr.extent_shift;
+	size_t size = xcfs_extent_size(inode);
+	struct xcfs_extent_buf eb;
+	loff_t end = pos + count;
+	loff_t newsize, start;
+	unsigned long n;
+	size_t off, len, valid;
+	ssize_t done = 0;
+	ssize_t rc, err;
+
+	if (!count)
+		return 0;
+	err = xcfs_ext_buf_alloc(inode, &eb, true);
+	if (err)
+		goto out;
+
+	mutex_lock(&XCFS_I(inode)->extent_lock);
+	newsize = max_t(loff_t, i_size_read(file_inode(lower_file)), end);
+	for (n = pos >> shift; done < count; n++) {
+		start = (loff_t)n << shift;
+		off = max_t(loff_t, pos, start) - start;
+		len = min_t(loff_t, end, start + size) - (start + off);
+		valid = min_t(loff_t, size, newsize - start);
+
+		/* a partly written extent keeps the rest of its data */
+		if (off || off + len < valid) {
+			rc = xcfs_load_extent(inode, lower_file, n, &eb);
+			if (rc < 0) {
+				err = rc;
+				break;
+			}
+		}
+		memcpy(eb.ext + off, buf + done, len);
+		err = xcfs_store_extent(inode, lower_file, n, &eb, valid);
+		if (err)
+			break;
+		done += len;
+	}
+
+	/* a compressed last extent leaves the lower file short */
+	if (done && i_size_read(file_inode(lower_file)) < pos + done)
+		err = vfs_truncate(&lower_file->f_path, pos + done);
+	mutex_unlock(&XCFS_I(inode)->extent_lock);
+out:
+	xcfs_ext_buf_free(&eb);
+	if (done)
+		return done;
+	return err;
+}
+
+/* the dirty pages of one extent, gathered for writeback */
+struct xcfs_compress_run {
+	struct file *lower_file;
+	unsigned long n;		/* the extent */
+	struct page **pages;		/* under writeback, unlocked */
+	unsigned int nr;
+	char *buf;			/* their data, at their extent offset */
+	struct xcfs_extent_buf eb;
+};
+
+static int xcfs_compress_run_alloc(struct inode *inode,
+				   struct xcfs_compress_run *run)
+{
+	size_t size = xcfs_extent_size(inode);
+	int err;
+
+	run->lower_file = xcfs_get_wb_file(inode);
+	run->nr = 0;
+	run->pages = kmalloc_array(size >> PAGE_SHIFT, sizeof(*run->pages),
+				   GFP_NOFS);
+	run->buf = kvmalloc(size, GFP_NOFS);
+	err = xcfs_ext_buf_alloc(inode, &run->eb, true);
+	if (!run->pages || !run->buf)
+		err = -ENOMEM;
+	return err;
+}
+
+static void xcfs_compress_run_free(struct xcfs_compress_run *run)
+{
+	kfree(run->pages);
+	kvfree(run->buf);
+	xcfs_ext_buf_free(&run->eb);
+	if (run->lower_file)
+		fput(run->lower_file);
+}
+
+/*
+ * this function stores the extent behind a run with one compression,
+ * reading the pages it has no dirty copy of from the lower file, and
+ * ends writeback on the run's pages
+ */
+static int xcfs_compress_run_flush(struct inode *inode,
+				   struct xcfs_compress_run *run)
+{
+	unsigned int shift = XCFS_I(inode)->hdr.extent_shift;
+	size_t size = xcfs_extent_size(inode);
+	struct file *lower_file = run->lower_file;
+	loff_t start = (loff_t)run->n << shift;
+	struct xcfs_extent_buf *eb = &run->eb;
+	size_t valid, off;
+	loff_t isize;
+	ssize_t err = 0;
+	unsigned int i;
+
+	if (!run->nr)
+		return 0;
+
+	mutex_lock(&XCFS_I(inode)->extent_lock);
+	/* truncated away while under writeback, see xcfs_setattr */
+	isize = i_size_read(inode);
+	if (isize <= start)
+		goto unlock;
+	valid = min_t(loff_t, size, isize - start);
+
+	if (run->nr < DIV_ROUND_UP(valid, PAGE_SIZE))
+		err = xcfs_load_extent(inode, lower_file, run->n, eb);
+	if (err >= 0) {
+		for (i = 0; i < run->nr; i++) {
+			off = ((loff_t)run->pages[i]->index << PAGE_SHIFT) -
+			      start;
+			memcpy(eb->ext + off, run->buf + off, PAGE_SIZE);
+		}
+		err = xcfs_store_extent(inode, lower_file, run->n, eb, valid);
+	}
+	/* a compressed last extent leaves the lower file short */
+	if (!err && i_size_read(file_inode(lower_file)) < start + valid)
+		err = vfs_truncate(&lower_file->f_path, start + valid);
+unlock:
+	mutex_unlock(&XCFS_I(inode)->extent_lock);
+	for (i = 0; i < run->nr; i++) {
+		if (err) {
+			SetPageError(run->pages[i]);
+			mapping_set_error(run->pages[i]->mapping, err);
+		}
+		end_page_writeback(run->pages[i]);
+	}
+	run->nr = 0;
+	return err;
+}
+
+/*
+ * this function is the write_cache_pages() callback for compressed
+ * files.  It copies a locked dirty page into the run, which is stored
+ * once the pages move on to another extent.
+ */
+static int xcfs_compress_wb_page(struct page *page,
+				 struct writeback_control *wbc, void *data)
+{
+	struct xcfs_compress_run *run = data;
+	struct inode *inode = page->mapping->host;
+	unsigned int shift = XCFS_I(inode)->hdr.extent_shift;
+	unsigned long n = page->index >> (shift - PAGE_SHIFT);
+	loff_t pos = page_offset(page);
+	loff_t isize = i_size_read(inode);
+	size_t off;
+	char *virt;
+	int err = 0;
+
+	/* truncated away while dirty */
+	if (pos >= isize) {
+		unlock_page(page);
+		return 0;
+	}
+	if (run->nr && run->n != n)
+		err = xcfs_compress_run_flush(inode, run);
+	run->n = n;
+
+	off = pos & (xcfs_extent_size(inode) - 1);
+	virt = kmap(page);
+	memcpy(run->buf + off, virt, PAGE_SIZE);
+	kunmap(page);
+
+	wbc_account_io(wbc, page, min_t(loff_t, PAGE_SIZE, isize - pos));
+	set_page_writeback(page);
+	unlock_page(page);
+	run->pages[run->nr++] = page;
+	return err;
+}
+
+/*
+ * this function writes back the dirty pages of a compressed file, each
+ * extent compressed and stored once however many of its pages are dirty
+ */
+int xcfs_compress_writepages(struct address_space *mapping,
+			     struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct xcfs_compress_run run;
+	int err, rc;
+
+	/* page at a time, redirtied without a lower file to write with */
+	err = xcfs_compress_run_alloc(inode, &run);
+	if (err || !run.lower_file) {
+		err = generic_writepages(mapping, wbc);
+		goto out;
+	}
+
+	err = write_cache_pages(mapping, wbc, xcfs_compress_wb_page, &run);
+	rc = xcfs_compress_run_flush(inode, &run);
+	if (!err)
+		err = rc;
+out:
+	xcfs_compress_run_free(&run);
+	return err;
+}
+
+/* this function writes back a page of a compressed file on its own */
+int xcfs_compress_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct xcfs_compress_run run;
+	int err;
+
+	err = xcfs_compress_run_alloc(inode, &run);
+	if (err || !run.lower_file) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		goto out;
+	}
+
+	/* errors are recorded on the page and the mapping */
+	xcfs_compress_wb_page(page, wbc, &run);
+	xcfs_compress_run_flush(inode, &run);
+out:
+	xcfs_compress_run_free(&run);
+	return 0;
+}
+
+/*
+ * this function rewrites the extent cut by a shrinking truncate to size
+ * if it is stored compressed, before the lower file is cut and its
+ * compressed data with it
+ */
+int xcfs_compress_truncate(struct inode *inode, struct path *lower_path,
+			   loff_t size)
+{
+	unsigned int shift = XCFS_I(inode)->hdr.extent_shift;
+	unsigned long n = size >> shift;
+	size_t off = size & (xcfs_extent_size(inode) - 1);
+	struct xcfs_extent_buf eb;
+	struct file *lower_file;
+	ssize_t err = 0;
+
+	mutex_lock(&XCFS_I(inode)->extent_lock);
+	if (!off || size >= i_size_read(xcfs_lower_inode(inode)))
+		goto out;
+
+	lower_file = dentry_open(lower_path, O_RDWR | O_LARGEFILE,
+				 current_cred());
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
+	err = xcfs_ext_buf_alloc(inode, &eb, true);
+	if (!err)
+		err = xcfs_load_extent(inode, lower_file, n, &eb);
+	if (err >= 0 && eb.framed)
+		err = xcfs_store_extent(inode, lower_file, n, &eb, off);
+	xcfs_ext_buf_free(&eb);
+	fput(lower_file);
+out:
+	mutex_unlock(&XCFS_I(inode)->extent_lock);
+	return err < 0 ? err : 0;
+}
@@ -0,0 +1,294 @@
+#include "xcfs.h"
+
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/uio.h>
+#include <crypto/algapi.h>
+#include <crypto/chacha20.h>
+
+/*
+ * Parallel transform engine.  Buffers of at least crypt_threshold bytes
+ * are cut into XCFS_CRYPT_CHUNK pieces that run on the mount's unbound
+ * workqueue, whose workers stay on the NUMA node that queued them; the
+ * caller transforms the last piece itself and returns once every piece
+ * is done, so callers see the whole buffer transformed in order, as with
+ * the inline transform.  Smaller buffers are transformed inline.
+ */
+
+struct xcfs_crypt_work {
+	struct work_struct work;
+	struct inode *inode;
+	char *buf;
+	size_t count;
+	loff_t pos;
+	bool encrypt;
+	atomic_t *pending;
+	struct completion *done;
+};
+
+static void xcfs_crypt_one(struct inode *inode, char *buf, size_t count,
+			   loff_t pos, bool encrypt)
+{
+	if (encrypt)
+		xcfs_encrypt(inode, buf, count, pos);
+	else
+		xcfs_decrypt(inode, buf, count, pos);
+}
+
+static void xcfs_crypt_fn(struct work_struct *work)
+{
+	struct xcfs_crypt_work *cw =
+		container_of(work, struct xcfs_crypt_work, work);
+
+	xcfs_crypt_one(cw->inode, cw->buf, cw->count, cw->pos, cw->encrypt);
+	if (atomic_dec_and_test(cw->pending))
+		complete(cw->done);
+}
+
+/* whether a buffer of count bytes is transformed by the caller alone */
+bool xcfs_crypt_inline(struct inode *inode, size_t count)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(inode->i_sb);
+	unsigned int threshold = READ_ONCE(sbi->crypt_threshold);
+
+	return !sbi->crypt_wq || !threshold || count < threshold ||
+	       count <= XCFS_CRYPT_CHUNK;
+}
+
+/* this function transforms a buffer, spread over the crypto workers */
+static void xcfs_crypt(struct inode *inode, char *buf, size_t count,
+		       loff_t pos, bool encrypt)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(inode->i_sb);
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct xcfs_crypt_work *works;
+	atomic_t pending;
+	unsigned int workers = READ_ONCE(sbi->crypto_workers);
+	size_t chunk;
+	unsigned int nr, i;
+
+	/* the caller transforms one piece, so workers + 1 pieces at most */
+	nr = min_t(size_t, DIV_ROUND_UP(count, XCFS_CRYPT_CHUNK),
+		   workers ? workers + 1 : num_online_cpus());
+	if (xcfs_crypt_inline(inode, count) || nr < 2)
+		goto inline_crypt;
+
+	works = kmalloc_array(nr - 1, sizeof(*works), GFP_NOFS);
+	if (!works)
+		goto inline_crypt;
+
+	/*
+	 * equal pieces of whole crypto units of the block format, which
+	 * also keeps workers from sharing a cache line
+	 */
+	chunk = ALIGN(DIV_ROUND_UP(count, nr), XCFS_BLOCK_SIZE);
+	nr = DIV_ROUND_UP(count, chunk);
+	atomic_set(&pending, nr - 1);
+	for (i = 0; i < nr - 1; i++) {
+		INIT_WORK(&works[i].work, xcfs_crypt_fn);
+		works[i].inode = inode;
+		works[i].buf = buf + i * chunk;
+		works[i].count = chunk;
+		works[i].pos = pos + i * chunk;
+		works[i].encrypt = encrypt;
+		works[i].pending = &pending;
+		works[i].done = &done;
+		queue_work(sbi->crypt_wq, &works[i].work);
+	}
+	xcfs_stat_add(inode->i_sb, crypt_offloaded, nr - 1);
+
+	xcfs_crypt_one(inode, buf + i * chunk, count - i * chunk,
+		       pos + i * chunk, encrypt);
+	if (nr > 1)
+		wait_for_completion(&done);
+	kfree(works);
+	return;
+
+inline_crypt:
+	xcfs_crypt_one(inode, buf, count, pos, encrypt);
+}
+
+void xcfs_encrypt_buf(struct inode *inode, char *buf, size_t count,
+		      loff_t pos)
+{
+	xcfs_crypt(inode, buf, count, pos, true);
+}
+
+void xcfs_decrypt_buf(struct inode *inode, char *buf, size_t count,
+		      loff_t pos)
+{
+	xcfs_crypt(inode, buf, count, pos, false);
+}
+
+/*
+ * Fused copies.  Transforming a whole buffer and then copying it to or
+ * from user memory walks it twice, and once the buffer outgrows the
+ * caches the second walk goes back to memory.  These transform one
+ * XCFS_FUSE_CHUNK and copy it while it is still in the L1 cache, so each
+ * byte is read from memory once and written to memory once.  Chunks
+ * start on crypto unit boundaries, as the block format needs.
+ */
+
+/* this function decrypts buf into an iterator; returns the bytes copied */
+size_t xcfs_decrypt_to_iter(struct inode *inode, char *buf, size_t count,
+			    loff_t pos, struct iov_iter *to)
+{
+	size_t done = 0, len, copied;
+
+	while (done < count) {
+		len = min_t(size_t, count - done, XCFS_FUSE_CHUNK);
+		xcfs_decrypt(inode, buf + done, len, pos + done);
+		copied = copy_to_iter(buf + done, len, to);
+		done += copied;
+		if (copied < len)
+			break;
+	}
+	return done;
+}
+
+/* this function fills buf with encrypted data from an iterator */
+size_t xcfs_encrypt_from_iter(struct inode *inode, char *buf, size_t count,
+			      loff_t pos, struct iov_iter *from)
+{
+	size_t done = 0, len, copied;
+
+	while (done < count) {
+		len = min_t(size_t, count - done, XCFS_FUSE_CHUNK);
+		copied = copy_from_iter(buf + done, len, from);
+		xcfs_encrypt(inode, buf + done, copied, pos + done);
+		done += copied;
+		if (copied < len)
+			break;
+	}
+	return done;
+}
+
+/*
+ * The ctr format xors data with a ChaCha20 keystream.  Block n of the
+ * stream covers file bytes [64n, 64n + 64) and is keyed by the mount key
+ * with the file's nonce and n as its 64-bit counter, so any range of the
+ * stream can be computed on its own, before the data is there.
+ */
+
+/* this function computes keystream block n of an inode */
+static void xcfs_ctr_block(struct inode *inode, u64 n, u8 *stream)
+{
+	u32 state[16];
+
+	xcfs_ctr_state(state, XCFS_SB(inode->i_sb)->ctr_key,
+		       XCFS_I(inode)->hdr.nonce, n);
+	chacha20_block(state, stream);
+}
+
+/* this function fills ks with the keystream for count bytes at pos */
+void xcfs_ctr_keystream(struct inode *inode, u8 *ks, size_t count,
+			loff_t pos)
+{
+	u8 block[CHACHA20_BLOCK_SIZE];
+	size_t skip = pos & (CHACHA20_BLOCK_SIZE - 1);
+	u64 n = pos / CHACHA20_BLOCK_SIZE;
+	size_t len;
+
+	while (count) {
+		len = min_t(size_t, count, CHACHA20_BLOCK_SIZE - skip);
+		if (!skip && len == CHACHA20_BLOCK_SIZE) {
+			xcfs_ctr_block(inode, n, ks);
+		} else {
+			xcfs_ctr_block(inode, n, block);
+			memcpy(ks, block + skip, len);
+		}
+		ks += len;
+		count -= len;
+		skip = 0;
+		n++;
+	}
+	memzero_explicit(block, sizeof(block));
+}
+
+/* this function encrypts or decrypts count bytes at pos in place */
+void xcfs_ctr_xor(struct inode *inode, char *buf, size_t count, loff_t pos)
+{
+	u8 block[CHACHA20_BLOCK_SIZE];
+	size_t skip = pos & (CHACHA20_BLOCK_SIZE - 1);
+	u64 n = pos / CHACHA20_BLOCK_SIZE;
+	size_t len;
+
+	while (count) {
+		len = min_t(size_t, count, CHACHA20_BLOCK_SIZE - skip);
+		xcfs_ctr_block(inode, n, block);
+		crypto_xor((u8 *)buf, block + skip, len);
+		buf += len;
+		count -= len;
+		skip = 0;
+		n++;
+	}
+	memzero_explicit(block, sizeof(block));
+}
+
+/*
+ * The block format transforms each XCFS_BLOCK_SIZE unit of a file as a
+ * whole: unit n covers file bytes [n * XCFS_BLOCK_SIZE, eof) up to one
+ * unit, and every byte of its ciphertext depends on every byte of its
+ * plaintext.  A running sum forwards then one backwards spread each
+ * byte over the unit, and the ctr keystream of the unit's position is
+ * xored over the result.  Changing any byte of a unit, or its length at
+ * eof, therefore means encrypting the whole unit again; the upper page
+ * cache holds units in plaintext between writes, see xcfs_write_begin.
+ *
+ * A full unit of zeros is stored as zeros, so that holes and
+ * preallocated space read back as zeros, as in the sparse format.
+ */
+
+/* this function encrypts or decrypts one unit in place */
+static void xcfs_block_unit(struct inode *inode, u8 *p, size_t len,
+			    loff_t pos, bool encrypt)
+{
+	if (len == XCFS_BLOCK_SIZE && !memchr_inv(p, 0, len))
+		return;
+
+	if (encrypt) {
+		xcfs_block_mix(p, len);
+		xcfs_ctr_xor(inode, (char *)p, len, pos);
+	} else {
+		xcfs_ctr_xor(inode, (char *)p, len, pos);
+		xcfs_block_unmix(p, len);
+	}
+}
+
+/*
+ * this function transforms whole units: pos starts a unit and count ends
+ * either on a unit boundary or at eof
+ */
+void xcfs_block_crypt(struct inode *inode, char *buf, size_t count,
+		      loff_t pos, bool encrypt)
+{
+	size_t len;
+
+	WARN_ON_ONCE(pos & (XCFS_BLOCK_SIZE - 1));
+	while (count) {
+		len = min_t(size_t, count, XCFS_BLOCK_SIZE);
+		xcfs_block_unit(inode, (u8 *)buf, len, pos, encrypt);
+		buf += len;
+		pos += len;
+		count -= len;
+	}
+}
+
+/* this function starts the crypto workers of a mount */
+int xcfs_crypt_init(struct super_block *sb)
+{
+	/* unbound: per-node worker pools, free to use any cpu of the node */
+	XCFS_SB(sb)->crypt_wq = alloc_workqueue("xcfs-crypt",
+						WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!XCFS_SB(sb)->crypt_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/* this function stops the crypto workers of a mount */
+void xcfs_crypt_exit(struct super_block *sb)
+{
+	if (XCFS_SB(sb)->crypt_wq)
+		destroy_workqueue(XCFS_SB(sb)->crypt_wq);
+}
@@ -28,6 +28,9 @@ out:
 /* copied from wrapfs, this code releases a locked dentry */
 static void xcfs_d_release(struct dentry *dentry)
 {
+	/* an NFS alias may die before it gets its lower path */
+	if (!XCFS_D(dentry))
+		return;
 	/* release and reset the lower paths */
 	xcfs_put_reset_lower_path(dentry);
 	free_dentry_private_data(dentry);
@@ -0,0 +1,370 @@
+#include "xcfs.h"
+
+#include <linux/jhash.h>
+
+/*
+ * NFS export.  An xcfs file handle is the lower file system's own handle
+ * with its type in front:
+ *
+ *	fh[0]	lower fh_type
+ *	fh[1..]	lower handle
+ *
+ * so a handle stays good for as long as the lower one does, whether or
+ * not either inode is still in memory.  Decoding goes through the lower
+ * file system's export operations and then xcfs_iget.
+ *
+ * The lower file system knows inodes outside our lower dir too, so every
+ * decoded dentry must be reconnected under it (xcfs_acceptable).  Unless
+ * the lower dir is the root of its file system, handles of non-directories
+ * therefore carry their parent, as with subtree_check.
+ *
+ * Decoding a handle is not cheap: the lower file system may read its
+ * inode from disk and reconnect a directory to the root one name at a
+ * time.  Recently decoded handles are kept, with a reference on their
+ * dentry, in a small direct-mapped cache so that clients hammering the
+ * same handles are answered from memory.  Our unlink, rmdir and rename
+ * drop the entries of an inode losing its last link, so they do not pin
+ * it; one unlinked in the lower file system directly is dropped at its
+ * next lookup.
+ */
+
+struct xcfs_fh_entry {
+	struct dentry *dentry;		/* NULL: empty */
+	u32 hash;
+	int type;			/* lower fh_type */
+	int len;			/* of the lower handle, in words */
+	__u32 fh[XCFS_FH_MAX_WORDS];
+};
+
+struct xcfs_fh_cache {
+	spinlock_t lock;
+	struct xcfs_fh_entry entries[XCFS_FH_CACHE_SIZE];
+};
+
+static u32 xcfs_fh_hash(const __u32 *fh, int len, int type)
+{
+	return jhash2(fh, len, type);
+}
+
+/* this function looks a handle up in the cache, returning a reference */
+static struct dentry *xcfs_fh_cache_get(struct super_block *sb,
+					const __u32 *fh, int len, int type)
+{
+	struct xcfs_fh_cache *cache = XCFS_SB(sb)->fh_cache;
+	struct xcfs_fh_entry *e;
+	struct dentry *dentry = NULL;
+	u32 hash;
+
+	if (!cache || len > XCFS_FH_MAX_WORDS)
+		return NULL;
+	hash = xcfs_fh_hash(fh, len, type);
+	e = &cache->entries[hash & (XCFS_FH_CACHE_SIZE - 1)];
+
+	spin_lock(&cache->lock);
+	if (e->dentry && e->hash == hash && e->type == type &&
+	    e->len == len && !memcmp(e->fh, fh, len * sizeof(*fh)))
+		dentry = dget(e->dentry);
+	spin_unlock(&cache->lock);
+	if (!dentry)
+		return NULL;
+
+	/* an unlinked file must go back to the lower fs to get its ESTALE */
+	if (xcfs_lower_inode(d_inode(dentry))->i_nlink)
+		return dentry;
+
+	spin_lock(&cache->lock);
+	if (e->dentry == dentry)
+		e->dentry = NULL;
+	else
+		dentry = NULL;
+	spin_unlock(&cache->lock);
+	dput(dentry);	/* the reference the cache held */
+	return NULL;
+}
+
+/* this function remembers a decoded handle, evicting its slot's last one */
+static void xcfs_fh_cache_put(struct super_block *sb, const __u32 *fh,
+			      int len, int type, struct dentry *dentry)
+{
+	struct xcfs_fh_cache *cache = XCFS_SB(sb)->fh_cache;
+	struct xcfs_fh_entry *e;
+	struct dentry *old;
+	u32 hash;
+
+	if (!cache || len > XCFS_FH_MAX_WORDS)
+		return;
+	hash = xcfs_fh_hash(fh, len, type);
+	e = &cache->entries[hash & (XCFS_FH_CACHE_SIZE - 1)];
+
+	spin_lock(&cache->lock);
+	old = e->dentry;
+	e->dentry = dget(dentry);
+	e->hash = hash;
+	e->type = type;
+	e->len = len;
+	memcpy(e->fh, fh, len * sizeof(*fh));
+	spin_unlock(&cache->lock);
+	dput(old);
+}
+
+int xcfs_fh_cache_init(struct super_block *sb)
+{
+	struct xcfs_fh_cache *cache;
+
+	cache = kvzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+	spin_lock_init(&cache->lock);
+	XCFS_SB(sb)->fh_cache = cache;
+	return 0;
+}
+
+/* this function drops the cached dentries; called before they are shrunk */
+void xcfs_fh_cache_drop(struct super_block *sb)
+{
+	struct xcfs_fh_cache *cache = XCFS_SB(sb)->fh_cache;
+	struct dentry *dentry;
+	int i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < XCFS_FH_CACHE_SIZE; i++) {
+		spin_lock(&cache->lock);
+		dentry = cache->entries[i].dentry;
+		cache->entries[i].dentry = NULL;
+		spin_unlock(&cache->lock);
+		dput(dentry);
+	}
+}
+
+/* this function drops the cached handles of an inode without links */
+void xcfs_fh_cache_forget(struct inode *inode)
+{
+	struct xcfs_fh_cache *cache = XCFS_SB(inode->i_sb)->fh_cache;
+	struct dentry *dentry;
+	int i;
+
+	if (!cache || xcfs_lower_inode(inode)->i_nlink)
+		return;
+	for (i = 0; i < XCFS_FH_CACHE_SIZE; i++) {
+		spin_lock(&cache->lock);
+		dentry = cache->entries[i].dentry;
+		if (dentry && d_inode(dentry) == inode)
+			cache->entries[i].dentry = NULL;
+		else
+			dentry = NULL;
+		spin_unlock(&cache->lock);
+		dput(dentry);
+	}
+}
+
+void xcfs_fh_cache_free(struct super_block *sb)
+{
+	kvfree(XCFS_SB(sb)->fh_cache);
+	XCFS_SB(sb)->fh_cache = NULL;
+}
+
+/* this function tells whether every lower inode is under our lower dir */
+static bool xcfs_lower_is_whole(struct super_block *sb)
+{
+	struct path lower_root;
+	bool whole;
+
+	xcfs_get_lower_path(sb->s_root, &lower_root);
+	whole = lower_root.dentry == lower_root.dentry->d_sb->s_root;
+	xcfs_put_lower_path(sb->s_root, &lower_root);
+	return whole;
+}
+
+/* this function encodes the lower handle of an inode into an xcfs handle */
+static int xcfs_encode_fh(struct inode *inode, __u32 *fh, int *max_len,
+			  struct inode *parent)
+{
+	struct inode *lower_parent = NULL;
+	struct dentry *alias = NULL, *dir = NULL;
+	int lower_len, type;
+
+	if (*max_len < 2) {
+		*max_len = 2;
+		return FILEID_INVALID;
+	}
+	/* a parent to reconnect through, see the top of this file */
+	if (!parent && !S_ISDIR(inode->i_mode) &&
+	    !xcfs_lower_is_whole(inode->i_sb)) {
+		alias = d_find_alias(inode);
+		if (alias && !IS_ROOT(alias)) {
+			dir = dget_parent(alias);
+			parent = d_inode(dir);
+		}
+	}
+	if (parent)
+		lower_parent = xcfs_lower_inode(parent);
+
+	lower_len = *max_len - 1;
+	type = exportfs_encode_inode_fh(xcfs_lower_inode(inode),
+					(struct fid *)(fh + 1), &lower_len,
+					lower_parent);
+	dput(dir);
+	dput(alias);
+	/* lower_len is what the lower handle needs, even when too small */
+	*max_len = lower_len + 1;
+	if (type < 0 || type == FILEID_INVALID)
+		return FILEID_INVALID;
+	fh[0] = type;
+	return XCFS_FILEID;
+}
+
+/* this function accepts the lower dentries under our lower dir */
+static int xcfs_acceptable(void *context, struct dentry *dentry)
+{
+	struct dentry *lower_root = context;
+
+	return lower_root == lower_root->d_sb->s_root ||
+	       is_subdir(dentry, lower_root);
+}
+
+/* this function decodes a lower handle, under our lower dir only */
+static struct dentry *xcfs_decode_lower(struct path *lower_root,
+					const __u32 *fh, int len, int type)
+{
+	struct dentry *lower_dentry;
+
+	lower_dentry = exportfs_decode_fh(lower_root->mnt, (struct fid *)fh,
+					  len, type, xcfs_acceptable,
+					  lower_root->dentry);
+	if (!lower_dentry)
+		return ERR_PTR(-ESTALE);
+	/* not acceptable: the lower file system knows it, we do not */
+	if (IS_ERR(lower_dentry) && PTR_ERR(lower_dentry) == -EACCES)
+		return ERR_PTR(-ESTALE);
+	return lower_dentry;
+}
+
+/* this function finds the dentry of an xcfs handle */
+static struct dentry *xcfs_fh_to_dentry(struct super_block *sb,
+					struct fid *fid, int fh_len,
+					int fh_type)
+{
+	const __u32 *fh = fid->raw;
+	struct path lower_root;
+	struct path lower_path;
+	struct dentry *dentry;
+	bool ok;
+
+	if (fh_type != XCFS_FILEID || fh_len < 2)
+		return NULL;
+
+	xcfs_get_lower_path(sb->s_root, &lower_root);
+	dentry = xcfs_fh_cache_get(sb, fh + 1, fh_len - 1, fh[0]);
+	if (dentry) {
+		xcfs_get_lower_path(dentry, &lower_path);
+		ok = xcfs_acceptable(lower_root.dentry, lower_path.dentry);
+		xcfs_put_lower_path(dentry, &lower_path);
+		/* moved out of our lower dir since it was cached */
+		if (!ok) {
+			dput(dentry);
+			dentry = ERR_PTR(-ESTALE);
+		}
+		goto out;
+	}
+
+	lower_path.mnt = lower_root.mnt;
+	lower_path.dentry = xcfs_decode_lower(&lower_root, fh + 1, fh_len - 1,
+					      fh[0]);
+	if (IS_ERR(lower_path.dentry)) {
+		dentry = lower_path.dentry;
+		goto out;
+	}
+
+	mntget(lower_path.mnt);
+	dentry = xcfs_obtain_alias(sb, &lower_path);
+	if (!IS_ERR(dentry))
+		xcfs_fh_cache_put(sb, fh + 1, fh_len - 1, fh[0], dentry);
+out:
+	xcfs_put_lower_path(sb->s_root, &lower_root);
+	return dentry;
+}
+
+/* this function finds the parent dentry named by a connectable handle */
+static struct dentry *xcfs_fh_to_parent(struct super_block *sb,
+					struct fid *fid, int fh_len,
+					int fh_type)
+{
+	const struct export_operations *lower_ops;
+	struct path lower_root;
+	struct path lower_path;
+	struct dentry *lower_dir;
+	struct dentry *dentry;
+	__u32 fh[XCFS_FH_MAX_WORDS];
+	int len = XCFS_FH_MAX_WORDS;
+	int type;
+
+	lower_ops = xcfs_lower_super(sb)->s_export_op;
+	if (fh_type != XCFS_FILEID || fh_len < 2 ||
+	    !lower_ops || !lower_ops->fh_to_parent)
+		return NULL;
+
+	lower_dir = lower_ops->fh_to_parent(xcfs_lower_super(sb),
+					    (struct fid *)(fid->raw + 1),
+					    fh_len - 1, fid->raw[0]);
+	if (IS_ERR_OR_NULL(lower_dir))
+		return lower_dir;
+
+	/*
+	 * The parent may come back disconnected; its own handle decodes it
+	 * again, reconnected and checked like any other directory.
+	 */
+	type = exportfs_encode_fh(lower_dir, (struct fid *)fh, &len, 0);
+	dput(lower_dir);
+	if (type < 0 || type == FILEID_INVALID)
+		return ERR_PTR(-ESTALE);
+
+	xcfs_get_lower_path(sb->s_root, &lower_root);
+	lower_path.dentry = xcfs_decode_lower(&lower_root, fh, len, type);
+	lower_path.mnt = mntget(lower_root.mnt);
+	xcfs_put_lower_path(sb->s_root, &lower_root);
+	if (IS_ERR(lower_path.dentry)) {
+		mntput(lower_path.mnt);
+		return lower_path.dentry;
+	}
+	dentry = xcfs_obtain_alias(sb, &lower_path);
+	return dentry;
+}
+
+/* this function finds the parent of a directory, to reconnect it */
+static struct dentry *xcfs_get_parent(struct dentry *child)
+{
+	struct super_block *sb = child->d_sb;
+	const struct export_operations *lower_ops;
+	struct path lower_path;
+	struct dentry *lower_parent;
+
+	xcfs_get_lower_path(child, &lower_path);
+	lower_ops = lower_path.dentry->d_sb->s_export_op;
+	if (!IS_ROOT(lower_path.dentry))
+		lower_parent = dget_parent(lower_path.dentry);
+	else if (lower_ops && lower_ops->get_parent)
+		/* decoded disconnected; ask the lower file system */
+		lower_parent = lower_ops->get_parent(lower_path.dentry);
+	else
+		lower_parent = ERR_PTR(-EACCES);
+	dput(lower_path.dentry);
+	if (IS_ERR(lower_parent)) {
+		mntput(lower_path.mnt);
+		return lower_parent;
+	}
+
+	lower_path.dentry = lower_parent;
+	return xcfs_obtain_alias(sb, &lower_path);
+}
+
+/*
+ * all other funcs are default as defined in exportfs/expfs.c
+ */
+
+const struct export_operations xcfs_export_ops = {
+	.encode_fh	= xcfs_encode_fh,
+	.fh_to_dentry	= xcfs_fh_to_dentry,
+	.fh_to_parent	= xcfs_fh_to_parent,
+	.get_parent	= xcfs_get_parent,
+};
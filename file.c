@@ -8,7 +8,260 @@
 #include <linux/security.h>
 #include <linux/compat.h>
 #include <linux/fs_stack.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
 
+/* this function drops upper page-cache pages made stale by a lower write */
+static void xcfs_invalidate_upper(struct file *file, loff_t pos, size_t count)
+{
+	if (!count || !file->f_mapping->nrpages)
+		return;
+	invalidate_inode_pages2_range(file->f_mapping, pos >> PAGE_SHIFT,
+				      (pos + count - 1) >> PAGE_SHIFT);
+}
+
+static ssize_t xcfs_read_iter(struct kiocb *iocb, struct iov_iter *iter);
+static ssize_t xcfs_write_iter(struct kiocb *iocb, struct iov_iter *iter);
+
+/*
+ * this function writes out and drops the pages of an O_DIRECT write that
+ * went through the page caches, as __generic_file_write_iter does when
+ * direct I/O falls back to buffered
+ */
+static int xcfs_direct_flush(struct file *file, loff_t pos, size_t count)
+{
+	struct address_space *lower_mapping = xcfs_lower_file(file)->f_mapping;
+	loff_t end = pos + count - 1;
+	int err;
+
+	err = filemap_write_and_wait_range(file->f_mapping, pos, end);
+	if (!err)
+		err = filemap_write_and_wait_range(lower_mapping, pos, end);
+	if (err)
+		return err;
+	invalidate_mapping_pages(file->f_mapping, pos >> PAGE_SHIFT,
+				 end >> PAGE_SHIFT);
+	xcfs_stat_add(file_inode(file)->i_sb, lower_dropped,
+		      invalidate_mapping_pages(lower_mapping,
+					       pos >> PAGE_SHIFT,
+					       end >> PAGE_SHIFT));
+	return 0;
+}
+
+/* this function runs a read or write of an O_DIRECT file */
+static ssize_t xcfs_direct_rw(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	loff_t pos = iocb->ki_pos;
+	size_t count = iov_iter_count(iter);
+	bool write = iov_iter_rw(iter) == WRITE;
+	struct xcfs_range range;
+	ssize_t ret;
+	int err;
+
+	if (!count)
+		return 0;
+	/*
+	 * Compressed extents and block units cannot be moved in place, so
+	 * O_DIRECT on them is buffered; a write is on disk and out of both
+	 * page caches before it returns, as it would be without them.
+	 */
+	if (xcfs_has_compression(inode) || xcfs_is_block(inode)) {
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		ret = write ? xcfs_write_iter(iocb, iter) :
+			      xcfs_read_iter(iocb, iter);
+		iocb->ki_flags |= IOCB_DIRECT;
+		if (write && ret > 0) {
+			err = xcfs_direct_flush(file, iocb->ki_pos - ret, ret);
+			if (err)
+				ret = err;
+		}
+		return ret;
+	}
+
+	/* plaintext dirtied through mmap must reach the lower file first */
+	ret = filemap_write_and_wait_range(file->f_mapping, pos,
+					   pos + count - 1);
+	if (ret)
+		return ret;
+
+	if (write)
+		xcfs_range_lock(inode, &range, pos, pos + count - 1);
+	ret = xcfs_direct_IO(iocb, iter);
+	if (write && ret > 0) {
+		xcfs_size_extend(inode, pos + ret);
+		fsstack_copy_attr_times(inode, file_inode(lower_file));
+	}
+	if (write)
+		xcfs_range_unlock(inode, &range);
+	if (ret <= 0)
+		return ret;
+
+	iocb->ki_pos += ret;
+	if (write) {
+		xcfs_invalidate_upper(file, pos, ret);
+	} else {
+		fsstack_copy_attr_atime(inode, file_inode(lower_file));
+	}
+	return ret;
+}
+
+/* this function turns read(2)/write(2) into an iterator based call */
+static ssize_t xcfs_sync_rw(struct file *file, char __user *ubuf,
+			    size_t count, loff_t *ppos, int rw,
+			    ssize_t (*rw_iter)(struct kiocb *, struct iov_iter *))
+{
+	struct iovec iov;
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	ret = import_single_range(rw, ubuf, count, &iov, &iter);
+	if (ret)
+		return ret;
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_pos = *ppos;
+	ret = rw_iter(&kiocb, &iter);
+	*ppos = kiocb.ki_pos;
+	return ret;
+}
+
+/*
+ * this function keeps written ciphertext from staying in the lower cache.
+ * When a write completes an XCFS_DROP_WINDOW, the windows just completed
+ * start writeback as a whole, and the window before them, which has had a
+ * window's worth of writing to get to disk, is dropped along with
+ * whatever of them is already clean.  Writes that complete no window
+ * leave their pages to lower writeback, to be batched, but still hand
+ * them to invalidate_mapping_pages: the clean ones go now, and the dirty
+ * ones are deactivated, to be reclaimed first once written.  fsync drops
+ * what it made clean, see xcfs_fsync.
+ */
+static void xcfs_drop_behind(struct file *file, loff_t pos, size_t count)
+{
+	struct address_space *lower_mapping = xcfs_lower_file(file)->f_mapping;
+	loff_t first = round_down(pos, XCFS_DROP_WINDOW);
+	loff_t last = round_down(pos + count, XCFS_DROP_WINDOW);
+	loff_t start = pos;
+	unsigned long dropped;
+
+	if (!count || !xcfs_use_upper_cache(file_inode(file)))
+		return;
+
+	if (first != last) {
+		filemap_fdatawrite_range(lower_mapping, first, last - 1);
+		start = max_t(loff_t, first - XCFS_DROP_WINDOW, 0);
+	}
+	dropped = invalidate_mapping_pages(lower_mapping, start >> PAGE_SHIFT,
+			(pos + count - 1) >> PAGE_SHIFT);
+	xcfs_stat_add(file_inode(file)->i_sb, lower_dropped, dropped);
+}
+
+/* this function waits for a write on a writeback=sync mount */
+static int xcfs_write_sync(struct file *file, loff_t pos, size_t count)
+{
+	struct inode *inode = file_inode(file);
+	int err;
+
+	if (READ_ONCE(XCFS_SB(inode->i_sb)->writeback) != XCFS_WB_SYNC ||
+	    !count)
+		return 0;
+	/* xcfs_fsync also writes back what is still in the page cache */
+	err = vfs_fsync_range(file, pos, pos + count - 1, 1);
+	return err;
+}
+
+/*
+ * this function writes through the compression stage, see compress.c,
+ * copying count bytes of plaintext in through buf, size bytes at a time
+ */
+static ssize_t xcfs_write_compressed(struct file *file, char *buf,
+				     size_t size, size_t count, loff_t *ppos,
+				     struct iov_iter *from)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	loff_t start, pos;
+	size_t len, copied;
+	ssize_t done = 0, ret = 0;
+
+	inode_lock(inode);
+	/* the lower file is not O_APPEND, extents are rewritten in place */
+	pos = (file->f_flags & O_APPEND) ?
+		i_size_read(file_inode(lower_file)) : *ppos;
+	start = pos;
+	while (done < count) {
+		len = min(size, count - done);
+		copied = copy_from_iter(buf, len, from);
+		ret = -EFAULT;
+		if (!copied)
+			break;
+		ret = xcfs_compress_write(inode, lower_file, buf, copied, pos);
+		if (ret < (ssize_t)copied)
+			iov_iter_revert(from, copied - max_t(ssize_t, ret, 0));
+		if (ret <= 0)
+			break;
+		done += ret;
+		pos += ret;
+		/* a fault part way writes what came before it */
+		if (ret < len)
+			break;
+	}
+	if (done) {
+		*ppos = pos;
+		xcfs_invalidate_upper(file, start, done);
+		xcfs_drop_behind(file, start, done);
+		fsstack_copy_inode_size(inode, file_inode(lower_file));
+		fsstack_copy_attr_times(inode, file_inode(lower_file));
+	}
+	inode_unlock(inode);
+	return done ? done : ret;
+}
+
+/*
+ * this function reads ciphertext through the lower page cache into a
+ * small buffer, which stays in the cache while it is decrypted from
+ * there straight into the iterator
+ */
+static ssize_t xcfs_read_lower(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	loff_t pos = iocb->ki_pos;
+	ssize_t done = 0, ret = 0;
+	size_t len, copied;
+	char *buf;
+
+	buf = kmalloc(XCFS_READ_BOUNCE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while (iov_iter_count(to)) {
+		len = min_t(size_t, iov_iter_count(to), XCFS_READ_BOUNCE);
+		ret = kernel_read(lower_file, pos, buf, len);
+		if (ret <= 0)
+			break;
+		xcfs_stat_add(inode->i_sb, lower_read_bytes, ret);
+		copied = xcfs_decrypt_to_iter(inode, buf, ret, pos, to);
+		done += copied;
+		pos += copied;
+		if (copied < ret) {
+			ret = -EFAULT;
+			break;
+		}
+		/* eof */
+		if (ret < len)
+			break;
+	}
+
+	iocb->ki_pos = pos;
+	fsstack_copy_attr_atime(inode, file_inode(lower_file));
+	kfree(buf);
+	return done ? done : ret;
+}
 
 /* copied from wrapfs, and modified */
 /* this function reads from a file, decrypts */
@@ -16,59 +269,212 @@
 static ssize_t xcfs_read(struct file *file, char __user *ubuf, 
         size_t count, loff_t *ppos) 
 {
-	struct file *lower_file;
-	char* buf = NULL;
-	long retval = 0;
-    	int err = 0;
-	struct dentry *dentry = file->f_path.dentry;
+	long retval;
 
 	printk("xcfs_read\n");
 
-	//if(count > (file->f_inode->i_size - *ppos))
-	//{
-	//	count = file->f_inode->i_size - *ppos;
-	//}
+	/* one iterator based path for read(2), readv(2) and aio */
+	retval = xcfs_sync_rw(file, ubuf, count, ppos, READ, xcfs_read_iter);
 
-	lower_file = xcfs_lower_file(file);
-	retval = vfs_read(lower_file, ubuf, count, ppos);
-	if(retval >= 0)	{
-		fsstack_copy_attr_atime(dentry->d_inode, 
-					file_inode(lower_file));
-	}
-	err = retval;
+	printk("xcfs_read: retval = %ld\n", retval);
+	return retval;
+}
 
+/* splits a write into runs that end on page boundaries */
+static size_t xcfs_page_chunk(loff_t pos, size_t left)
+{
+	return min_t(size_t, left, PAGE_SIZE - (pos & (PAGE_SIZE - 1)));
+}
 
- 
-   	/* decryption */
-	buf = kcalloc(count, sizeof(char), GFP_KERNEL);
-	if(buf == NULL) {
-		printk("xcfs_read: allocation failed for buf\n");
-		return -1;
-	}
+/* whole pages of zero ciphertext are stored as holes */
+static bool xcfs_hole_chunk(const char *buf, size_t len)
+{
+	return len == PAGE_SIZE && !memchr_inv(buf, 0, PAGE_SIZE);
+}
 
-    	retval = copy_from_user(buf, ubuf, count);
+/* this function turns a range of the lower file into a hole */
+static int xcfs_punch_lower(struct file *lower_file, loff_t pos, size_t len)
+{
+	mm_segment_t old_fs;
+	loff_t wpos = pos;
+	ssize_t ret;
+
+	/* past the lower eof there is nothing to punch */
+	if (pos >= i_size_read(file_inode(lower_file)))
+		return 0;
+	ret = vfs_fallocate(lower_file,
+			    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			    pos, len);
+	if (ret != -EOPNOTSUPP)
+		return ret;
+
+	/* no hole punching below us: store the zeros */
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (wpos < pos + len) {
+		ret = vfs_write(lower_file,
+				(const char __user *)page_address(ZERO_PAGE(0)),
+				min_t(size_t, PAGE_SIZE, pos + len - wpos),
+				&wpos);
+		if (ret <= 0)
+			break;
+	}
+	set_fs(old_fs);
+	return ret < 0 ? ret : 0;
+}
 
-	if(retval) {
-		printk("xcfs_read: failed to copy %ld from user\n", retval);
-		retval = -1;
-		goto xcfs_read_cleanup;
+/*
+ * this function writes sparse-format ciphertext to the lower file,
+ * leaving holes where whole pages are zero.  Must be called with
+ * KERNEL_DS set, like the vfs_write it replaces.
+ */
+static ssize_t xcfs_write_sparse(struct file *lower_file, const char *buf,
+				 size_t count, loff_t *ppos)
+{
+	loff_t pos = *ppos, end = *ppos + count;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	while (done < count) {
+		loff_t start = pos + done;
+		size_t run = 0, len;
+		bool hole;
+
+		/* gather consecutive chunks of the same kind */
+		len = xcfs_page_chunk(start, count - done);
+		hole = xcfs_hole_chunk(buf + done, len);
+		do {
+			run += len;
+			if (done + run == count)
+				break;
+			len = xcfs_page_chunk(start + run, count - done - run);
+		} while (xcfs_hole_chunk(buf + done + run, len) == hole);
+
+		if (hole) {
+			ret = xcfs_punch_lower(lower_file, start, run);
+			if (ret)
+				break;
+		} else {
+			ret = vfs_write(lower_file,
+					(const char __user *)buf + done,
+					run, &start);
+			if (ret < 0)
+				break;
+			if (ret < run) {
+				done += ret;
+				break;
+			}
+		}
+		done += run;
 	}
-	
-	xcfs_decrypt(buf, count);
 
-	retval = copy_to_user(ubuf, buf, count);
-	if(retval) {
-		printk("xcfs_read: failed to copy %ld to user\n", retval);
-		retval = -1;
-		goto xcfs_read_cleanup;
+	/* a trailing hole still has to move the lower eof */
+	if (done == count && end > i_size_read(file_inode(lower_file))) {
+		ret = vfs_truncate(&lower_file->f_path, end);
+		if (ret)
+			return ret;
 	}
-	retval = err; 
 
-	printk("xcfs_read: retval = %ld\n", retval);
-xcfs_read_cleanup:
-	kfree(buf);
+	if (!done)
+		return ret;
+	*ppos = pos + done;
+	return done;
+}
 
-	return retval;
+/*
+ * this function encrypts count bytes of plaintext from an iterator and
+ * writes them to the lower file at *ppos, or at eof for O_APPEND, through
+ * buf, size bytes at a time; the iterator is left past what was written
+ */
+static ssize_t xcfs_write_lower(struct file *file, char *buf, size_t size,
+				size_t count, loff_t *ppos,
+				struct iov_iter *from)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	struct xcfs_range range;
+	mm_segment_t old_fs;
+	loff_t start, pos = *ppos;
+	size_t len, copied;
+	ssize_t done = 0, ret = 0;
+	int err = 0;
+	bool fused;
+
+	if (!count)
+		return 0;
+	if (xcfs_has_compression(inode))
+		return xcfs_write_compressed(file, buf, size, count, ppos,
+					     from);
+
+	/*
+	 * A buffer encrypted by the caller alone is copied in and encrypted
+	 * a chunk at a time, see xcfs_encrypt_from_iter, and each chunk is
+	 * written while still in cache; crypto workers cannot reach user
+	 * memory, so bigger ones are copied in first.
+	 */
+	fused = xcfs_crypt_inline(inode, count);
+
+	/*
+	 * Writers to disjoint ranges encrypt and write side by side.  An
+	 * append holds everything past eof, so a position-dependent
+	 * transform knows where its data lands.  The whole request is
+	 * locked at once, however many pieces of buf it takes.
+	 */
+	if (file->f_flags & O_APPEND)
+		pos = xcfs_range_lock_eof(inode, &range);
+	else
+		xcfs_range_lock(inode, &range, pos, pos + count - 1);
+	start = pos;
+
+	while (done < count) {
+		len = min(size, count - done);
+		if (fused) {
+			copied = xcfs_encrypt_from_iter(inode, buf, len, pos,
+							from);
+		} else {
+			copied = copy_from_iter(buf, len, from);
+			xcfs_encrypt_buf(inode, buf, copied, pos);
+		}
+		ret = -EFAULT;
+		if (!copied)
+			break;
+
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		if (xcfs_has_holes(inode) && !(lower_file->f_flags & O_APPEND))
+			ret = xcfs_write_sparse(lower_file, buf, copied, &pos);
+		else
+			ret = vfs_write(lower_file, buf, copied, &pos);
+		set_fs(old_fs);
+		if (ret < (ssize_t)copied)
+			iov_iter_revert(from, copied - max_t(ssize_t, ret, 0));
+		if (ret <= 0)
+			break;
+		if (!err)
+			err = xcfs_csum_update(inode, lower_file, pos - ret,
+					       buf, ret);
+		xcfs_stat_add(inode->i_sb, lower_write_bytes, ret);
+		done += ret;
+		/* a fault part way writes what came before it */
+		if (ret < len)
+			break;
+	}
+	if (done) {
+		/* what was recorded is stored even if not all of it was */
+		err = xcfs_csum_flush(inode) ?: err;
+		xcfs_size_extend(inode, pos);
+		fsstack_copy_attr_times(inode, file_inode(lower_file));
+	}
+	xcfs_range_unlock(inode, &range);
+
+	if (!done)
+		return ret;
+	*ppos = pos;
+	/* page-cache invalidation may wait on writeback, so unlocked */
+	xcfs_invalidate_upper(file, start, done);
+	xcfs_drop_behind(file, start, done);
+	/* data without its checksums would not read back */
+	return err ?: done;
 }
 
 /* copied from wrapfs with modification */
@@ -77,46 +483,35 @@ xcfs_read_cleanup:
 static ssize_t xcfs_write(struct file *file, const char __user *ubuf, 
         size_t count, loff_t *ppos) 
 {
-	struct file *lower_file;
-	long retval = 0;
-	char *buf = NULL;
-	struct dentry *dentry = file->f_path.dentry;
-	mm_segment_t old_fs = get_fs();
-	set_fs(KERNEL_DS);
-        
-    	/* encryption */
-	buf = kcalloc(count, sizeof(char), GFP_KERNEL);
-	if(buf == NULL) {
-		printk("xcfs_write: allocation failed for buf\n");
-		return -1;
-	}
-    
-	retval = copy_from_user(buf, ubuf, count);
+	long retval;
 
-	if(retval) {
-		printk("xcfs_write: failed to copy %ld from user\n", retval);
-		retval = -1;
-		goto xcfs_write_cleanup;
-	}
-	
-	xcfs_encrypt(buf, count);
+	/* one iterator based path for write(2), writev(2) and aio */
+	retval = xcfs_sync_rw(file, (char __user *)ubuf, count, ppos, WRITE,
+			      xcfs_write_iter);
 
-	lower_file = xcfs_lower_file(file);
-	retval = vfs_write(lower_file, buf, count, ppos);
-	if(retval >= 0) {
- 	       	fsstack_copy_inode_size(dentry->d_inode,
-					file_inode(lower_file));
-		fsstack_copy_attr_times(dentry->d_inode,
-					file_inode(lower_file));
-	}
-	
 	printk("xcfs_write: retval: %ld\n", retval);
+	return retval;
+}
 
-	xcfs_write_cleanup:
-    	kfree(buf);
-	set_fs(old_fs);
+/* what xcfs_filldir passes the entries of the top directory on to */
+struct xcfs_getdents_callback {
+	struct dir_context ctx;
+	struct dir_context *caller;
+};
 
-	return retval;
+/* this function passes on every entry of the top directory but our own */
+static int xcfs_filldir(struct dir_context *ctx, const char *name,
+			int namelen, loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct xcfs_getdents_callback *buf =
+		container_of(ctx, struct xcfs_getdents_callback, ctx);
+
+	buf->caller->pos = buf->ctx.pos;
+	if (namelen == sizeof(XCFS_META_DIR) - 1 &&
+	    !memcmp(name, XCFS_META_DIR, namelen))
+		return 0;
+	return buf->caller->actor(buf->caller, name, namelen, offset, ino,
+				  d_type);
 }
 
 /* copied from wrapfs */
@@ -126,9 +521,20 @@ static int xcfs_readdir(struct file *file, struct dir_context *ctx)
 	int err;
 	struct file *lower_file = NULL;
 	struct dentry *dentry = file->f_path.dentry;
+	struct xcfs_getdents_callback buf = {
+		.ctx.actor = xcfs_filldir,
+		.caller = ctx,
+	};
 
 	lower_file = xcfs_lower_file(file);
-	err = iterate_dir(lower_file, ctx);
+	/* the top directory holds our own, see integrity.c */
+	if (IS_ROOT(dentry)) {
+		buf.ctx.pos = ctx->pos;
+		err = iterate_dir(lower_file, &buf.ctx);
+		ctx->pos = buf.ctx.pos;
+	} else {
+		err = iterate_dir(lower_file, ctx);
+	}
 	file->f_pos = lower_file->f_pos;
 	if (err >= 0) {		/* copy the atime */
 		fsstack_copy_attr_atime(d_inode(dentry),
@@ -253,6 +659,203 @@ out:
 	return err;
 }
 
+/*
+ * Opens of a regular file share lower files: an open reuses a lower file
+ * of the same inode opened by the same credentials, through the same
+ * lower dentry and with the same flags, instead of going through
+ * dentry_open and its permission and LSM checks again.  Lower reads and
+ * writes always pass the upper position, so sharing the lower f_pos does
+ * not matter; directories, which read from the lower f_pos, never share.
+ * A read-only lower file is kept for a while after its last close, for
+ * the next open; writable ones are closed at once so that they do not
+ * hold off execve with ETXTBSY.
+ */
+struct xcfs_lower_file {
+	struct list_head list;
+	struct file *file;
+	int flags;
+	int count;		/* xcfs files using it, 0: idle */
+};
+
+static struct kmem_cache *xcfs_file_info_cachep;
+
+/* this function finds a lower file to share, with a use counted */
+static struct xcfs_lower_file *xcfs_find_lower_file(struct inode *inode,
+						    struct path *lower_path,
+						    int flags)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct xcfs_lower_file *lf;
+
+	list_for_each_entry(lf, &info->lower_files, list) {
+		if (lf->flags == flags &&
+		    lf->file->f_cred == current_cred() &&
+		    lf->file->f_path.dentry == lower_path->dentry) {
+			lf->count++;
+			return lf;
+		}
+	}
+	return NULL;
+}
+
+/* this function opens the lower file of an upper open, or shares one */
+static struct xcfs_lower_file *xcfs_get_lower_file(struct inode *inode,
+						   struct path *lower_path,
+						   int flags)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct xcfs_lower_file *lf, *new;
+	struct file *lower_file;
+
+	/* open(2)-only flags do nothing to an open file */
+	flags &= ~(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC | O_CLOEXEC);
+	spin_lock(&info->lower_lock);
+	lf = xcfs_find_lower_file(inode, lower_path, flags);
+	spin_unlock(&info->lower_lock);
+	if (lf)
+		return lf;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return ERR_PTR(-ENOMEM);
+	lower_file = dentry_open(lower_path, flags, current_cred());
+	if (IS_ERR(lower_file)) {
+		kfree(new);
+		return ERR_CAST(lower_file);
+	}
+	new->file = lower_file;
+	new->flags = flags;
+	new->count = 1;
+
+	spin_lock(&info->lower_lock);
+	lf = xcfs_find_lower_file(inode, lower_path, flags);
+	if (!lf)
+		list_add(&new->list, &info->lower_files);
+	spin_unlock(&info->lower_lock);
+	if (lf) {
+		/* another open got there first */
+		fput(lower_file);
+		kfree(new);
+		return lf;
+	}
+	return new;
+}
+
+/* this function lets go of a shared lower file at an upper release */
+static void xcfs_put_lower_file(struct inode *inode,
+				struct xcfs_lower_file *lf)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct xcfs_lower_file *idle, *drop = NULL;
+	int nr_idle = 0;
+
+	spin_lock(&info->lower_lock);
+	if (--lf->count == 0) {
+		drop = lf;
+		if ((lf->flags & O_ACCMODE) == O_RDONLY) {
+			/* keep it for the next open, within bounds */
+			list_for_each_entry(idle, &info->lower_files, list)
+				if (!idle->count)
+					nr_idle++;
+			if (nr_idle <= XCFS_LOWER_IDLE_MAX)
+				drop = NULL;
+		}
+		if (drop)
+			list_del(&drop->list);
+	}
+	spin_unlock(&info->lower_lock);
+	if (drop) {
+		fput(drop->file);
+		kfree(drop);
+	}
+}
+
+/* this function closes the idle lower files of an inode being evicted */
+void xcfs_put_lower_files(struct inode *inode)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct xcfs_lower_file *lf, *next;
+
+	/* no upper file is open any more, all of them are idle */
+	list_for_each_entry_safe(lf, next, &info->lower_files, list) {
+		WARN_ON(lf->count);
+		list_del(&lf->list);
+		fput(lf->file);
+		kfree(lf);
+	}
+}
+
+/*
+ * this function keeps a writable lower file that can write pages back
+ * at their own offsets, for writeback, which has no file of its own
+ */
+static void xcfs_set_wb_file(struct inode *inode, struct file *lower_file)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+
+	spin_lock(&info->lower_lock);
+	if (!info->wb_file)
+		info->wb_file = get_file(lower_file);
+	spin_unlock(&info->lower_lock);
+}
+
+/* this function returns the writeback lower file with a reference, or NULL */
+struct file *xcfs_get_wb_file(struct inode *inode)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct file *lower_file;
+
+	spin_lock(&info->lower_lock);
+	lower_file = info->wb_file;
+	if (lower_file)
+		get_file(lower_file);
+	spin_unlock(&info->lower_lock);
+	return lower_file;
+}
+
+/*
+ * this function lets go of the writeback lower file at the last writable
+ * release, once the dirty pages are written back, so that the lower
+ * inode is not left open for write (and exec of it refused with ETXTBSY)
+ * while the upper inode stays cached.  A shared writable mapping holds
+ * its upper file, so nothing is dirtied after this but by a new open,
+ * which sets a writeback file of its own.
+ */
+static void xcfs_put_wb_file(struct inode *inode)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct file *lower_file = NULL;
+
+	/* the releasing file still counts as a writer */
+	if (atomic_read(&inode->i_writecount) != 1 || !info->wb_file)
+		return;
+	filemap_write_and_wait(inode->i_mapping);
+
+	spin_lock(&info->lower_lock);
+	if (atomic_read(&inode->i_writecount) == 1) {
+		lower_file = info->wb_file;
+		info->wb_file = NULL;
+	}
+	spin_unlock(&info->lower_lock);
+	if (lower_file)
+		fput(lower_file);
+}
+
+int xcfs_init_file_cache(void)
+{
+	xcfs_file_info_cachep = kmem_cache_create("xcfs_file_info",
+						  sizeof(struct xcfs_file_info),
+						  0, 0, NULL);
+	if (!xcfs_file_info_cachep)
+		return -ENOMEM;
+	return 0;
+}
+
+void xcfs_destroy_file_cache(void)
+{
+	kmem_cache_destroy(xcfs_file_info_cachep);
+}
+
 /* coped from wrapfs */
 /* this function handles how an inode is opened */
 /* open */
@@ -260,7 +863,11 @@ static int xcfs_open(struct inode *inode, struct file *file)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
+	struct xcfs_lower_file *lf = NULL;
 	struct path lower_path;
+	unsigned int ra_kb;
+	bool rmw;
+	int flags;
 
 	/* don't open unhashed/deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -268,30 +875,57 @@ static int xcfs_open(struct inode *inode, struct file *file)
 		goto out_err;
 	}
 
+	/* data in a format we do not know must not be misread */
+	if (xcfs_format(inode) == XCFS_FMT_UNKNOWN) {
+		err = -EOPNOTSUPP;
+		goto out_err;
+	}
+
 	file->private_data =
-		kzalloc(sizeof(struct xcfs_file_info), GFP_KERNEL);
+		kmem_cache_zalloc(xcfs_file_info_cachep, GFP_KERNEL);
 	if (!XCFS_F(file)) {
 		err = -ENOMEM;
 		goto out_err;
 	}
 
-	/* open lower object and link xcfs's file struct to lower's */
+	/*
+	 * open lower object and link xcfs's file struct to lower's.
+	 * Compressed extents and block units are read back and rewritten
+	 * in place, so their lower file is never write-only, O_APPEND or
+	 * O_DIRECT.
+	 */
+	flags = file->f_flags;
+	rmw = xcfs_has_compression(inode) || xcfs_is_block(inode);
+	if (rmw)
+		flags &= ~(O_APPEND | O_DIRECT);
+	if (rmw && (file->f_mode & FMODE_WRITE))
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
 	xcfs_get_lower_path(file->f_path.dentry, &lower_path);
-	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
+	if (S_ISREG(inode->i_mode)) {
+		lf = xcfs_get_lower_file(inode, &lower_path, flags);
+		lower_file = IS_ERR(lf) ? ERR_CAST(lf) : lf->file;
+	} else {
+		lower_file = dentry_open(&lower_path, flags, current_cred());
+	}
 	path_put(&lower_path);
 	if (IS_ERR(lower_file)) {
 		err = PTR_ERR(lower_file);
-		lower_file = xcfs_lower_file(file);
-		if (lower_file) {
-			xcfs_set_lower_file(file, NULL);
-			fput(lower_file); /* fput calls dput for lower_dentry */
-		}
 	} else {
 		xcfs_set_lower_file(file, lower_file);
+		XCFS_F(file)->shared = lf;
+		/* readahead_kb applies to files opened after it is set */
+		ra_kb = READ_ONCE(XCFS_SB(inode->i_sb)->readahead_kb);
+		if (ra_kb) {
+			file->f_ra.ra_pages = ra_kb >> (PAGE_SHIFT - 10);
+			lower_file->f_ra.ra_pages = file->f_ra.ra_pages;
+		}
+		if ((file->f_mode & FMODE_WRITE) &&
+		    !(flags & (O_APPEND | O_DIRECT)))
+			xcfs_set_wb_file(inode, lower_file);
 	}
 
 	if (err)
-		kfree(XCFS_F(file));
+		kmem_cache_free(xcfs_file_info_cachep, XCFS_F(file));
 	else
 		fsstack_copy_attr_all(inode, xcfs_lower_inode(inode));
 out_err:
@@ -311,6 +945,8 @@ static int xcfs_flush(struct file *file, fl_owner_t id)
 		filemap_write_and_wait(file->f_mapping);
 		err = lower_file->f_op->flush(lower_file, id);
 	}
+	if(!err && (file->f_mode & FMODE_WRITE))
+		err = xcfs_csum_flush(file_inode(file));
 
 	return err;
 }
@@ -322,13 +958,19 @@ static int xcfs_release(struct inode *inode, struct file *file)
 {
 	struct file *lower_file = NULL;
 
+	if ((file->f_mode & FMODE_WRITE) && S_ISREG(inode->i_mode))
+		xcfs_put_wb_file(inode);
+
 	lower_file = xcfs_lower_file(file);
-	if(lower_file) {
+	if (XCFS_F(file)->shared) {
+		xcfs_set_lower_file(file, NULL);
+		xcfs_put_lower_file(inode, XCFS_F(file)->shared);
+	} else if(lower_file) {
 		xcfs_set_lower_file(file, NULL);
 		fput(lower_file);
 	}	
 
-	kfree(XCFS_F(file));
+	kmem_cache_free(xcfs_file_info_cachep, XCFS_F(file));
 	return 0;
 }
 
@@ -343,13 +985,27 @@ static int xcfs_fsync(struct file *file, loff_t start, loff_t end,
 	struct path lower_path;
 	struct dentry *dentry = file->f_path.dentry;
 
-	err = __generic_file_fsync(file, start, end, datasync);
+	/*
+	 * Only the dirty upper pages in the range go down, encrypted in
+	 * runs by xcfs_writepages; the upper inode itself has nothing to
+	 * write, its attributes live in the lower one.
+	 */
+	err = filemap_write_and_wait_range(file->f_mapping, start, end);
 	if (err) {
 		goto out;
     }
 	lower_file = xcfs_lower_file(file);
 	xcfs_get_lower_path(dentry, &lower_path);
-	err = vfs_fsync_range(lower_file, start, end, datasync);
+	/* the sidecar first, the root in the lower file's header after */
+	err = xcfs_csum_sync(file_inode(file), datasync);
+	if (!err)
+		err = vfs_fsync_range(lower_file, start, end, datasync);
+	/* the range is clean now, whatever drop-behind left of it can go */
+	if (!err && xcfs_use_upper_cache(file_inode(file)))
+		xcfs_stat_add(dentry->d_sb, lower_dropped,
+			      invalidate_mapping_pages(lower_file->f_mapping,
+						       start >> PAGE_SHIFT,
+						       end >> PAGE_SHIFT));
 	xcfs_put_lower_path(dentry, &lower_path);
 out:
 	return err;
@@ -383,69 +1039,328 @@ static loff_t xcfs_llseek(struct file* file, loff_t offset, int whence)
     return vfs_llseek(lower_file, offset, whence);
 }
 
-/* copied from wrapfs */
+/* copied from wrapfs and modified */
 /* defines behavior for reading a interator */
 /* read iter */ 
 static ssize_t xcfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
+	struct file *file = iocb->ki_filp;
+
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return xcfs_direct_rw(iocb, iter);
+	/* plaintext comes from the upper page cache, see xcfs_readpage */
+	if (xcfs_use_upper_cache(file_inode(file)))
+		return generic_file_read_iter(iocb, iter);
+	if (!iov_iter_count(iter))
+		return 0;
+	return xcfs_read_lower(iocb, iter);
+}
+
+/* copied from wrapfs and modified */
+/* defines a behavior for writing to an iterator */
+/* write iter */
+static ssize_t xcfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct file *file = iocb->ki_filp;
+	size_t count = iov_iter_count(iter);
+	size_t size;
+	ssize_t ret;
+	bool fused;
+	char *buf;
 	int err;
-	struct file *file = iocb->ki_filp, *lower_file;
 
-	lower_file = xcfs_lower_file(file);
-	if (!lower_file->f_op->read_iter) {
-		err = -EINVAL;
-		goto out;
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return xcfs_direct_rw(iocb, iter);
+
+	/* block units are rewritten whole, from the upper page cache */
+	if (xcfs_is_block(file_inode(file))) {
+		ret = generic_file_write_iter(iocb, iter);
+		if (ret > 0) {
+			err = xcfs_write_sync(file, iocb->ki_pos - ret, ret);
+			if (err)
+				ret = err;
+		}
+		return ret;
 	}
+	if (!count)
+		return 0;
 
-	get_file(lower_file); /* prevent lower_file from being released */
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->read_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
-	/* update upper inode atime as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
-		fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
-    }
-out:
-	return err;
+	/*
+	 * The ciphertext copy is charged to the writer's memcg.  A fused
+	 * write encrypts and writes one XCFS_FUSE_CHUNK at a time, so that
+	 * is all the buffer it needs.
+	 */
+	fused = xcfs_crypt_inline(file_inode(file), count) &&
+		!xcfs_has_compression(file_inode(file));
+	size = min_t(size_t, count,
+		     fused ? XCFS_FUSE_CHUNK : XCFS_WRITE_CHUNK);
+	buf = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+	if (!buf)
+		return -ENOMEM;
+	ret = xcfs_write_lower(file, buf, size, count, &iocb->ki_pos, iter);
+	kvfree(buf);
+	if (ret > 0) {
+		err = xcfs_write_sync(file, iocb->ki_pos - ret, ret);
+		if (err)
+			ret = err;
+	}
+	return ret;
 }
 
-/* copied from wrapfs */
-/* defines a behavior for writing to an iterator */
-/* write iter */
-static ssize_t xcfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+/* this function feeds decrypted upper page-cache pages into a pipe */
+/* splice read */
+static ssize_t xcfs_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
 {
-	int err = 0;
-	struct file *file = iocb->ki_filp, *lower_file;
-	
-	lower_file = xcfs_lower_file(file);
-	if(!lower_file->f_op->write_iter)
-	{
-		return -EINVAL;
+	struct iov_iter to;
+	struct kiocb kiocb;
+	int idx;
+	ssize_t ret;
+
+	/*
+	 * Same as generic_file_splice_read, but always through the upper
+	 * mapping: it holds plaintext, so the pipe takes references to the
+	 * cached pages instead of copying them, and ->readpage decrypts
+	 * whatever is not cached yet.
+	 */
+	iov_iter_pipe(&to, ITER_PIPE | READ, pipe, len);
+	idx = to.idx;
+	init_sync_kiocb(&kiocb, in);
+	kiocb.ki_pos = *ppos;
+	ret = generic_file_read_iter(&kiocb, &to);
+	if (ret > 0) {
+		*ppos = kiocb.ki_pos;
+		file_accessed(in);
+	} else if (ret < 0) {
+		to.idx = idx;
+		to.iov_offset = 0;
+		iov_iter_advance(&to, 0); /* to free what was emitted */
+		/* splice callers expect -EAGAIN rather than -EFAULT */
+		if (ret == -EFAULT)
+			ret = -EAGAIN;
 	}
+	return ret;
+}
 
-	get_file(lower_file);
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->write_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
+/* state shared by the splice write actor */
+struct xcfs_splice_ctx {
+	struct inode *inode;
+	struct file *lower_file;
+	char *crypt;	/* one page of ciphertext */
+};
 
-	if(err >= 0 || err == -EIOCBQUEUED)
-	{
-		fsstack_copy_inode_size(file->f_path.dentry->d_inode,
-					file_inode(lower_file));
-		fsstack_copy_attr_times(file->f_path.dentry->d_inode,
-					file_inode(lower_file));
+/* this function encrypts one pipe buffer and writes it to the lower file */
+static int xcfs_pipe_to_lower(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct xcfs_splice_ctx *ctx = sd->u.data;
+	struct xcfs_range range;
+	char *data;
+	int ret, err;
+
+	/* pipe buffers never span more than a page */
+	data = kmap(buf->page);
+	memcpy(ctx->crypt, data + buf->offset, sd->len);
+	kunmap(buf->page);
+
+	if (xcfs_has_compression(ctx->inode))
+		return xcfs_compress_write(ctx->inode, ctx->lower_file,
+					   ctx->crypt, sd->len, sd->pos);
+
+	xcfs_range_lock(ctx->inode, &range, sd->pos, sd->pos + sd->len - 1);
+	xcfs_encrypt(ctx->inode, ctx->crypt, sd->len, sd->pos);
+	ret = kernel_write(ctx->lower_file, ctx->crypt, sd->len, sd->pos);
+	if (ret > 0) {
+		err = xcfs_csum_update(ctx->inode, ctx->lower_file, sd->pos,
+				       ctx->crypt, ret);
+		if (err)
+			ret = err;
 	}
-	
-	return err;
-}	
+	xcfs_range_unlock(ctx->inode, &range);
+	return ret;
+}
+
+/* this function encrypts pipe buffers page by page into the lower file */
+/* splice write */
+static ssize_t xcfs_splice_write(struct pipe_inode_info *pipe,
+				 struct file *out, loff_t *ppos, size_t len,
+				 unsigned int flags)
+{
+	struct xcfs_splice_ctx ctx;
+	struct splice_desc sd = {
+		.total_len = len,
+		.flags = flags,
+		.pos = *ppos,
+		.u.data = &ctx,
+	};
+	ssize_t ret;
+	int err;
+
+	/* through write_iter, into the upper page cache */
+	if (xcfs_is_block(file_inode(out))) {
+		ret = iter_file_splice_write(pipe, out, ppos, len, flags);
+		if (ret > 0) {
+			err = xcfs_write_sync(out, *ppos - ret, ret);
+			if (err)
+				ret = err;
+		}
+		return ret;
+	}
+
+	ctx.inode = file_inode(out);
+	ctx.lower_file = xcfs_lower_file(out);
+	ctx.crypt = (char *)__get_free_page(GFP_KERNEL_ACCOUNT);
+	if (!ctx.crypt)
+		return -ENOMEM;
+
+	pipe_lock(pipe);
+	/* extent rewrites must not interleave with write(2) */
+	if (xcfs_has_compression(ctx.inode))
+		inode_lock(ctx.inode);
+	ret = __splice_from_pipe(pipe, &sd, xcfs_pipe_to_lower);
+	if (xcfs_has_compression(ctx.inode))
+		inode_unlock(ctx.inode);
+	pipe_unlock(pipe);
+	/* checksums of the whole splice at once */
+	err = ret > 0 ? xcfs_csum_flush(ctx.inode) : 0;
+
+	if (ret > 0) {
+		/* compress.c counts what actually reached the lower file */
+		if (!xcfs_has_compression(ctx.inode))
+			xcfs_stat_add(out->f_path.dentry->d_sb,
+				      lower_write_bytes, ret);
+		xcfs_invalidate_upper(out, *ppos, ret);
+		xcfs_drop_behind(out, *ppos, ret);
+		*ppos += ret;
+		xcfs_size_extend(file_inode(out),
+				 i_size_read(file_inode(ctx.lower_file)));
+		fsstack_copy_attr_times(file_inode(out),
+					file_inode(ctx.lower_file));
+		err = xcfs_write_sync(out, *ppos - ret, ret) ?: err;
+		if (err)
+			ret = err;
+	}
+
+	free_page((unsigned long)ctx.crypt);
+	return ret;
+}
+
+/* this function seeks in a file, finding holes in the lower file */
+/* llseek */
+static loff_t xcfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+	loff_t ret;
+
+	/* legacy-format holes do not read back as zeros, so hide them */
+	if ((whence != SEEK_DATA && whence != SEEK_HOLE) ||
+	    !xcfs_has_holes(inode))
+		return generic_file_llseek(file, offset, whence);
+
+	ret = vfs_llseek(xcfs_lower_file(file), offset, whence);
+	if (ret < 0)
+		return ret;
+	return vfs_setpos(file, ret, inode->i_sb->s_maxbytes);
+}
+
+/* this function allocates, punches or zeroes ranges of the lower file */
+/* fallocate */
+static long xcfs_fallocate(struct file *file, int mode, loff_t offset,
+			   loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	long err;
+
+	/*
+	 * Without holes the lower zeros this would expose do not decrypt
+	 * to zeros; only preallocating past eof is harmless.  Checksummed
+	 * files cannot shift or zero blocks behind their checksums either.
+	 */
+	if ((!xcfs_has_holes(inode) || xcfs_has_integrity(inode)) &&
+	    mode != FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	err = vfs_fallocate(lower_file, mode, offset, len);
+	if (err)
+		return err;
+
+	if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE))
+		invalidate_inode_pages2_range(file->f_mapping,
+					      offset >> PAGE_SHIFT, -1);
+	else if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		xcfs_invalidate_upper(file, offset, len);
+	/* the upper size may be ahead of the lower one until writeback */
+	if (!(mode & FALLOC_FL_KEEP_SIZE))
+		fsstack_copy_inode_size(inode, file_inode(lower_file));
+	fsstack_copy_attr_times(inode, file_inode(lower_file));
+	return 0;
+}
 
+/* this function updates the destination of a lower copy or clone */
+static void xcfs_copy_done(struct file *file_out, struct file *lower_out,
+			   loff_t pos_out, loff_t count)
+{
+	xcfs_invalidate_upper(file_out, pos_out, count);
+	fsstack_copy_inode_size(file_inode(file_out), file_inode(lower_out));
+	fsstack_copy_attr_times(file_inode(file_out), file_inode(lower_out));
+}
+
+/* this function copies ciphertext between lower files */
+/* copy file range */
+static ssize_t xcfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				    struct file *file_out, loff_t pos_out,
+				    size_t len, unsigned int flags)
+{
+	struct file *lower_in, *lower_out;
+	ssize_t ret;
+
+	/*
+	 * -EOPNOTSUPP makes the VFS fall back to do_splice_direct, which
+	 * stays in the kernel and goes through our splice ops.
+	 */
+	if (!xcfs_can_share_ciphertext(file_inode(file_in),
+				       file_inode(file_out)))
+		return -EOPNOTSUPP;
+
+	lower_in = xcfs_lower_file(file_in);
+	lower_out = xcfs_lower_file(file_out);
+	ret = vfs_copy_file_range(lower_in, pos_in, lower_out, pos_out,
+				  len, flags);
+	if (ret > 0)
+		xcfs_copy_done(file_out, lower_out, pos_out, ret);
+	return ret;
+}
+
+/* this function reflinks ciphertext between lower files */
+/* clone file range */
+static int xcfs_clone_file_range(struct file *file_in, loff_t pos_in,
+				 struct file *file_out, loff_t pos_out, u64 len)
+{
+	struct file *lower_in, *lower_out;
+	int err;
+
+	if (!xcfs_can_share_ciphertext(file_inode(file_in),
+				       file_inode(file_out)))
+		return -EOPNOTSUPP;
+
+	lower_in = xcfs_lower_file(file_in);
+	lower_out = xcfs_lower_file(file_out);
+	err = vfs_clone_file_range(lower_in, pos_in, lower_out, pos_out, len);
+	if (err)
+		return err;
+
+	/* a zero length clones up to the end of the source */
+	if (!len)
+		len = i_size_read(file_inode(lower_out)) - pos_out;
+	xcfs_copy_done(file_out, lower_out, pos_out, len);
+	return 0;
+}
 
 /* file operations for files */
 const struct file_operations xcfs_file_ops = {
-	.llseek 	= generic_file_llseek,
+	.llseek 	= xcfs_file_llseek,
 	.read 		= xcfs_read,
 	.write 		= xcfs_write,
 	.mmap		= xcfs_mmap,
@@ -460,6 +1375,11 @@ const struct file_operations xcfs_file_ops = {
 	.fasync		= xcfs_fasync,
 	.read_iter 	= xcfs_read_iter,
 	.write_iter = xcfs_write_iter,
+	.splice_read	= xcfs_splice_read,
+	.splice_write	= xcfs_splice_write,
+	.copy_file_range	= xcfs_copy_file_range,
+	.clone_file_range	= xcfs_clone_file_range,
+	.fallocate	= xcfs_fallocate,
 };
 
 /* file operations for directories */
@@ -0,0 +1,170 @@
+#include "xcfs.h"
+
+#include <linux/random.h>
+
+/*
+ * Per-file header.  It lives in a lower xattr so lower offsets and sizes
+ * stay identical to the upper ones, and is decoded once into
+ * xcfs_inode_info when the inode is set up.  Files without a header
+ * predate it and use the legacy byte shift.
+ */
+
+/* this function describes a file written before headers existed */
+static void xcfs_legacy_header(struct xcfs_header *hdr)
+{
+	hdr->version = 0;
+	hdr->format = XCFS_FMT_SHIFT;
+	hdr->flags = 0;
+	hdr->extent_shift = PAGE_SHIFT;
+	hdr->nonce = 0;
+	hdr->csum_id = 0;
+	hdr->csum_root = 0;
+	hdr->csum_leaves = 0;
+}
+
+/* this function decodes an on-disk header */
+static void xcfs_decode_header(struct xcfs_header *hdr,
+			       const struct xcfs_disk_header *disk)
+{
+	hdr->version = disk->version;
+	hdr->format = disk->format;
+	hdr->flags = le16_to_cpu(disk->flags);
+	hdr->extent_shift = disk->extent_shift;
+	hdr->nonce = 0;
+	memcpy(&hdr->nonce, disk->nonce, sizeof(disk->nonce));
+	hdr->nonce = le64_to_cpu((__force __le64)hdr->nonce);
+	hdr->csum_id = le64_to_cpu(disk->csum_id);
+	hdr->csum_root = le32_to_cpu(disk->csum_root);
+	hdr->csum_leaves = le32_to_cpu(disk->csum_leaves);
+
+	/* never guess at data written by a newer xcfs */
+	if (le32_to_cpu(disk->magic) != XCFS_HDR_MAGIC ||
+	    hdr->version > XCFS_HDR_VERSION ||
+	    hdr->format > XCFS_FMT_MAX ||
+	    (hdr->flags & ~XCFS_HDR_KNOWN_FLAGS))
+		hdr->format = XCFS_FMT_UNKNOWN;
+
+	/* an index longer than a sidecar can hold is not ours */
+	if ((hdr->flags & XCFS_HDR_INTEGRITY) &&
+	    hdr->csum_leaves > XCFS_CSUM_MAX_LEAVES)
+		hdr->format = XCFS_FMT_UNKNOWN;
+
+	/* compressed extents are whole pages, and bounded for the buffers */
+	if ((hdr->flags & XCFS_HDR_COMPRESS) &&
+	    (hdr->extent_shift < PAGE_SHIFT ||
+	     hdr->extent_shift > XCFS_COMPRESS_MAX_SHIFT))
+		hdr->format = XCFS_FMT_UNKNOWN;
+}
+
+/* this function encodes a header for the lower xattr */
+static void xcfs_encode_header(struct xcfs_disk_header *disk,
+			       const struct xcfs_header *hdr)
+{
+	memset(disk, 0, sizeof(*disk));
+	disk->magic = cpu_to_le32(XCFS_HDR_MAGIC);
+	disk->version = hdr->version;
+	disk->format = hdr->format;
+	disk->flags = cpu_to_le16(hdr->flags);
+	disk->extent_shift = hdr->extent_shift;
+	if (xcfs_format_keyed(hdr->format)) {
+		__le64 nonce = cpu_to_le64(hdr->nonce);
+
+		memcpy(disk->nonce, &nonce, sizeof(disk->nonce));
+	}
+	if (hdr->flags & XCFS_HDR_INTEGRITY) {
+		disk->csum_id = cpu_to_le64(hdr->csum_id);
+		disk->csum_root = cpu_to_le32(hdr->csum_root);
+		disk->csum_leaves = cpu_to_le32(hdr->csum_leaves);
+	}
+}
+
+/* this function reads the header of a lower file into its upper inode */
+void xcfs_read_header(struct inode *inode, struct inode *lower_inode)
+{
+	struct xcfs_header *hdr = &XCFS_I(inode)->hdr;
+	struct xcfs_disk_header disk;
+	struct dentry *lower_dentry;
+	ssize_t len;
+
+	xcfs_legacy_header(hdr);
+	if (!S_ISREG(lower_inode->i_mode) ||
+	    !(lower_inode->i_opflags & IOP_XATTR))
+		return;
+
+	lower_dentry = d_find_any_alias(lower_inode);
+	if (!lower_dentry)
+		return;
+	len = __vfs_getxattr(lower_dentry, lower_inode, XCFS_HDR_XATTR,
+			     &disk, sizeof(disk));
+	dput(lower_dentry);
+
+	if (len == -ENODATA)
+		return;
+	if (len != sizeof(disk)) {
+		/* -ERANGE: a longer header from a newer version */
+		hdr->format = XCFS_FMT_UNKNOWN;
+		return;
+	}
+	xcfs_decode_header(hdr, &disk);
+
+	/* without the key such data can be neither read nor written */
+	if (xcfs_format_keyed(hdr->format) && !XCFS_SB(inode->i_sb)->has_key)
+		hdr->format = XCFS_FMT_UNKNOWN;
+}
+
+/* this function stores the in-memory header in the lower xattr */
+int xcfs_store_header(struct inode *inode, struct dentry *lower_dentry)
+{
+	struct inode *lower_inode = d_inode(lower_dentry);
+	struct xcfs_disk_header disk;
+	int err;
+
+	xcfs_encode_header(&disk, &XCFS_I(inode)->hdr);
+
+	/* the header is ours, the caller's permissions do not apply */
+	inode_lock(lower_inode);
+	err = __vfs_setxattr_noperm(lower_dentry, XCFS_HDR_XATTR, &disk,
+				    sizeof(disk), 0);
+	inode_unlock(lower_inode);
+	return err;
+}
+
+/* this function gives a newly created file the mount's format */
+void xcfs_init_header(struct inode *inode, struct dentry *lower_dentry)
+{
+	struct xcfs_header *hdr = &XCFS_I(inode)->hdr;
+	int err;
+
+	hdr->version = XCFS_HDR_VERSION;
+	hdr->format = XCFS_SB(inode->i_sb)->format;
+	hdr->flags = XCFS_SB(inode->i_sb)->integrity ? XCFS_HDR_INTEGRITY : 0;
+	hdr->extent_shift = PAGE_SHIFT;
+	hdr->nonce = 0;
+	hdr->csum_id = 0;
+	hdr->csum_root = 0;
+	hdr->csum_leaves = 0;
+	/* the sidecar is made by the first store of checksums */
+	if (hdr->flags & XCFS_HDR_INTEGRITY)
+		get_random_bytes(&hdr->csum_id, sizeof(hdr->csum_id));
+	if (xcfs_format_keyed(hdr->format)) {
+		/* a fresh keystream for every file */
+		get_random_bytes(&hdr->nonce, sizeof(hdr->nonce));
+		hdr->nonce &= (1ULL << 56) - 1;
+	}
+	if (XCFS_SB(inode->i_sb)->compress) {
+		hdr->flags |= XCFS_HDR_COMPRESS;
+		hdr->extent_shift = max_t(int, XCFS_COMPRESS_SHIFT, PAGE_SHIFT);
+	}
+
+	err = -EOPNOTSUPP;
+	if (d_inode(lower_dentry)->i_opflags & IOP_XATTR)
+		err = xcfs_store_header(inode, lower_dentry);
+	if (err) {
+		/* what cannot be recorded would be read back as legacy */
+		if (err != -EOPNOTSUPP)
+			printk_ratelimited(KERN_WARNING "xcfs: cannot store "
+					   "header, using legacy format: %d\n",
+					   err);
+		xcfs_legacy_header(hdr);
+	}
+}
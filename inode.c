@@ -21,6 +21,8 @@ static int xcfs_create(struct inode* dir, struct dentry* dentry,
 	err = xcfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
 		goto out;
+	/* new files are written in the mount's format */
+	xcfs_init_header(d_inode(dentry), lower_dentry);
 	fsstack_copy_attr_times(dir, xcfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
 
@@ -30,6 +32,24 @@ out:
 	return err;
 }
 
+/* this function hides our private lower xattrs from a name list */
+static ssize_t xcfs_filter_xattr_list(char *list, ssize_t size)
+{
+	char *p = list, *end = list + size;
+
+	while (p < end) {
+		size_t len = strnlen(p, end - p) + 1;
+
+		if (xcfs_is_private_xattr(p)) {
+			memmove(p, p + len, end - p - len);
+			end -= len;
+			continue;
+		}
+		p += len;
+	}
+	return end - list;
+}
+
 /* copied from wrapfs */
 /* this function defines the behaviour of how to a link an inode */
 static int xcfs_link(struct dentry *old_dentry, struct inode *dir,
@@ -105,6 +125,9 @@ static int xcfs_unlink(struct inode *dir, struct dentry *dentry)
 	d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
 out:
 	unlock_dir(lower_dir_dentry);
+	/* cached NFS handles must not keep it alive, see export.c */
+	if (!err)
+		xcfs_fh_cache_forget(d_inode(dentry));
 	dput(lower_dentry);
 	xcfs_put_lower_path(dentry, &lower_path);
 	return err;
@@ -200,6 +223,8 @@ static int xcfs_rmdir(struct inode *dir, struct dentry *dentry)
 
 out:
 	unlock_dir(lower_dir_dentry);
+	if (!err && d_inode(dentry))
+		xcfs_fh_cache_forget(d_inode(dentry));
 	xcfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
@@ -250,6 +275,7 @@ static int xcfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_old_dir_dentry = NULL;
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
+	struct inode *victim = d_inode(new_dentry);
 	struct path lower_old_path, lower_new_path;
 
     if (flags) {
@@ -292,6 +318,9 @@ static int xcfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
+	/* an overwritten target may have lost its last link */
+	if (!err && victim)
+		xcfs_fh_cache_forget(victim);
 	dput(lower_old_dir_dentry);
 	dput(lower_new_dir_dentry);
 	xcfs_put_lower_path(old_dentry, &lower_old_path);
@@ -309,14 +338,9 @@ static int xcfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 
 	xcfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
-	if (!lower_dentry->d_inode->i_op ||
-	    !lower_dentry->d_inode->i_op->readlink) {
-		err = -EINVAL;
-		goto out;
-	}
 
-	err = lower_dentry->d_inode->i_op->readlink(lower_dentry,
-						    buf, bufsiz);
+	/* vfs_readlink falls back to ->get_link for lower fs without ->readlink */
+	err = vfs_readlink(lower_dentry, buf, bufsiz);
 	if (err < 0)
 		goto out;
 	fsstack_copy_attr_atime(dentry->d_inode, lower_dentry->d_inode);
@@ -326,39 +350,122 @@ out:
 	return err;
 }
 
+/* drops a reference to a cached symlink body */
+void xcfs_put_link(void *arg)
+{
+	struct xcfs_link *link = arg;
 
-/* copied from wrapfs */
-/* this function defines the behavior of how to get a link from an inode */
-static const char *xcfs_get_link(struct dentry *dentry, struct inode *inode,
-				   struct delayed_call *done)
+	if (atomic_dec_and_test(&link->count))
+		kfree_rcu(link, rcu);
+}
+
+/* installs a symlink body on an inode, returning the one it replaced */
+static struct xcfs_link *xcfs_swap_link(struct inode *inode,
+					struct xcfs_link *link)
+{
+	struct xcfs_link *old;
+
+	spin_lock(&inode->i_lock);
+	old = rcu_dereference_protected(XCFS_I(inode)->link,
+					lockdep_is_held(&inode->i_lock));
+	rcu_assign_pointer(XCFS_I(inode)->link, link);
+	spin_unlock(&inode->i_lock);
+	return old;
+}
+
+/* forgets the cached symlink body of an inode */
+void xcfs_drop_link(struct inode *inode)
 {
+	struct xcfs_link *link;
+
+	link = xcfs_swap_link(inode, NULL);
+	if (link)
+		xcfs_put_link(link);
+}
+
+/* a cached body is stale once the lower symlink changed under us */
+static bool xcfs_link_valid(struct inode *inode, struct xcfs_link *link)
+{
+	struct inode *lower_inode = xcfs_lower_inode(inode);
+
+	return timespec_equal(&link->lower_ctime, &lower_inode->i_ctime);
+}
+
+/* reads the lower symlink once and installs a body sized to the target */
+static struct xcfs_link *xcfs_fill_link(struct dentry *dentry,
+					struct inode *inode)
+{
+	struct xcfs_link *link, *old;
+	struct timespec lower_ctime;
 	char *buf;
-	int len = PAGE_SIZE, err;
+	int err;
 	mm_segment_t old_fs;
 
-	if (!dentry)
-		return ERR_PTR(-ECHILD);
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
 
-	/* This is freed by the put_link method assuming a successful call. */
-	buf = kmalloc(len, GFP_KERNEL);
-	if (!buf) {
-		buf = ERR_PTR(-ENOMEM);
-		return buf;
-	}
+	lower_ctime = xcfs_lower_inode(inode)->i_ctime;
 
 	/* read the symlink, and then we will follow it */
 	old_fs = get_fs();
 	set_fs(KERNEL_DS);
-	err = xcfs_readlink(dentry, buf, len);
+	err = xcfs_readlink(dentry, (char __user *)buf, PAGE_SIZE - 1);
 	set_fs(old_fs);
 	if (err < 0) {
-		kfree(buf);
-		buf = ERR_PTR(err);
-	} else {
-		buf[err] = '\0';
+		link = ERR_PTR(err);
+		goto out;
 	}
-	set_delayed_call(done, kfree_link, buf);
-	return buf;
+
+	link = kmalloc(sizeof(*link) + err + 1, GFP_KERNEL);
+	if (!link) {
+		link = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	/* one reference for the inode, one for the caller */
+	atomic_set(&link->count, 2);
+	link->lower_ctime = lower_ctime;
+	memcpy(link->body, buf, err);
+	link->body[err] = '\0';
+
+	old = xcfs_swap_link(inode, link);
+	if (old)
+		xcfs_put_link(old);
+out:
+	kfree(buf);
+	return link;
+}
+
+/* copied from wrapfs and modified */
+/* this function defines the behavior of how to get a link from an inode */
+/*
+ * The body is cached on the upper inode, so following a symlink costs no
+ * allocation and no lower call once it has been read.  The body is only
+ * handed out under a reference, in rcu-walk too: the walk may leave rcu
+ * mode still holding it.  There a miss or a stale body drops to ref-walk.
+ */
+static const char *xcfs_get_link(struct dentry *dentry, struct inode *inode,
+				   struct delayed_call *done)
+{
+	struct xcfs_link *link;
+
+	rcu_read_lock();
+	link = rcu_dereference(XCFS_I(inode)->link);
+	if (link && (!xcfs_link_valid(inode, link) ||
+		     !atomic_inc_not_zero(&link->count)))
+		link = NULL;
+	rcu_read_unlock();
+
+	if (!link) {
+		/* rcu-walk cannot read the lower symlink */
+		if (!dentry)
+			return ERR_PTR(-ECHILD);
+		link = xcfs_fill_link(dentry, inode);
+		if (IS_ERR(link))
+			return ERR_CAST(link);
+	}
+	set_delayed_call(done, xcfs_put_link, link);
+	return link->body;
 }
 
 /* copied from wrapfs */
@@ -383,6 +490,10 @@ static int xcfs_setattr(struct dentry *dentry, struct iattr *ia)
 	struct inode *lower_inode;
 	struct path lower_path;
 	struct iattr lower_ia;
+	struct file *lower_file;
+	struct xcfs_range range;
+	loff_t old_size = 0;
+	bool resized = false;
 
 	inode = d_inode(dentry);
 
@@ -405,7 +516,7 @@ static int xcfs_setattr(struct dentry *dentry, struct iattr *ia)
 		lower_ia.ia_file = xcfs_lower_file(ia->ia_file);
 
 	/*
-	 * If shrinking, first truncate upper level to cancel writing dirty
+	 * If shrinking, first set the upper size to cancel writing dirty
 	 * pages beyond the new eof; and also if its' maxbytes is more
 	 * limiting (fail with -EFBIG before making any change to the lower
 	 * level).  There is no need to vmtruncate the upper level
@@ -416,7 +527,44 @@ static int xcfs_setattr(struct dentry *dentry, struct iattr *ia)
 		err = inode_newsize_ok(inode, ia->ia_size);
 		if (err)
 			goto out;
-		truncate_setsize(inode, ia->ia_size);
+		/* block units at the edges are re-encrypted from the lower file */
+		if (xcfs_is_block(inode))
+			err = filemap_write_and_wait_range(inode->i_mapping,
+				round_down(min(ia->ia_size, i_size_read(inode)),
+					   XCFS_BLOCK_SIZE), LLONG_MAX);
+		if (err)
+			goto out;
+	}
+
+	/*
+	 * Writers see the size change all at once: the upper size only
+	 * changes under the range lock, so a write past the new eof either
+	 * finished before or extends the file after, see xcfs_size_extend.
+	 * The pages go once it is dropped, as writeback of them takes it; if
+	 * the lower file could not be changed, the old size comes back and
+	 * the pages stay.
+	 */
+	if (ia->ia_valid & ATTR_SIZE) {
+		xcfs_range_lock(inode, &range,
+				min3(ia->ia_size, i_size_read(inode),
+				     i_size_read(lower_inode)),
+				XCFS_RANGE_EOF);
+		old_size = i_size_read(inode);
+		i_size_write(inode, ia->ia_size);
+	}
+
+	/* a block unit cut or lengthened by the new eof is encrypted again */
+	if ((ia->ia_valid & ATTR_SIZE) && xcfs_is_block(inode)) {
+		err = xcfs_block_truncate(inode, &lower_path, ia->ia_size);
+		if (err)
+			goto out_unlock;
+	}
+
+	/* a compressed extent cut by the new eof must be rewritten first */
+	if ((ia->ia_valid & ATTR_SIZE) && xcfs_has_compression(inode)) {
+		err = xcfs_compress_truncate(inode, &lower_path, ia->ia_size);
+		if (err)
+			goto out_unlock;
 	}
 
 	/*
@@ -437,16 +585,49 @@ static int xcfs_setattr(struct dentry *dentry, struct iattr *ia)
 			    NULL);
 	inode_unlock(d_inode(lower_dentry));
 	if (err)
-		goto out;
+		goto out_unlock;
+	resized = ia->ia_valid & ATTR_SIZE;
+
+	/*
+	 * drop checksums past the new eof; the cut last block is checksummed
+	 * again from the lower file, opened here for a truncate by path
+	 */
+	if (ia->ia_valid & ATTR_SIZE) {
+		lower_file = NULL;
+		if (ia->ia_valid & ATTR_FILE)
+			lower_file = get_file(lower_ia.ia_file);
+		else if (xcfs_has_integrity(inode))
+			lower_file = dentry_open(&lower_path,
+						 O_RDONLY | O_LARGEFILE,
+						 current_cred());
+		if (IS_ERR(lower_file)) {
+			/* still forget what is past eof, and say why */
+			err = PTR_ERR(lower_file);
+			lower_file = NULL;
+		}
+		err = xcfs_csum_truncate(inode, lower_file, ia->ia_size) ?: err;
+		if (lower_file)
+			fput(lower_file);
+	}
 
 	/* get attributes from the lower inode */
 	fsstack_copy_attr_all(inode, lower_inode);
+	/* the block count changed too, ask the lower inode next time */
+	WRITE_ONCE(XCFS_I(inode)->attr_time, 0);
 	/*
 	 * Not running fsstack_copy_inode_size(inode, lower_inode), because
 	 * VFS should update our inode size, and notify_change on
 	 * lower_inode should update its size.
 	 */
 
+out_unlock:
+	if (ia->ia_valid & ATTR_SIZE) {
+		if (!resized)
+			i_size_write(inode, old_size);
+		xcfs_range_unlock(inode, &range);
+		if (resized)
+			truncate_pagecache(inode, ia->ia_size);
+	}
 out:
 	xcfs_put_lower_path(dentry, &lower_path);
 out_err:
@@ -459,18 +640,30 @@ static int xcfs_getattr(const struct path *path, struct kstat *stat,
         u32 request_mask, unsigned int flags) 
 {
     struct dentry *dentry = path->dentry;
+    struct inode *inode = d_inode(dentry);
     int err;
 	struct kstat lower_stat;
 	struct path lower_path;
+	unsigned int timeout;
+	unsigned long then;
+
+	/* attr_timeout: trust what the last lower getattr copied up */
+	timeout = READ_ONCE(XCFS_SB(inode->i_sb)->attr_timeout);
+	then = READ_ONCE(XCFS_I(inode)->attr_time);
+	if (timeout && then && !(flags & AT_STATX_FORCE_SYNC) &&
+	    time_before(jiffies, then + msecs_to_jiffies(timeout))) {
+		generic_fillattr(inode, stat);
+		return 0;
+	}
 
 	xcfs_get_lower_path(dentry, &lower_path);
 	err = vfs_getattr(&lower_path, &lower_stat, request_mask, flags);
 	if (err)
 		goto out;
-	fsstack_copy_attr_all(d_inode(dentry),
-			      d_inode(lower_path.dentry));
-	generic_fillattr(d_inode(dentry), stat);
-	stat->blocks = lower_stat.blocks;
+	fsstack_copy_attr_all(inode, d_inode(lower_path.dentry));
+	inode->i_blocks = lower_stat.blocks;
+	generic_fillattr(inode, stat);
+	WRITE_ONCE(XCFS_I(inode)->attr_time, jiffies);
 out:
 	xcfs_put_lower_path(dentry, &lower_path);
 	return err;
@@ -485,6 +678,9 @@ xcfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 	int err; struct dentry *lower_dentry;
 	struct path lower_path;
 
+	if (xcfs_is_private_xattr(name))
+		return -EPERM;
+
 	xcfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
@@ -492,6 +688,7 @@ xcfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 		goto out;
 	}
 	err = vfs_setxattr(lower_dentry, name, value, size, flags);
+	xcfs_xattr_invalidate(inode);
 	if (err)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry),
@@ -511,6 +708,14 @@ xcfs_getxattr(struct dentry *dentry, struct inode *inode,
 	struct dentry *lower_dentry;
 	struct inode *lower_inode;
 	struct path lower_path;
+	struct timespec lower_ctime, now;
+
+	if (xcfs_is_private_xattr(name))
+		return -ENODATA;
+
+	err = xcfs_xattr_cache_get(inode, name, buffer, size);
+	if (err != -EAGAIN)
+		return err;
 
 	xcfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -519,7 +724,12 @@ xcfs_getxattr(struct dentry *dentry, struct inode *inode,
 		err = -EOPNOTSUPP;
 		goto out;
 	}
+	lower_ctime = lower_inode->i_ctime;
+	now = current_time(lower_inode);
 	err = vfs_getxattr(lower_dentry, name, buffer, size);
+	if (xcfs_xattr_cacheable(&lower_ctime, &now))
+		xcfs_xattr_cache_set(inode, name, size ? buffer : NULL, err,
+				     &lower_ctime);
 	if (err)
 		goto out;
 	fsstack_copy_attr_atime(d_inode(dentry),
@@ -544,7 +754,11 @@ xcfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 		err = -EOPNOTSUPP;
 		goto out;
 	}
+	/* filtered by the caller's privileges, see xattr.c */
 	err = vfs_listxattr(lower_dentry, buffer, buffer_size);
+	/* a size query may overestimate, the real listing never does */
+	if (err > 0 && buffer)
+		err = xcfs_filter_xattr_list(buffer, err);
 	if (err)
 		goto out;
 	fsstack_copy_attr_atime(d_inode(dentry),
@@ -563,6 +777,9 @@ xcfs_removexattr(struct dentry *dentry, struct inode *inode, const char *name)
 	struct inode *lower_inode;
 	struct path lower_path;
 
+	if (xcfs_is_private_xattr(name))
+		return -EPERM;
+
 	xcfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_inode = xcfs_lower_inode(inode);
@@ -571,6 +788,7 @@ xcfs_removexattr(struct dentry *dentry, struct inode *inode, const char *name)
 		goto out;
 	}
 	err = vfs_removexattr(lower_dentry, name);
+	xcfs_xattr_invalidate(inode);
 	if (err)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry), lower_inode);
@@ -579,6 +797,18 @@ out:
 	return err;
 }
 
+/* this function maps file extents, passing through to the lower inode */
+static int xcfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		       u64 start, u64 len)
+{
+	struct inode *lower_inode = xcfs_lower_inode(inode);
+
+	/* legacy-format holes are not zeros, tools must not skip them */
+	if (!xcfs_has_holes(inode) || !lower_inode->i_op->fiemap)
+		return -EOPNOTSUPP;
+	return lower_inode->i_op->fiemap(lower_inode, fieinfo, start, len);
+}
+
 const struct inode_operations xcfs_inode_sym_ops = {
     .readlink	    = xcfs_readlink,
 	.permission	    = xcfs_permission,
@@ -609,6 +839,7 @@ const struct inode_operations xcfs_inode_file_ops = {
     .setattr        = xcfs_setattr,
     .getattr        = xcfs_getattr,
     .listxattr      = xcfs_listxattr,
+    .fiemap         = xcfs_fiemap,
 };
 
 static int xcfs_xattr_get(const struct xattr_handler *handler,
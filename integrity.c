@@ -0,0 +1,713 @@
+#include "xcfs.h"
+
+#include <linux/crc32c.h>
+
+/*
+ * Block integrity.  Every PAGE_SIZE block of lower ciphertext has a
+ * crc32c.  They are kept XCFS_CSUM_PER_LEAF to a leaf in a sidecar file
+ * under XCFS_META_DIR, each leaf ending with the crc32c of its entries,
+ * and the leaves are tied together by an index whose root is in the
+ * file's header (see xcfs_format.h).  A zero entry means "never
+ * checksummed" (holes, space added by an extending truncate) and is not
+ * verified.  Only the index can say a leaf was never stored, so neither
+ * a leaf nor the sidecar can be removed to turn verification off.
+ *
+ * Blocks are verified once, when they enter the upper page cache; hits
+ * are served from there and never verified again.  The index is read
+ * whole and checked against the root the first time the checksums of a
+ * file are needed, leaves as their blocks are.  A writer stores the
+ * leaves it changed with xcfs_csum_flush right after its data, then the
+ * index entries and the root, once per write rather than once per block.
+ * A store that fails is returned to the writer and marked on the mapping
+ * for fsync, and is tried again by the next flush.  fsync makes the
+ * sidecar durable before the lower file and the header with the root.
+ */
+
+#define XCFS_CSUM_SEED		(~0U)
+#define XCFS_CSUM_NR_SUMS	(XCFS_CSUM_MAX_LEAVES / XCFS_CSUM_INDEX_BLOCK)
+
+struct xcfs_csum {
+	struct mutex lock;
+	struct file *file;	/* the sidecar, once opened */
+	bool loaded;		/* index read and checked against the root */
+	int error;		/* it did not match */
+	unsigned long nr_leaves;	/* index entries in use */
+	unsigned long cap;		/* entries allocated below */
+	__le32 *index;		/* crc32c ending each leaf, 0: never stored */
+	__le32 **leaves;	/* leaves read so far, NULL otherwise */
+	unsigned long *dirty;	/* leaves to store */
+	unsigned long index_lo, index_hi;	/* index entries to store */
+	bool any_dirty;
+	__le32 sums[XCFS_CSUM_NR_SUMS];	/* crc32c of each index block */
+};
+
+/* crc32c with 0 kept free to mean "not checksummed" */
+static u32 xcfs_crc(const void *data, size_t len)
+{
+	u32 crc = crc32c(XCFS_CSUM_SEED, data, len);
+
+	return crc ? crc : 1;
+}
+
+/* this function returns the checksum state of an inode, creating it */
+static struct xcfs_csum *xcfs_csum_get(struct inode *inode)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct xcfs_csum *cs;
+
+	cs = READ_ONCE(info->csum);
+	if (cs)
+		return cs;
+
+	cs = kzalloc(sizeof(*cs), GFP_NOFS);
+	if (!cs)
+		return NULL;
+	mutex_init(&cs->lock);
+	if (cmpxchg(&info->csum, NULL, cs)) {
+		kfree(cs);
+		cs = info->csum;
+	}
+	return cs;
+}
+
+/* this function makes room for nr leaves */
+static int xcfs_csum_grow(struct xcfs_csum *cs, unsigned long nr)
+{
+	unsigned long cap;
+	__le32 *index;
+	__le32 **leaves;
+	unsigned long *dirty;
+
+	if (nr > XCFS_CSUM_MAX_LEAVES)
+		return -EFBIG;
+	if (nr <= cs->cap)
+		return 0;
+
+	cap = min_t(unsigned long, max(nr, 2 * cs->cap),
+		    XCFS_CSUM_MAX_LEAVES);
+	index = kvzalloc(cap * sizeof(*index), GFP_NOFS);
+	leaves = kvzalloc(cap * sizeof(*leaves), GFP_NOFS);
+	dirty = kvzalloc(BITS_TO_LONGS(cap) * sizeof(long), GFP_NOFS);
+	if (!index || !leaves || !dirty) {
+		kvfree(index);
+		kvfree(leaves);
+		kvfree(dirty);
+		return -ENOMEM;
+	}
+
+	if (cs->cap) {
+		memcpy(index, cs->index, cs->cap * sizeof(*index));
+		memcpy(leaves, cs->leaves, cs->cap * sizeof(*leaves));
+		memcpy(dirty, cs->dirty, BITS_TO_LONGS(cs->cap) * sizeof(long));
+		kvfree(cs->index);
+		kvfree(cs->leaves);
+		kvfree(cs->dirty);
+	}
+	cs->index = index;
+	cs->leaves = leaves;
+	cs->dirty = dirty;
+	cs->cap = cap;
+	return 0;
+}
+
+/*
+ * this function returns XCFS_META_DIR of a mount with a reference,
+ * making it if create is set; -ENOENT if there is none
+ */
+static int xcfs_get_meta_dir(struct super_block *sb, struct path *dir,
+			     bool create)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+	const struct cred *old_cred;
+	struct path lower_root;
+	struct dentry *dentry;
+	int err = 0;
+
+	mutex_lock(&sbi->meta_lock);
+	if (sbi->meta_dir.dentry)
+		goto out;
+
+	xcfs_get_lower_path(sb->s_root, &lower_root);
+	old_cred = override_creds(sbi->creator_cred);
+	inode_lock_nested(d_inode(lower_root.dentry), I_MUTEX_PARENT);
+	dentry = lookup_one_len(XCFS_META_DIR, lower_root.dentry,
+				sizeof(XCFS_META_DIR) - 1);
+	if (!IS_ERR(dentry) && d_is_negative(dentry) && create)
+		err = vfs_mkdir(d_inode(lower_root.dentry), dentry, 0700);
+	inode_unlock(d_inode(lower_root.dentry));
+	revert_creds(old_cred);
+
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out_root;
+	}
+	if (!err && d_is_negative(dentry))
+		err = -ENOENT;
+	else if (!err && !d_is_dir(dentry))
+		err = -ENOTDIR;
+	if (err) {
+		dput(dentry);
+		goto out_root;
+	}
+	sbi->meta_dir.dentry = dentry;
+	sbi->meta_dir.mnt = mntget(lower_root.mnt);
+out_root:
+	xcfs_put_lower_path(sb->s_root, &lower_root);
+out:
+	if (!err) {
+		*dir = sbi->meta_dir;
+		path_get(dir);
+	}
+	mutex_unlock(&sbi->meta_lock);
+	return err;
+}
+
+/* this function lets go of XCFS_META_DIR at unmount */
+void xcfs_put_meta_dir(struct super_block *sb)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+
+	if (sbi->meta_dir.dentry)
+		path_put(&sbi->meta_dir);
+	sbi->meta_dir.dentry = NULL;
+}
+
+/* this function names the sidecar of an inode */
+static void xcfs_csum_name(struct inode *inode, char *name, size_t size)
+{
+	snprintf(name, size, XCFS_CSUM_NAME,
+		 (unsigned long long)XCFS_I(inode)->hdr.csum_id);
+}
+
+/*
+ * this function opens the sidecar of an inode, making it if create is
+ * set; -ENOENT if there is none.  It is ours, so it is opened with the
+ * credentials of the mount, not of the caller.
+ */
+static int xcfs_csum_open(struct inode *inode, struct xcfs_csum *cs,
+			  bool create)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(inode->i_sb);
+	char name[sizeof(XCFS_CSUM_NAME) + 16];
+	const struct cred *old_cred;
+	struct path dir, path;
+	struct file *file;
+	int err;
+
+	if (cs->file)
+		return 0;
+	err = xcfs_get_meta_dir(inode->i_sb, &dir, create);
+	if (err)
+		return err;
+	xcfs_csum_name(inode, name, sizeof(name));
+
+	old_cred = override_creds(sbi->creator_cred);
+	inode_lock_nested(d_inode(dir.dentry), I_MUTEX_PARENT);
+	path.dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	if (IS_ERR(path.dentry)) {
+		err = PTR_ERR(path.dentry);
+		inode_unlock(d_inode(dir.dentry));
+		goto out;
+	}
+	if (d_is_negative(path.dentry))
+		err = create ? vfs_create(d_inode(dir.dentry), path.dentry,
+					  S_IFREG | 0600, true) : -ENOENT;
+	inode_unlock(d_inode(dir.dentry));
+
+	if (!err) {
+		path.mnt = dir.mnt;
+		file = dentry_open(&path, O_RDWR | O_LARGEFILE, current_cred());
+		if (IS_ERR(file))
+			err = PTR_ERR(file);
+		else
+			cs->file = file;
+	}
+	dput(path.dentry);
+out:
+	revert_creds(old_cred);
+	path_put(&dir);
+	return err;
+}
+
+/* this function sums index block j */
+static void xcfs_csum_sum(struct xcfs_csum *cs, unsigned long j)
+{
+	unsigned long start = j * XCFS_CSUM_INDEX_BLOCK;
+	unsigned long nr = min_t(unsigned long, XCFS_CSUM_INDEX_BLOCK,
+				 cs->nr_leaves - start);
+
+	cs->sums[j] = cpu_to_le32(xcfs_crc(cs->index + start,
+					   nr * sizeof(*cs->index)));
+}
+
+/* this function returns the root over the index entries in use */
+static u32 xcfs_csum_root(struct xcfs_csum *cs)
+{
+	unsigned long nr = DIV_ROUND_UP(cs->nr_leaves, XCFS_CSUM_INDEX_BLOCK);
+
+	return nr ? xcfs_crc(cs->sums, nr * sizeof(*cs->sums)) : 0;
+}
+
+/* this function marks index entries [lo, hi) to be stored */
+static void xcfs_csum_dirty_index(struct xcfs_csum *cs, unsigned long lo,
+				  unsigned long hi)
+{
+	if (cs->index_lo < cs->index_hi) {
+		lo = min(lo, cs->index_lo);
+		hi = max(hi, cs->index_hi);
+	}
+	cs->index_lo = lo;
+	cs->index_hi = hi;
+	cs->any_dirty = true;
+}
+
+/*
+ * this function reads the index, the first time the checksums of an
+ * inode are needed, and checks it against the root in the header.  A
+ * mismatch stays: the file's checksums cannot be trusted any more.
+ */
+static int xcfs_csum_load(struct inode *inode, struct xcfs_csum *cs)
+{
+	struct xcfs_header *hdr = &XCFS_I(inode)->hdr;
+	unsigned long nr = hdr->csum_leaves, j;
+	size_t len = nr * sizeof(*cs->index);
+	int err = 0;
+	int rc;
+
+	if (cs->loaded)
+		return cs->error;
+	err = xcfs_csum_grow(cs, nr);
+	if (err)
+		return err;
+
+	if (nr) {
+		err = xcfs_csum_open(inode, cs, false);
+		/* the sidecar went away under a file that has one */
+		if (err == -ENOENT)
+			goto bad;
+		if (err)
+			return err;
+		rc = kernel_read(cs->file, 0, (char *)cs->index, len);
+		if (rc < 0)
+			return rc;
+		if (rc != len)
+			goto bad;
+	}
+	cs->nr_leaves = nr;
+	for (j = 0; j < DIV_ROUND_UP(nr, XCFS_CSUM_INDEX_BLOCK); j++)
+		xcfs_csum_sum(cs, j);
+	if (xcfs_csum_root(cs) != hdr->csum_root)
+		goto bad;
+	cs->loaded = true;
+	return 0;
+
+bad:
+	printk_ratelimited(KERN_ERR "xcfs: inode %lu: checksum index does "
+			   "not match its root\n", inode->i_ino);
+	memset(cs->index, 0, len);
+	cs->nr_leaves = 0;
+	cs->loaded = true;
+	cs->error = -EIO;
+	return cs->error;
+}
+
+/* this function returns leaf n, reading it (or a blank one) if needed */
+static __le32 *xcfs_csum_leaf(struct inode *inode, struct xcfs_csum *cs,
+			      unsigned long n)
+{
+	unsigned long nr;
+	__le32 *leaf;
+	int err, rc;
+
+	err = xcfs_csum_load(inode, cs);
+	if (err)
+		return ERR_PTR(err);
+	nr = cs->nr_leaves;
+	if (n < nr && cs->leaves[n])
+		return cs->leaves[n];
+
+	err = xcfs_csum_grow(cs, n + 1);
+	if (err)
+		return ERR_PTR(err);
+	leaf = kzalloc(XCFS_CSUM_LEAF_SIZE, GFP_NOFS);
+	if (!leaf)
+		return ERR_PTR(-ENOMEM);
+
+	/* a leaf never stored is blank */
+	if (n < nr && cs->index[n]) {
+		err = xcfs_csum_open(inode, cs, false);
+		if (!err) {
+			rc = kernel_read(cs->file, XCFS_CSUM_LEAF_POS(n),
+					 (char *)leaf, XCFS_CSUM_LEAF_SIZE);
+			if (rc < 0)
+				err = rc;
+			else if (rc != XCFS_CSUM_LEAF_SIZE ||
+				 leaf[XCFS_CSUM_PER_LEAF] != cs->index[n] ||
+				 xcfs_crc(leaf, XCFS_CSUM_PER_LEAF *
+					  sizeof(*leaf)) !=
+				 le32_to_cpu(leaf[XCFS_CSUM_PER_LEAF]))
+				err = -EIO;
+		}
+		if (err == -ENOENT || err == -EIO) {
+			printk_ratelimited(KERN_ERR "xcfs: inode %lu: bad "
+					   "checksum leaf %lu\n",
+					   inode->i_ino, n);
+			err = -EIO;
+		}
+		if (err) {
+			kfree(leaf);
+			return ERR_PTR(err);
+		}
+	}
+	cs->leaves[n] = leaf;
+	/* the index grows with the file, the root with it */
+	if (n >= nr) {
+		cs->nr_leaves = n + 1;
+		xcfs_csum_dirty_index(cs, nr, n + 1);
+	}
+	return leaf;
+}
+
+/* this function records the checksum of one block */
+static int xcfs_csum_set(struct inode *inode, struct xcfs_csum *cs,
+			 pgoff_t index, u32 crc)
+{
+	unsigned long n = index / XCFS_CSUM_PER_LEAF;
+	__le32 *leaf;
+
+	leaf = xcfs_csum_leaf(inode, cs, n);
+	if (IS_ERR(leaf))
+		return PTR_ERR(leaf);
+	leaf[index % XCFS_CSUM_PER_LEAF] = cpu_to_le32(crc);
+	set_bit(n, cs->dirty);
+	cs->any_dirty = true;
+	return 0;
+}
+
+/*
+ * this function stores the changed leaves, then their index entries, then
+ * the root in the header, with cs->lock held
+ */
+static int xcfs_csum_store(struct inode *inode, struct xcfs_csum *cs)
+{
+	struct xcfs_header *hdr = &XCFS_I(inode)->hdr;
+	struct dentry *lower_dentry;
+	unsigned long n, lo, hi, j;
+	__le32 *leaf;
+	u32 crc;
+	int err = 0;
+	int rc;
+
+	if (!cs->any_dirty)
+		return 0;
+	err = xcfs_csum_open(inode, cs, true);
+	if (err)
+		goto out;
+
+	for_each_set_bit(n, cs->dirty, cs->nr_leaves) {
+		leaf = cs->leaves[n];
+		crc = xcfs_crc(leaf, XCFS_CSUM_PER_LEAF * sizeof(*leaf));
+		leaf[XCFS_CSUM_PER_LEAF] = cpu_to_le32(crc);
+		rc = kernel_write(cs->file, (char *)leaf, XCFS_CSUM_LEAF_SIZE,
+				  XCFS_CSUM_LEAF_POS(n));
+		if (rc != XCFS_CSUM_LEAF_SIZE) {
+			err = rc < 0 ? rc : -EIO;
+			goto out;
+		}
+		cs->index[n] = leaf[XCFS_CSUM_PER_LEAF];
+		xcfs_csum_dirty_index(cs, n, n + 1);
+		clear_bit(n, cs->dirty);
+	}
+
+	/* entries past nr_leaves are zeros left by a truncate */
+	lo = cs->index_lo;
+	hi = cs->index_hi;
+	if (lo < hi) {
+		rc = kernel_write(cs->file, (char *)(cs->index + lo),
+				  (hi - lo) * sizeof(*cs->index),
+				  lo * sizeof(*cs->index));
+		if (rc != (hi - lo) * sizeof(*cs->index)) {
+			err = rc < 0 ? rc : -EIO;
+			goto out;
+		}
+		hi = min(hi, cs->nr_leaves);
+		for (j = lo / XCFS_CSUM_INDEX_BLOCK;
+		     j * XCFS_CSUM_INDEX_BLOCK < hi; j++)
+			xcfs_csum_sum(cs, j);
+	}
+
+	hdr->csum_root = xcfs_csum_root(cs);
+	hdr->csum_leaves = cs->nr_leaves;
+	lower_dentry = d_find_any_alias(xcfs_lower_inode(inode));
+	if (!lower_dentry) {
+		err = -ESTALE;
+		goto out;
+	}
+	err = xcfs_store_header(inode, lower_dentry);
+	dput(lower_dentry);
+	if (err)
+		goto out;
+	cs->index_lo = cs->index_hi = 0;
+	cs->any_dirty = false;
+out:
+	if (err) {
+		printk_ratelimited(KERN_ERR "xcfs: inode %lu: cannot store "
+				   "checksums: %d\n", inode->i_ino, err);
+		/* for fsync, in case no writer was there to see it */
+		mapping_set_error(inode->i_mapping, err);
+	}
+	return err;
+}
+
+/*
+ * this function checks a block of ciphertext as read from the lower file
+ * (len bytes, short only at eof) before it is decrypted
+ */
+int xcfs_csum_verify(struct inode *inode, pgoff_t index, const void *data,
+		     size_t len)
+{
+	struct xcfs_csum *cs;
+	__le32 *leaf;
+	u32 crc = 0;
+	int err = 0;
+
+	if (!xcfs_has_integrity(inode))
+		return 0;
+	cs = xcfs_csum_get(inode);
+	if (!cs)
+		return -ENOMEM;
+
+	mutex_lock(&cs->lock);
+	leaf = xcfs_csum_leaf(inode, cs, index / XCFS_CSUM_PER_LEAF);
+	if (IS_ERR(leaf))
+		err = PTR_ERR(leaf);
+	else
+		crc = le32_to_cpu(leaf[index % XCFS_CSUM_PER_LEAF]);
+	mutex_unlock(&cs->lock);
+	if (err || !crc)
+		return err;
+
+	if (xcfs_crc(data, len) != crc) {
+		printk_ratelimited(KERN_ERR "xcfs: inode %lu: checksum "
+				   "mismatch in block %lu\n",
+				   inode->i_ino, index);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* this function checksums block index after it was changed */
+static u32 xcfs_block_crc(struct inode *inode, struct file *lower_file,
+			  pgoff_t index, loff_t pos, const char *buf,
+			  size_t len, char *tmp)
+{
+	loff_t start = (loff_t)index << PAGE_SHIFT;
+	loff_t size = i_size_read(xcfs_lower_inode(inode));
+	size_t valid;
+	int rc;
+
+	if (size <= start)
+		return 0;
+	valid = min_t(loff_t, PAGE_SIZE, size - start);
+
+	/* the new ciphertext covers the whole block */
+	if (pos <= start && pos + len >= start + valid)
+		return xcfs_crc(buf + (start - pos), valid);
+
+	/* an edge block: what is in the lower file now is what counts */
+	if (!lower_file || !tmp)
+		return 0;
+	rc = kernel_read(lower_file, start, tmp, valid);
+	if (rc != valid)
+		return 0;
+	return xcfs_crc(tmp, valid);
+}
+
+/*
+ * this function updates the checksums after len bytes of ciphertext in
+ * buf were written at pos.  lower_file is used to re-read edge blocks;
+ * without it they are left unchecksummed.  The caller stores them with
+ * xcfs_csum_flush once its data is written.
+ */
+int xcfs_csum_update(struct inode *inode, struct file *lower_file,
+		     loff_t pos, const char *buf, size_t len)
+{
+	struct xcfs_csum *cs;
+	pgoff_t index, last;
+	char *tmp = NULL;
+	int err = 0;
+
+	if (!xcfs_has_integrity(inode) || !len)
+		return 0;
+	cs = xcfs_csum_get(inode);
+	if (!cs)
+		return -ENOMEM;
+
+	if (lower_file && ((pos | len) & (PAGE_SIZE - 1)))
+		tmp = kmalloc(PAGE_SIZE, GFP_NOFS);
+
+	index = pos >> PAGE_SHIFT;
+	last = (pos + len - 1) >> PAGE_SHIFT;
+
+	mutex_lock(&cs->lock);
+	for (; !err && index <= last; index++)
+		err = xcfs_csum_set(inode, cs, index,
+				    xcfs_block_crc(inode, lower_file, index,
+						   pos, buf, len, tmp));
+	mutex_unlock(&cs->lock);
+
+	kfree(tmp);
+	return err;
+}
+
+/* this function forgets checksums past a new eof */
+int xcfs_csum_truncate(struct inode *inode, struct file *lower_file,
+		       loff_t size)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(inode->i_sb);
+	const struct cred *old_cred;
+	struct xcfs_csum *cs;
+	pgoff_t last = size ? (size - 1) >> PAGE_SHIFT : 0;
+	unsigned long n, nr;
+	__le32 *leaf;
+	char *tmp;
+	int err = 0;
+
+	if (!xcfs_has_integrity(inode))
+		return 0;
+	cs = xcfs_csum_get(inode);
+	if (!cs)
+		return -ENOMEM;
+
+	mutex_lock(&cs->lock);
+	err = xcfs_csum_load(inode, cs);
+	if (err)
+		goto out;
+
+	/* whole leaves past eof go, and their index entries with them */
+	nr = size ? last / XCFS_CSUM_PER_LEAF + 1 : 0;
+	if (nr < cs->nr_leaves) {
+		for (n = nr; n < cs->nr_leaves; n++) {
+			kfree(cs->leaves[n]);
+			cs->leaves[n] = NULL;
+			clear_bit(n, cs->dirty);
+		}
+		memset(cs->index + nr, 0,
+		       (cs->nr_leaves - nr) * sizeof(*cs->index));
+		xcfs_csum_dirty_index(cs, nr, cs->nr_leaves);
+		cs->nr_leaves = nr;
+	}
+
+	/* entries past eof in the last leaf, and the new last block */
+	if (size) {
+		leaf = xcfs_csum_leaf(inode, cs, last / XCFS_CSUM_PER_LEAF);
+		if (IS_ERR(leaf)) {
+			err = PTR_ERR(leaf);
+			goto out;
+		}
+		n = last % XCFS_CSUM_PER_LEAF;
+		memset(leaf + n + 1, 0,
+		       (XCFS_CSUM_PER_LEAF - n - 1) * sizeof(*leaf));
+		tmp = kmalloc(PAGE_SIZE, GFP_NOFS);
+		leaf[n] = cpu_to_le32(xcfs_block_crc(inode, lower_file, last,
+						     0, NULL, 0, tmp));
+		kfree(tmp);
+		set_bit(last / XCFS_CSUM_PER_LEAF, cs->dirty);
+		cs->any_dirty = true;
+	}
+	err = xcfs_csum_store(inode, cs);
+
+	/* the leaves past the new end take no space any more */
+	if (!err && cs->file) {
+		old_cred = override_creds(sbi->creator_cred);
+		err = vfs_truncate(&cs->file->f_path,
+				   XCFS_CSUM_LEAF_POS(cs->nr_leaves));
+		revert_creds(old_cred);
+	}
+out:
+	mutex_unlock(&cs->lock);
+	return err;
+}
+
+/* this function stores the checksums changed since it last ran */
+int xcfs_csum_flush(struct inode *inode)
+{
+	struct xcfs_csum *cs = XCFS_I(inode)->csum;
+	int err;
+
+	if (!cs)
+		return 0;
+
+	mutex_lock(&cs->lock);
+	err = xcfs_csum_store(inode, cs);
+	mutex_unlock(&cs->lock);
+	return err;
+}
+
+/* this function makes the sidecar durable, before fsync of the lower file */
+int xcfs_csum_sync(struct inode *inode, int datasync)
+{
+	struct xcfs_csum *cs = XCFS_I(inode)->csum;
+	struct file *file = NULL;
+	int err;
+
+	if (!cs)
+		return 0;
+
+	mutex_lock(&cs->lock);
+	err = xcfs_csum_store(inode, cs);
+	if (cs->file)
+		file = get_file(cs->file);
+	mutex_unlock(&cs->lock);
+	if (!err && file)
+		err = vfs_fsync(file, datasync);
+	if (file)
+		fput(file);
+	return err;
+}
+
+/* this function removes the sidecar of an inode whose lower file is gone */
+void xcfs_csum_remove(struct inode *inode)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(inode->i_sb);
+	char name[sizeof(XCFS_CSUM_NAME) + 16];
+	const struct cred *old_cred;
+	struct dentry *dentry;
+	struct path dir;
+
+	if (!xcfs_has_integrity(inode) ||
+	    xcfs_get_meta_dir(inode->i_sb, &dir, false))
+		return;
+	xcfs_csum_name(inode, name, sizeof(name));
+
+	old_cred = override_creds(sbi->creator_cred);
+	inode_lock_nested(d_inode(dir.dentry), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	if (!IS_ERR(dentry)) {
+		if (d_is_positive(dentry))
+			vfs_unlink(d_inode(dir.dentry), dentry, NULL);
+		dput(dentry);
+	}
+	inode_unlock(d_inode(dir.dentry));
+	revert_creds(old_cred);
+	path_put(&dir);
+}
+
+/* this function frees the checksum state of an inode being evicted */
+void xcfs_csum_free(struct inode *inode)
+{
+	struct xcfs_csum *cs = XCFS_I(inode)->csum;
+	unsigned long n;
+
+	if (!cs)
+		return;
+	if (cs->file)
+		fput(cs->file);
+	for (n = 0; n < cs->cap; n++)
+		kfree(cs->leaves[n]);
+	kvfree(cs->index);
+	kvfree(cs->leaves);
+	kvfree(cs->dirty);
+	kfree(cs);
+	XCFS_I(inode)->csum = NULL;
+}
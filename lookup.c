@@ -1,4 +1,9 @@
 #include "xcfs.h"
+
+#include <linux/hash.h>
+#include <linux/rculist_bl.h>
+#include <linux/writeback.h>
+
 const char XCFS_SALT[] = "SALTIEST SALT OF THE SEA";
 
 /* The dentry cache is just so we have properly sized dentries */
@@ -54,56 +59,175 @@ int new_dentry_private_data(struct dentry *dentry)
 	return 0;
 }
 
-/* copied from wrapfs */
-/* this function tests if a lower inode is the lower inode of another inode */
-static int xcfs_inode_test(struct inode *inode, void *candidate_lower_inode)
+/*
+ * Upper inodes are found from their lower inode through a per-superblock
+ * hash of lower inode pointers rather than the global inode hash: hits
+ * walk a bucket under rcu_read_lock() alone, only inserts and evictions
+ * take the bucket's bit lock, and nothing is shared with other file
+ * systems.  Upper inodes are freed through call_rcu (xcfs_destroy_inode),
+ * so an entry seen under rcu_read_lock() stays readable.
+ */
+
+static struct hlist_bl_head *xcfs_ihash_bucket(struct super_block *sb,
+					       struct inode *lower_inode)
 {
-	struct inode *current_lower_inode = xcfs_lower_inode(inode);
-	if (current_lower_inode == (struct inode *)candidate_lower_inode) {
-		return 1; /* found a match */
-    } else {
-		return 0; /* no match */
-    }
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+
+	return &sbi->inode_hash[hash_ptr(lower_inode, sbi->inode_hash_bits)];
 }
 
-/* copied from wrapfs */
-/* this function does nothing */
-static int xcfs_inode_set(struct inode *inode, void *lower_inode)
+/* this function finds the hashed upper inode of lower_inode, under rcu */
+static struct inode *xcfs_ihash_find(struct hlist_bl_head *b,
+				     struct inode *lower_inode)
 {
-	/* we do actual inode initialization in xcfs_iget */
+	struct xcfs_inode_info *info;
+	struct hlist_bl_node *pos;
+
+	hlist_bl_for_each_entry_rcu(info, pos, b, hash_node)
+		if (READ_ONCE(info->lower_inode) == lower_inode)
+			return &info->vfs_inode;
+	return NULL;
+}
+
+/*
+ * this function returns the upper inode of lower_inode with a reference,
+ * NULL if there is none, or ERR_PTR(-EAGAIN) while it is being evicted
+ */
+static struct inode *xcfs_ihash_lookup(struct hlist_bl_head *b,
+				       struct inode *lower_inode)
+{
+	struct inode *inode;
+	struct inode *ret;
+
+	rcu_read_lock();
+	ret = inode = xcfs_ihash_find(b, lower_inode);
+	if (inode) {
+		spin_lock(&inode->i_lock);
+		if (inode->i_state & (I_FREEING | I_WILL_FREE))
+			ret = ERR_PTR(-EAGAIN);
+		else
+			__iget(inode);
+		spin_unlock(&inode->i_lock);
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+/* this function tells whether an evicted upper inode is still hashed */
+static bool xcfs_ihash_freeing(struct hlist_bl_head *b,
+			       struct inode *lower_inode)
+{
+	struct inode *inode;
+	bool freeing = false;
+
+	rcu_read_lock();
+	inode = xcfs_ihash_find(b, lower_inode);
+	if (inode)
+		freeing = READ_ONCE(inode->i_state) &
+			  (I_FREEING | I_WILL_FREE);
+	rcu_read_unlock();
+	return freeing;
+}
+
+/* this function unhashes an inode being evicted */
+void xcfs_ihash_remove(struct inode *inode)
+{
+	struct xcfs_inode_info *info = XCFS_I(inode);
+	struct hlist_bl_head *b;
+
+	if (hlist_bl_unhashed(&info->hash_node))
+		return;
+	b = xcfs_ihash_bucket(inode->i_sb, info->lower_inode);
+	hlist_bl_lock(b);
+	hlist_bl_del_init_rcu(&info->hash_node);
+	hlist_bl_unlock(b);
+	/* iget of the same lower inode may make a new one now */
+	wake_up_all(&XCFS_SB(inode->i_sb)->inode_wait);
+}
+
+/* this function sizes the inode hash of a mount after the memory size */
+int xcfs_ihash_init(struct super_block *sb)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+	unsigned int i;
+
+	/* about one bucket per 16 pages of memory */
+	sbi->inode_hash_bits = clamp_t(int, ilog2(totalram_pages) - 4,
+				       XCFS_IHASH_MIN_BITS,
+				       XCFS_IHASH_MAX_BITS);
+	sbi->inode_hash = kvmalloc_array(1U << sbi->inode_hash_bits,
+					 sizeof(*sbi->inode_hash),
+					 GFP_KERNEL);
+	if (!sbi->inode_hash)
+		return -ENOMEM;
+	for (i = 0; i < (1U << sbi->inode_hash_bits); i++)
+		INIT_HLIST_BL_HEAD(&sbi->inode_hash[i]);
+	init_waitqueue_head(&sbi->inode_wait);
 	return 0;
 }
 
-/* copied from wrapfs */
+void xcfs_ihash_free(struct super_block *sb)
+{
+	kvfree(XCFS_SB(sb)->inode_hash);
+	XCFS_SB(sb)->inode_hash = NULL;
+}
+
+/* copied from wrapfs and modified */
 /* this function gets an inode from a superblock */
 struct inode *xcfs_iget(struct super_block *sb, struct inode *lower_inode)
 {
 	struct xcfs_inode_info *info;
 	struct inode *inode; /* the new inode to return */
+	struct hlist_bl_head *b;
+	struct hlist_bl_node *pos;
+	struct xcfs_inode_info *other;
 
 	if (!igrab(lower_inode)) {
 		return ERR_PTR(-ESTALE);
     }
-	inode = iget5_locked(sb, /* our superblock */
-			     /*
-			      * hashval: we use inode number, but we can
-			      * also use "(unsigned long)lower_inode"
-			      * instead.
-			      */
-			     lower_inode->i_ino, /* hashval */
-			     xcfs_inode_test,	/* inode comparison function */
-			     xcfs_inode_set, /* inode init function */
-			     lower_inode); /* data passed to test+set fxns */
-	if (!inode) {
-		iput(lower_inode);
-		return ERR_PTR(-ENOMEM);
+	b = xcfs_ihash_bucket(sb, lower_inode);
+again:
+	inode = xcfs_ihash_lookup(b, lower_inode);
+	if (IS_ERR(inode)) {
+		/* never two upper inodes for one lower inode */
+		wait_event(XCFS_SB(sb)->inode_wait,
+			   !xcfs_ihash_freeing(b, lower_inode));
+		goto again;
 	}
 	/* if found a cached inode, then just return it (after iput) */
-	if (!(inode->i_state & I_NEW)) {
+	if (inode) {
 		iput(lower_inode);
+		wait_on_inode(inode);
 		return inode;
 	}
 
+	inode = new_inode(sb);
+	if (!inode) {
+		iput(lower_inode);
+		return ERR_PTR(-ENOMEM);
+	}
+	spin_lock(&inode->i_lock);
+	inode->i_state |= I_NEW;
+	spin_unlock(&inode->i_lock);
+
+	hlist_bl_lock(b);
+	hlist_bl_for_each_entry(other, pos, b, hash_node) {
+		if (other->lower_inode == lower_inode) {
+			/* lost the race, throw ours away and take theirs */
+			hlist_bl_unlock(b);
+			spin_lock(&inode->i_lock);
+			inode->i_state &= ~I_NEW;
+			spin_unlock(&inode->i_lock);
+			iput(inode);
+			goto again;
+		}
+	}
+	xcfs_set_lower_inode(inode, lower_inode);
+	hlist_bl_add_head_rcu(&XCFS_I(inode)->hash_node, b);
+	hlist_bl_unlock(b);
+	/* writeback skips inodes that look unhashed */
+	hlist_add_fake(&inode->i_hash);
+
 	/* initialize new inode */
 	info = XCFS_I(inode);
 
@@ -145,10 +269,59 @@ struct inode *xcfs_iget(struct super_block *sb, struct inode *lower_inode)
 	fsstack_copy_attr_all(inode, lower_inode);
 	fsstack_copy_inode_size(inode, lower_inode);
 
+	/* decode the file header once, hot paths only look at the copy */
+	xcfs_read_header(inode, lower_inode);
+
 	unlock_new_inode(inode);
 	return inode;
 }
 
+/*
+ * this function finds or makes a dentry for a lower path without a name
+ * to look up, for NFS handles.  It takes over the reference on lower_path.
+ */
+struct dentry *xcfs_obtain_alias(struct super_block *sb,
+				 struct path *lower_path)
+{
+	struct xcfs_dentry_info *info;
+	struct inode *inode;
+	struct dentry *dentry;
+
+	inode = xcfs_iget(sb, d_inode(lower_path->dentry));
+	if (IS_ERR(inode)) {
+		path_put(lower_path);
+		return ERR_CAST(inode);
+	}
+	/* an alias found here may be connected, or another one's anon */
+	dentry = d_obtain_alias(inode);
+	if (IS_ERR(dentry) || dentry->d_fsdata) {
+		path_put(lower_path);
+		return dentry;
+	}
+
+	info = kmem_cache_zalloc(xcfs_dentry_cachep, GFP_KERNEL);
+	if (!info) {
+		path_put(lower_path);
+		dput(dentry);
+		return ERR_PTR(-ENOMEM);
+	}
+	spin_lock_init(&info->lock);
+	pathcpy(&info->lower_path, lower_path);
+
+	spin_lock(&dentry->d_lock);
+	if (!dentry->d_fsdata) {
+		dentry->d_fsdata = info;
+		info = NULL;
+	}
+	spin_unlock(&dentry->d_lock);
+	if (info) {
+		/* someone else set it up first */
+		kmem_cache_free(xcfs_dentry_cachep, info);
+		path_put(lower_path);
+	}
+	return dentry;
+}
+
 /*
  * Helper interpose routine, called directly by ->lookup to handle
  * spliced dentries.
@@ -227,8 +400,7 @@ static struct dentry *__xcfs_lookup(struct dentry *dentry,
 	struct qstr this;
 	struct dentry *ret_dentry = NULL;
 
-	/* must initialize dentry operations */
-	d_set_d_op(dentry, &xcfs_dent_ops);
+	/* dentry operations come from sb->s_d_op */
 
 	if (IS_ROOT(dentry)) {
 		goto out;
@@ -236,6 +408,13 @@ static struct dentry *__xcfs_lookup(struct dentry *dentry,
 
 	name = dentry->d_name.name;
 
+	/* our own lower directory, see integrity.c, is not there for users */
+	if (xcfs_is_meta_dir(dentry->d_parent, name, dentry->d_name.len)) {
+		err = (flags & (LOOKUP_CREATE | LOOKUP_RENAME_TARGET)) ?
+		      -EPERM : -ENOENT;
+		goto out;
+	}
+
 	/* now start the actual lookup procedure */
 	lower_dir_dentry = lower_parent_path->dentry;
 	lower_dir_mnt = lower_parent_path->mnt;
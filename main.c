@@ -1,5 +1,324 @@
 #include "xcfs.h"
 
+#include <linux/parser.h>
+#include <linux/kernel.h>
+#include <linux/backing-dev.h>
+#include <linux/key.h>
+#include <keys/user-type.h>
+#include <asm/unaligned.h>
+
+/* what xcfs_mount hands to xcfs_read_super */
+struct xcfs_mount_data {
+	const char *dev_name;	/* lower directory */
+	char *options;
+};
+
+enum {
+	Opt_sparse,
+	Opt_cache_lower,
+	Opt_cache_upper,
+	Opt_integrity,
+	Opt_compress,
+	Opt_crypt_threshold,
+	Opt_ctr,
+	Opt_block,
+	Opt_key,
+	Opt_readahead_kb,
+	Opt_crypto_workers,
+	Opt_bounce_pool_pages,
+	Opt_attr_timeout,
+	Opt_writeback_async,
+	Opt_writeback_sync,
+	Opt_err
+};
+
+static const match_table_t xcfs_tokens = {
+	{Opt_sparse, "sparse"},
+	{Opt_cache_lower, "cache=lower"},
+	{Opt_cache_upper, "cache=upper"},
+	{Opt_integrity, "integrity"},
+	{Opt_compress, "compress"},
+	{Opt_crypt_threshold, "crypt_threshold=%u"},
+	{Opt_ctr, "ctr"},
+	{Opt_block, "block"},
+	{Opt_key, "key_desc=%s"},
+	{Opt_readahead_kb, "readahead_kb=%u"},
+	{Opt_crypto_workers, "crypto_workers=%u"},
+	{Opt_bounce_pool_pages, "bounce_pool_pages=%u"},
+	{Opt_attr_timeout, "attr_timeout=%u"},
+	{Opt_writeback_async, "writeback=async"},
+	{Opt_writeback_sync, "writeback=sync"},
+	{Opt_err, NULL}
+};
+
+/*
+ * what mount options set, parsed apart from the live xcfs_sb_info so a
+ * failed or refused change leaves it alone
+ */
+struct xcfs_options {
+	int format;
+	int cache;
+	bool integrity;
+	bool compress;
+	bool has_key;
+	u32 ctr_key[8];
+	unsigned int crypt_threshold;
+	unsigned int readahead_kb;
+	unsigned int crypto_workers;
+	unsigned int bounce_pool_pages;
+	unsigned int attr_timeout;
+	int writeback;
+};
+
+/*
+ * this function takes the ctr key from the kernel keyring, so that it
+ * never passes through the mount data: a "logon" key (or failing that a
+ * "user" key) of that description, whose payload is the 32 key bytes
+ */
+static int xcfs_parse_key(struct xcfs_options *opt, substring_t *arg)
+{
+	const struct user_key_payload *payload;
+	struct key *key;
+	char *desc;
+	int i, err = -EINVAL;
+
+	desc = match_strdup(arg);
+	if (!desc)
+		return -ENOMEM;
+	key = request_key(&key_type_logon, desc, NULL);
+	if (IS_ERR(key))
+		key = request_key(&key_type_user, desc, NULL);
+	if (IS_ERR(key)) {
+		printk(KERN_ERR "xcfs: no key '%s' in the keyring\n", desc);
+		err = PTR_ERR(key);
+		goto out;
+	}
+
+	down_read(&key->sem);
+	payload = user_key_payload_locked(key);
+	/* revoked since it was found */
+	if (!payload) {
+		err = -EKEYREVOKED;
+		goto out_key;
+	}
+	if (payload->datalen != sizeof(opt->ctr_key)) {
+		printk(KERN_ERR "xcfs: key '%s' is not %zu bytes\n", desc,
+		       sizeof(opt->ctr_key));
+		goto out_key;
+	}
+	for (i = 0; i < ARRAY_SIZE(opt->ctr_key); i++)
+		opt->ctr_key[i] = get_unaligned_le32(payload->data + 4 * i);
+	opt->has_key = true;
+	err = 0;
+out_key:
+	up_read(&key->sem);
+	key_put(key);
+out:
+	kfree(desc);
+	return err;
+}
+
+/* this function parses comma separated mount options into opt */
+static int xcfs_parse_into(struct xcfs_options *opt, char *options)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int arg, err;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, xcfs_tokens, args)) {
+		case Opt_sparse:
+			opt->format = XCFS_FMT_SPARSE;
+			break;
+		case Opt_cache_lower:
+			opt->cache = XCFS_CACHE_LOWER;
+			break;
+		case Opt_cache_upper:
+			opt->cache = XCFS_CACHE_UPPER;
+			break;
+		case Opt_integrity:
+			opt->integrity = true;
+			break;
+		case Opt_compress:
+			opt->compress = true;
+			break;
+		case Opt_crypt_threshold:
+			if (match_int(&args[0], &arg) || arg < 0)
+				return -EINVAL;
+			opt->crypt_threshold = arg;
+			break;
+		case Opt_ctr:
+			opt->format = XCFS_FMT_CTR;
+			break;
+		case Opt_block:
+			opt->format = XCFS_FMT_BLOCK;
+			break;
+		case Opt_key:
+			err = xcfs_parse_key(opt, &args[0]);
+			if (err)
+				return err;
+			break;
+		case Opt_readahead_kb:
+			if (match_int(&args[0], &arg) || arg < 0)
+				return -EINVAL;
+			opt->readahead_kb = arg;
+			break;
+		case Opt_crypto_workers:
+			if (match_int(&args[0], &arg) || arg < 0 ||
+			    arg > WQ_UNBOUND_MAX_ACTIVE)
+				return -EINVAL;
+			opt->crypto_workers = arg;
+			break;
+		case Opt_bounce_pool_pages:
+			if (match_int(&args[0], &arg) || arg < 1)
+				return -EINVAL;
+			opt->bounce_pool_pages = arg;
+			break;
+		case Opt_attr_timeout:
+			if (match_int(&args[0], &arg) || arg < 0)
+				return -EINVAL;
+			opt->attr_timeout = arg;
+			break;
+		case Opt_writeback_async:
+			opt->writeback = XCFS_WB_ASYNC;
+			break;
+		case Opt_writeback_sync:
+			opt->writeback = XCFS_WB_SYNC;
+			break;
+		default:
+			printk(KERN_ERR
+			       "xcfs: unrecognized mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	if (xcfs_format_keyed(opt->format) && !opt->has_key) {
+		printk(KERN_ERR "xcfs: ctr and block need a key_desc\n");
+		return -EINVAL;
+	}
+
+	/* compressed extents are not aligned to crypto units */
+	if (opt->format == XCFS_FMT_BLOCK && opt->compress) {
+		printk(KERN_ERR "xcfs: block and compress cannot be "
+		       "combined\n");
+		return -EINVAL;
+	}
+
+	/* checksums cover blocks, compressed extents are not blocks */
+	if (opt->integrity && opt->compress) {
+		printk(KERN_ERR "xcfs: integrity and compress cannot be "
+		       "combined\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* this function parses the options given at mount time */
+int xcfs_parse_options(struct super_block *sb, char *options)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+	struct xcfs_options opt = {
+		.crypt_threshold = XCFS_CRYPT_THRESHOLD,
+		.bounce_pool_pages = XCFS_BOUNCE_POOL_PAGES,
+	};
+	int err;
+
+	err = xcfs_parse_into(&opt, options);
+	if (err)
+		goto out;
+
+	sbi->format = opt.format;
+	sbi->cache = opt.cache;
+	sbi->integrity = opt.integrity;
+	sbi->compress = opt.compress;
+	sbi->has_key = opt.has_key;
+	memcpy(sbi->ctr_key, opt.ctr_key, sizeof(sbi->ctr_key));
+	sbi->crypt_threshold = opt.crypt_threshold;
+	sbi->readahead_kb = opt.readahead_kb;
+	sbi->crypto_workers = opt.crypto_workers;
+	sbi->bounce_pool_pages = opt.bounce_pool_pages;
+	sbi->attr_timeout = opt.attr_timeout;
+	sbi->writeback = opt.writeback;
+out:
+	memzero_explicit(opt.ctr_key, sizeof(opt.ctr_key));
+	return err;
+}
+
+/* this function hands the tunables to the crypto workers */
+static void xcfs_apply_options(struct super_block *sb)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+
+	if (sbi->crypt_wq)
+		workqueue_set_max_active(sbi->crypt_wq,
+					 sbi->crypto_workers ?:
+					 WQ_UNBOUND_MAX_ACTIVE);
+}
+
+/*
+ * this function changes the options of a mounted xcfs, from remount or
+ * sysfs.  Only the tunables can change; what decides how new files are
+ * stored may be repeated but not changed.
+ */
+int xcfs_change_options(struct super_block *sb, char *options)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+	struct xcfs_options opt;
+	int err;
+
+	mutex_lock(&sbi->opt_lock);
+	/* what is not given stays as it is */
+	opt.format = sbi->format;
+	opt.cache = sbi->cache;
+	opt.integrity = sbi->integrity;
+	opt.compress = sbi->compress;
+	opt.has_key = sbi->has_key;
+	memcpy(opt.ctr_key, sbi->ctr_key, sizeof(opt.ctr_key));
+	opt.crypt_threshold = sbi->crypt_threshold;
+	opt.readahead_kb = sbi->readahead_kb;
+	opt.crypto_workers = sbi->crypto_workers;
+	opt.bounce_pool_pages = sbi->bounce_pool_pages;
+	opt.attr_timeout = sbi->attr_timeout;
+	opt.writeback = sbi->writeback;
+
+	err = xcfs_parse_into(&opt, options);
+	if (err)
+		goto out;
+	if (opt.format != sbi->format || opt.integrity != sbi->integrity ||
+	    opt.compress != sbi->compress ||
+	    memcmp(opt.ctr_key, sbi->ctr_key, sizeof(sbi->ctr_key))) {
+		printk(KERN_ERR "xcfs: the file format cannot be changed "
+		       "on a mounted xcfs\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (opt.bounce_pool_pages != sbi->bounce_pool_pages) {
+		err = mempool_resize(sbi->bounce_pool,
+				     opt.bounce_pool_pages);
+		if (err)
+			goto out;
+	}
+
+	WRITE_ONCE(sbi->cache, opt.cache);
+	WRITE_ONCE(sbi->crypt_threshold, opt.crypt_threshold);
+	WRITE_ONCE(sbi->readahead_kb, opt.readahead_kb);
+	WRITE_ONCE(sbi->crypto_workers, opt.crypto_workers);
+	WRITE_ONCE(sbi->bounce_pool_pages, opt.bounce_pool_pages);
+	WRITE_ONCE(sbi->attr_timeout, opt.attr_timeout);
+	WRITE_ONCE(sbi->writeback, opt.writeback);
+	xcfs_apply_options(sb);
+out:
+	memzero_explicit(opt.ctr_key, sizeof(opt.ctr_key));
+	mutex_unlock(&sbi->opt_lock);
+	return err;
+}
+
 /*
  * There is no need to lock the xcfs_super_info's rwsem as there is no
  * way anyone can have a reference to the superblock at this point in time.
@@ -9,7 +328,8 @@ static int xcfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct xcfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -36,6 +356,31 @@ static int xcfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		goto out_free;
 	}
 
+	mutex_init(&XCFS_SB(sb)->opt_lock);
+	mutex_init(&XCFS_SB(sb)->meta_lock);
+	/* our own lower files are made as whoever mounted us */
+	XCFS_SB(sb)->creator_cred = prepare_creds();
+	if (!XCFS_SB(sb)->creator_cred) {
+		err = -ENOMEM;
+		goto out_freesbi;
+	}
+	err = xcfs_parse_options(sb, data->options);
+	if (err)
+		goto out_freesbi;
+
+	err = xcfs_crypt_init(sb);
+	if (err)
+		goto out_freesbi;
+
+	/* direct I/O must make progress even when page allocation fails */
+	XCFS_SB(sb)->bounce_pool =
+		mempool_create_page_pool(XCFS_SB(sb)->bounce_pool_pages, 0);
+	if (!XCFS_SB(sb)->bounce_pool) {
+		err = -ENOMEM;
+		goto out_freesbi;
+	}
+	xcfs_apply_options(sb);
+
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
@@ -44,6 +389,18 @@ static int xcfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
 
+	/*
+	 * our own bdi: dirty mmap pages are throttled and written back per
+	 * mount, by per-cgroup writeback when the writer's cgroup has one
+	 */
+	err = super_setup_bdi(sb);
+	if (err)
+		goto out_sput;
+	sb->s_bdi->ra_pages = lower_sb->s_bdi->ra_pages;
+	sb->s_bdi->io_pages = lower_sb->s_bdi->io_pages;
+	sb->s_bdi->capabilities |= BDI_CAP_CGROUP_WRITEBACK;
+	sb->s_iflags |= SB_I_CGROUPWB;
+
 	/*
 	 * Our c/m/atime granularity is 1 ns because we may stack on file
 	 * systems whose granularity is as good.
@@ -53,7 +410,13 @@ static int xcfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	sb->s_op = &xcfs_sb_ops;
     sb->s_xattr = xcfs_xattr_handlers;
 
-	sb->s_export_op = &xcfs_export_ops; /* adding NFS support */
+	sb->s_export_op = &xcfs_export_ops; /* adding NFS support, export.c */
+	sb->s_d_op = &xcfs_dent_ops;	/* NFS aliases are made by the VFS */
+	err = xcfs_fh_cache_init(sb);
+	if (!err)
+		err = xcfs_ihash_init(sb);
+	if (err)
+		goto out_sput;
 
 	/* get a new inode and allocate our root dentry */
 	inode = xcfs_iget(sb, d_inode(lower_path.dentry));
@@ -66,7 +429,6 @@ static int xcfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -ENOMEM;
 		goto out_iput;
 	}
-	d_set_d_op(sb->s_root, &xcfs_dent_ops);
 
 	/* link the upper and lower dentries */
 	sb->s_root->d_fsdata = NULL;
@@ -85,6 +447,11 @@ static int xcfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	 * d_rehash it.
 	 */
 	d_rehash(sb->s_root);
+
+	/* tunables under /sys/fs/xcfs/; a mount works without them */
+	if (xcfs_sysfs_register(sb))
+		printk(KERN_WARNING "xcfs: no sysfs directory for %s\n",
+		       dev_name);
 	if (!silent)
 		printk(KERN_INFO
 		       "xcfs: mounted on top of %s type %s\n",
@@ -99,6 +466,13 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+out_freesbi:
+	xcfs_fh_cache_free(sb);
+	xcfs_ihash_free(sb);
+	xcfs_crypt_exit(sb);
+	mempool_destroy(XCFS_SB(sb)->bounce_pool);
+	if (XCFS_SB(sb)->creator_cred)
+		put_cred(XCFS_SB(sb)->creator_cred);
 	kfree(XCFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -144,17 +518,27 @@ static int xcfs_fill_sb(struct super_block *sb, void *data, int silent)
 static struct dentry *xcfs_mount(struct file_system_type *fs_type, int flags,
 					char const *dev_name, void *raw_data)
 {
-	void *lower_path_name = (void *) dev_name;
+	struct xcfs_mount_data data = {
+		.dev_name = dev_name,
+		.options = raw_data,
+	};
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   xcfs_read_super);
+	return mount_nodev(fs_type, flags, &data, xcfs_read_super);
+}
+
+/* this function unmounts, letting go of dentries held for NFS first */
+static void xcfs_kill_sb(struct super_block *sb)
+{
+	if (XCFS_SB(sb))
+		xcfs_fh_cache_drop(sb);
+	generic_shutdown_super(sb);
 }
 
 static struct file_system_type xcfs_type = {
 	.owner = THIS_MODULE,
 	.name = XCFS_NAME,
 	.mount = xcfs_mount,
-	.kill_sb = generic_shutdown_super,
+	.kill_sb = xcfs_kill_sb,
 	.fs_flags = 0,
 };
 MODULE_ALIAS_FS(XCFS_NAME);
@@ -175,11 +559,20 @@ static int __init p4_init(void)
     if (retval) {
         goto out;
     }
+	retval = xcfs_init_file_cache();
+	if (retval)
+		goto out;
+	retval = xcfs_init_sysfs();
+	if (retval)
+		goto out;
 	retval = register_filesystem(&xcfs_type);
+	if (retval)
+		xcfs_exit_sysfs();
 out:
     if (retval) {
         xcfs_destroy_inode_cache();
         xcfs_destroy_dentry_cache();
+        xcfs_destroy_file_cache();
     }
     return retval;
 }
@@ -189,7 +582,9 @@ static void __exit p4_exit(void)
 	printk(PRINT_PREF "Unloading module: %s\n", XCFS_NAME);
 	xcfs_destroy_inode_cache();
 	xcfs_destroy_dentry_cache();
+	xcfs_destroy_file_cache();
 	unregister_filesystem(&xcfs_type);
+	xcfs_exit_sysfs();
 }
 
 module_init(p4_init);
@@ -6,25 +6,43 @@
 #include <linux/mount.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <crypto/algapi.h>
 #include <asm/unaligned.h>
 
 //Reading and Decryption
-void xcfs_decrypt(char* buf, size_t count) 
+//pos is where buf starts in the file, only the ctr format depends on it
+void xcfs_decrypt(struct inode *inode, char* buf, size_t count, loff_t pos) 
 {
-	int i = 0;
-	printk("xcfs_decrypt\n");
-	for(i = 0; i < count; ++i) {
-		buf[i]--;
+	switch (xcfs_format(inode)) {
+	case XCFS_FMT_CTR:
+		xcfs_ctr_xor(inode, buf, count, pos);
+		break;
+	case XCFS_FMT_BLOCK:
+		xcfs_block_crypt(inode, buf, count, pos, false);
+		break;
+	case XCFS_FMT_SPARSE:
+		/* zeros (holes) stay zero, see xcfs_format.h */
+		xcfs_sparse_decrypt((u8 *)buf, count);
+		break;
+	default:
+		xcfs_shift_decrypt((u8 *)buf, count);
 	}
 }
 
-int xcfs_decrypt_page(struct file *file, struct page *page)
+//decrypts the first len bytes of a page
+int xcfs_decrypt_page(struct file *file, struct page *page, size_t len)
 {
+	struct inode *inode = page->mapping->host;
 	char* virt = kmap(page);
 
 	printk("xcfs_decrypt_page\n");
 
-	xcfs_decrypt(virt, PAGE_SIZE);
+	/* holes come back as zero pages, which need no transform */
+	if (!xcfs_has_holes(inode) || memchr_inv(virt, 0, len))
+		xcfs_decrypt(inode, virt, len, page_offset(page));
 
 	//some cleanup
 	kunmap(page);
@@ -37,14 +55,32 @@ int xcfs_decrypt_page(struct file *file, struct page *page)
 static int read_lower(struct file* file, char *data, loff_t offset, size_t size)
 {
 	struct file *lower_file = NULL;
+	int rc;
 	printk("read_lower\n");
 	lower_file = xcfs_lower_file(file);
 	if(!lower_file)
 		return -EIO;
-	return kernel_read(lower_file, offset, data, size);
+	rc = kernel_read(lower_file, offset, data, size);
+	if(rc > 0)
+		xcfs_stat_add(file_inode(file)->i_sb, lower_read_bytes, rc);
+	return rc;
 }
 
-//returns 0 on success, nonzero on failure
+//drops lower ciphertext pages once the upper page holds the plaintext
+static void drop_lower_pages(struct file *file, pgoff_t start, pgoff_t end)
+{
+	struct inode *inode = file_inode(file);
+	unsigned long dropped;
+
+	if(!xcfs_use_upper_cache(inode))
+		return;
+	//dirty or mapped lower pages are left alone
+	dropped = invalidate_mapping_pages(xcfs_lower_file(file)->f_mapping,
+					   start, end);
+	xcfs_stat_add(inode->i_sb, lower_dropped, dropped);
+}
+
+//returns number of bytes read (positive) or an error (negative)
 static int read_lower_page_segment(	struct file *file,
 					struct page *page, pgoff_t page_index,
 					size_t offset_in_page, size_t size)
@@ -60,10 +96,11 @@ static int read_lower_page_segment(	struct file *file,
 	virt = kmap(page);
 	
 	//hand off actual reading
-	rc = read_lower(file, virt, offset, size);
+	rc = read_lower(file, virt + offset_in_page, offset, size);
 
-	if(rc > 0)	//positive values mean we read correctly,
-		rc = 0;	//	so this function should return 0
+	//past the lower eof the page must read back as zeros
+	if(rc >= 0 && rc < size)
+		memset(virt + offset_in_page + rc, 0, size - rc);
 
 	//some cleanup
 	kunmap(page);
@@ -71,6 +108,33 @@ static int read_lower_page_segment(	struct file *file,
 	return rc;
 }
 
+//reads, verifies and decrypts a locked page; 0 on success
+static int xcfs_fill_page(struct file *file, struct page *page)
+{
+	int rc = 0;
+
+	rc = read_lower_page_segment(file, page, page->index, 0,
+					PAGE_SIZE);
+
+	//check the ciphertext before trusting it
+	if(rc >= 0) {
+		char *virt = kmap(page);
+
+		if(xcfs_csum_verify(file_inode(file), page->index, virt, rc))
+			rc = -EIO;
+		kunmap(page);
+	}
+
+	//do decryption of what the lower file actually held
+	if(rc >= 0) {
+		xcfs_decrypt_page(file, page, rc);
+		drop_lower_pages(file, page->index, page->index);
+		xcfs_stat_add(file_inode(file)->i_sb, readpages, 1);
+		rc = 0;
+	}
+	return rc;
+}
+
 //returns 0 on success, nonzero on failure
 static int xcfs_readpage(struct file *file, struct page *page)
 {
@@ -78,15 +142,16 @@ static int xcfs_readpage(struct file *file, struct page *page)
 
 	printk("xcfs_readpage\n");
 
-	rc = read_lower_page_segment(file, page, page->index, 0,
-					PAGE_SIZE);
-
-	//do decryption
-	xcfs_decrypt_page(file, page);
+	//compressed extents are decompressed whole, see compress.c
+	if(xcfs_has_compression(file_inode(file)))
+		rc = xcfs_compress_readpage(file, page);
+	else
+		rc = xcfs_fill_page(file, page);
 
-	if(rc)
+	if(rc) {
 		ClearPageUptodate(page);
-	else
+		SetPageError(page);
+	} else
 		SetPageUptodate(page);
 
 	unlock_page(page);
@@ -94,83 +159,785 @@ static int xcfs_readpage(struct file *file, struct page *page)
 	return rc;
 }
 
-//Writing and Encryption
-void xcfs_encrypt(char* buf, size_t count) 
+//one piece of a pipelined run: read from the lower file, then decrypted
+struct xcfs_read_chunk {
+	struct work_struct work;
+	struct file *file;
+	struct page **pages;
+	unsigned int nr;
+	char *virt;		//the pages, mapped contiguously
+	bool xor_later;		//ctr: the reader xors in a keystream
+	int rc;
+	struct completion done;
+};
+
+//reads, verifies and decrypts one chunk; runs on a crypto worker
+static void xcfs_read_chunk(struct xcfs_read_chunk *c)
 {
-	int i = 0;
-	printk("xcfs_encrypt\n");
-	for(i = 0; i < count; ++i) {
-		buf[i]++;
+	struct inode *inode = file_inode(c->file);
+	size_t size = (size_t)c->nr << PAGE_SHIFT;
+	unsigned int i;
+	int rc;
+
+	rc = read_lower(c->file, c->virt, page_offset(c->pages[0]), size);
+	if(rc >= 0) {
+		//past the lower eof the pages must read back as zeros
+		memset(c->virt + rc, 0, size - rc);
+		//check the ciphertext before trusting it
+		for(i = 0; i < c->nr; i++) {
+			size_t done = (size_t)i << PAGE_SHIFT;
+			size_t len = (size_t)rc > done ?
+				     min_t(size_t, rc - done, PAGE_SIZE) : 0;
+
+			if(xcfs_csum_verify(inode, c->pages[i]->index,
+					    c->virt + done, len))
+				SetPageError(c->pages[i]);
+		}
+		//the sparse transform keeps holes zero, no need to skip them
+		if(!c->xor_later)
+			xcfs_decrypt(inode, c->virt, rc,
+				     page_offset(c->pages[0]));
 	}
+	c->rc = rc;
 }
 
-int xcfs_encrypt_page(struct page *page, struct page *crypt_page)
+static void xcfs_read_chunk_fn(struct work_struct *work)
 {
-	char *old_page_virt = kmap(page);
-	char *crypt_page_virt = kmap(crypt_page);
+	struct xcfs_read_chunk *c =
+		container_of(work, struct xcfs_read_chunk, work);
 
-	printk("xcfs_encrypt_page\n");	
-	
-	//copies old page to temp page
-	memcpy(crypt_page_virt, old_page_virt, PAGE_SIZE);
+	xcfs_read_chunk(c);
+	complete(&c->done);
+}
+
+//unlocks the pages of a finished chunk, uptodate unless it failed
+static void xcfs_read_chunk_end(struct xcfs_read_chunk *c)
+{
+	struct inode *inode = file_inode(c->file);
+	pgoff_t first = c->pages[0]->index;
+	unsigned int i;
 
-	xcfs_encrypt(crypt_page_virt, PAGE_SIZE);
+	for(i = 0; i < c->nr; i++) {
+		struct page *page = c->pages[i];
+
+		if(c->rc >= 0 && !PageError(page)) {
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		} else
+			SetPageError(page);
+		unlock_page(page);
+	}
+
+	if(c->rc >= 0) {
+		drop_lower_pages(c->file, first, first + c->nr - 1);
+		xcfs_stat_add(inode->i_sb, readpages, c->nr);
+	}
+}
+
+/*
+ * fills a run of contiguous locked pages.  Long runs are cut into
+ * chunks that crypto workers read and decrypt, keeping up to
+ * XCFS_READ_DEPTH lower reads in flight, so the decryption of one chunk
+ * overlaps the lower reads of the next ones.  Pages are unlocked in
+ * file order as their chunks finish.
+ */
+static void xcfs_read_run(struct file *file, struct page **pages,
+			  unsigned int nr)
+{
+	struct workqueue_struct *wq = XCFS_SB(file_inode(file)->i_sb)->crypt_wq;
+	struct xcfs_read_chunk one, *chunks = &one;
+	unsigned int nr_chunks = 1;
+	unsigned int i, queued;
+	u8 *ks = NULL;
+	char *virt;
+
+	virt = vmap(pages, nr, VM_MAP, PAGE_KERNEL);
+	if(!virt) {
+		//one page at a time still works
+		for(i = 0; i < nr; i++) {
+			xcfs_readpage(file, pages[i]);
+			put_page(pages[i]);
+		}
+		return;
+	}
+
+	if(wq && nr > XCFS_READ_CHUNK_PAGES) {
+		nr_chunks = DIV_ROUND_UP(nr, XCFS_READ_CHUNK_PAGES);
+		chunks = kmalloc_array(nr_chunks, sizeof(*chunks), GFP_KERNEL);
+		if(!chunks) {
+			chunks = &one;
+			nr_chunks = 1;
+		}
+	}
+	//a ctr keystream can be computed while the ciphertext is on its way
+	if(nr_chunks > 1 && xcfs_format(file_inode(file)) == XCFS_FMT_CTR)
+		ks = kvmalloc(XCFS_READ_CHUNK_PAGES << PAGE_SHIFT, GFP_KERNEL);
 
+	for(i = 0; i < nr_chunks; i++) {
+		unsigned int first = i * XCFS_READ_CHUNK_PAGES;
+
+		chunks[i].file = file;
+		chunks[i].pages = pages + first;
+		chunks[i].nr = nr_chunks == 1 ? nr :
+			min_t(unsigned int, nr - first, XCFS_READ_CHUNK_PAGES);
+		chunks[i].virt = virt + ((size_t)first << PAGE_SHIFT);
+		chunks[i].xor_later = ks != NULL;
+		INIT_WORK(&chunks[i].work, xcfs_read_chunk_fn);
+		init_completion(&chunks[i].done);
+	}
+
+	if(nr_chunks == 1) {
+		//nothing to overlap with
+		xcfs_read_chunk(chunks);
+		xcfs_read_chunk_end(chunks);
+	} else {
+		for(queued = 0; queued < min_t(unsigned int, nr_chunks,
+					       XCFS_READ_DEPTH); queued++)
+			queue_work(wq, &chunks[queued].work);
+		for(i = 0; i < nr_chunks; i++) {
+			size_t len = (size_t)chunks[i].nr << PAGE_SHIFT;
+			loff_t pos = page_offset(chunks[i].pages[0]);
+
+			if(ks)
+				xcfs_ctr_keystream(file_inode(file), ks, len,
+						   pos);
+			wait_for_completion(&chunks[i].done);
+			if(queued < nr_chunks)
+				queue_work(wq, &chunks[queued++].work);
+			//decryption is now a single xor pass
+			if(ks && chunks[i].rc > 0)
+				crypto_xor((u8 *)chunks[i].virt, ks,
+					   chunks[i].rc);
+			xcfs_read_chunk_end(&chunks[i]);
+		}
+		kvfree(ks);
+		kfree(chunks);
+	}
+
+	vunmap(virt);
+	for(i = 0; i < nr; i++)
+		put_page(pages[i]);
+}
+
+//readahead: runs of contiguous pages are read and decrypted in one go
+static int xcfs_readpages(struct file *file, struct address_space *mapping,
+			  struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	unsigned int max = min_t(unsigned int, nr_pages, XCFS_IO_BATCH_PAGES);
+	gfp_t gfp = readahead_gfp_mask(mapping);
+	struct page **run = NULL;
+	struct page *page;
+	unsigned int nr = 0;
+
+	//compressed extents already fill whole runs, see compress.c
+	if(!xcfs_has_compression(inode))
+		run = kmalloc_array(max, sizeof(*run), GFP_KERNEL);
+
+	while(!list_empty(pages)) {
+		page = list_entry(pages->prev, struct page, lru);
+		list_del(&page->lru);
+		if(add_to_page_cache_lru(page, mapping, page->index, gfp)) {
+			put_page(page);
+			continue;
+		}
+		if(!run) {
+			xcfs_readpage(file, page);
+			put_page(page);
+			continue;
+		}
+		if(nr && (nr == max ||
+			  page->index != run[nr - 1]->index + 1)) {
+			xcfs_read_run(file, run, nr);
+			nr = 0;
+		}
+		run[nr++] = page;
+	}
+	if(nr)
+		xcfs_read_run(file, run, nr);
+
+	kfree(run);
 	return 0;
 }
 
+//Writing and Encryption
+void xcfs_encrypt(struct inode *inode, char* buf, size_t count, loff_t pos) 
+{
+	switch (xcfs_format(inode)) {
+	case XCFS_FMT_CTR:
+		/* the xor is its own inverse */
+		xcfs_ctr_xor(inode, buf, count, pos);
+		break;
+	case XCFS_FMT_BLOCK:
+		xcfs_block_crypt(inode, buf, count, pos, true);
+		break;
+	case XCFS_FMT_SPARSE:
+		/* zeros stay zero so they can be stored as holes */
+		xcfs_sparse_encrypt((u8 *)buf, count);
+		break;
+	default:
+		xcfs_shift_encrypt((u8 *)buf, count);
+	}
+}
+
+//copies the first len bytes of a page into buf, encrypted later
+static void xcfs_copy_page(struct page *page, char *buf, size_t len)
+{
+	char *virt = kmap(page);
+
+	//the plaintext in the page cache stays
+	memcpy(buf, virt, len);
+	kunmap(page);
+}
+
+//bytes of a page below eof, 0 if it was truncated away
+static size_t xcfs_page_len(struct page *page)
+{
+	loff_t isize = i_size_read(page->mapping->host);
+	loff_t pos = page_offset(page);
+
+	if(pos >= isize)
+		return 0;
+	return min_t(loff_t, PAGE_SIZE, isize - pos);
+}
+
+//contiguous dirty pages written to the lower file in one go
+struct xcfs_wb_run {
+	struct file *lower_file;
+	struct page **pages;	//under writeback, unlocked
+	unsigned int nr, max;
+	size_t len;		//bytes of ciphertext in buf
+	char *buf;
+};
+
+//writes a run of encrypted pages and ends their writeback
+static int xcfs_wb_flush(struct inode *inode, struct xcfs_wb_run *run)
+{
+	struct xcfs_range range;
+	loff_t pos, isize;
+	size_t len;
+	int rc, err = 0;
+	unsigned int i;
+
+	if(!run->nr)
+		return 0;
+
+	pos = page_offset(run->pages[0]);
+	//write(2) to the same bytes must not interleave with ours
+	xcfs_range_lock(inode, &range, pos, pos + run->len - 1);
+	//a truncate may have cut the run while we waited, see xcfs_setattr
+	isize = i_size_read(inode);
+	len = pos < isize ? min_t(loff_t, run->len, isize - pos) : 0;
+	if(len) {
+		xcfs_encrypt_buf(inode, run->buf, len, pos);
+		err = xcfs_csum_update(inode, run->lower_file, pos, run->buf,
+				       len);
+	}
+	if(len && !err) {
+		rc = kernel_write(run->lower_file, run->buf, len, pos);
+		if(rc > 0)
+			xcfs_stat_add(inode->i_sb, lower_write_bytes, rc);
+		if(rc != len)
+			err = rc < 0 ? rc : -EIO;
+		else
+			err = xcfs_csum_flush(inode);
+	}
+	xcfs_range_unlock(inode, &range);
+	//the upper pages hold the plaintext, the lower ones are reclaimed first
+	if(len && !err && xcfs_use_upper_cache(inode))
+		xcfs_stat_add(inode->i_sb, lower_dropped,
+			invalidate_mapping_pages(run->lower_file->f_mapping,
+						 pos >> PAGE_SHIFT,
+						 (pos + len - 1) >> PAGE_SHIFT));
+
+	for(i = 0; i < run->nr; i++) {
+		if(err) {
+			SetPageError(run->pages[i]);
+			mapping_set_error(inode->i_mapping, err);
+		}
+		end_page_writeback(run->pages[i]);
+	}
+	run->nr = 0;
+	run->len = 0;
+	return err;
+}
+
+//adds a locked dirty page to the run, writing the run out when it breaks
+static int xcfs_wb_page(struct page *page, struct writeback_control *wbc,
+			void *data)
+{
+	struct xcfs_wb_run *run = data;
+	struct inode *inode = page->mapping->host;
+	size_t len = xcfs_page_len(page);
+	int err = 0;
+
+	//truncated away while dirty
+	if(!len) {
+		unlock_page(page);
+		return 0;
+	}
+
+	if(run->nr && (run->nr == run->max ||
+		       page->index != run->pages[run->nr - 1]->index + 1))
+		err = xcfs_wb_flush(inode, run);
+
+	xcfs_copy_page(page, run->buf + run->len, len);
+	/* lets cgroup writeback tell whose dirty pages these were */
+	wbc_account_io(wbc, page, len);
+	set_page_writeback(page);
+	unlock_page(page);
+	run->pages[run->nr++] = page;
+	run->len += len;
+
+	//nothing follows the page at eof
+	if(len < PAGE_SIZE)
+		err = xcfs_wb_flush(inode, run) ?: err;
+	return err;
+}
+
 static int xcfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-    struct page *crypt_page = NULL;
-	struct inode *lower_inode = xcfs_lower_inode(page->mapping->host);
+	struct inode *inode = page->mapping->host;
+	struct xcfs_wb_run run = {
+		.pages = &page,
+		.max = 1,
+	};
 	int retval = 0;
 	
 	printk("xcfs_writepage\n");
-	
+
+	//a lone compressed page is stored with the rest of its extent
+	if(xcfs_has_compression(inode))
+		return xcfs_compress_writepage(page, wbc);
+
+	//no writable open gave us a lower file to write with
+	run.lower_file = xcfs_get_wb_file(inode);
+	if(!run.lower_file) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
 	//allocate temporary page
-	crypt_page = alloc_page(GFP_USER);
-	if(crypt_page == NULL)
+	run.buf = (char *)__get_free_page(GFP_NOFS);
+	if(run.buf == NULL)
 	{
-		retval = -ENOMEM;
 		printk("Error allocation memory for temp encrypted page\n");
-		goto xcfs_writepage_out;
-	}
-
-	//encrypt the page given to us and store it in a temporary page
-	xcfs_encrypt_page(page, crypt_page);
-
-	//passes the writepage call down to the lower filesystem,
-	//	using the encrypted page
-	//we can't pass it down to kernel_write like we do in readpage,
-	//	because there's no way to get the "struct file" data structure
-	//	for the page we're given without making some modifications
-	//	to the module's data structures (see the ecrypfs_inode_info 
-	//	struct)
-	//(we could probably implement readpage in the same way, but it works
-	//	as-is, and I don't want to mess with it)
-	retval = lower_inode->i_mapping->a_ops->writepage(crypt_page, wbc);
-
-xcfs_writepage_out:
-	//frees temporary page, if necessary
-	if(crypt_page)
-	{
-		__free_page(crypt_page);
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		goto out;
 	}
-	
+
+	//encrypts into the temporary page and writes it with kernel_write
+	retval = xcfs_wb_page(page, wbc, &run);
+	retval = xcfs_wb_flush(inode, &run) ?: retval;
+
+	free_page((unsigned long)run.buf);
 	if(retval)
-	{
-		printk("xcfs_encrypt_page: error encrypting page\n");
-		ClearPageUptodate(page);
+		printk("xcfs_writepage: error writing page: %d\n", retval);
+out:
+	fput(run.lower_file);
+	return 0;
+}
+
+//writes runs of contiguous dirty pages with one lower write each
+static int xcfs_writepages(struct address_space *mapping,
+			   struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct xcfs_wb_run run = {
+		.max = XCFS_IO_BATCH_PAGES,
+	};
+	int err;
+
+	//compressed files store each dirty extent once
+	if(xcfs_has_compression(inode))
+		return xcfs_compress_writepages(mapping, wbc);
+	run.lower_file = xcfs_get_wb_file(inode);
+	if(!run.lower_file)
+		return generic_writepages(mapping, wbc);
+
+	run.pages = kmalloc_array(run.max, sizeof(*run.pages), GFP_NOFS);
+	run.buf = kvmalloc((size_t)run.max << PAGE_SHIFT, GFP_NOFS);
+	if(!run.pages || !run.buf) {
+		err = generic_writepages(mapping, wbc);
+		goto out;
 	}
-	else
-	{
+
+	err = write_cache_pages(mapping, wbc, xcfs_wb_page, &run);
+	err = xcfs_wb_flush(inode, &run) ?: err;
+out:
+	kfree(run.pages);
+	kvfree(run.buf);
+	fput(run.lower_file);
+	return err;
+}
+
+/*
+ * Block format writes.  A unit is only ever encrypted whole, so write(2)
+ * goes through the upper page cache, which holds units in plaintext: a
+ * partial write reads its page in once (the read-modify-write), and
+ * every further write to it until writeback only copies into it.  The
+ * unit is encrypted again once per writeback, by xcfs_writepages.
+ */
+
+//dirties the page of an old eof, so its unit is rewritten at full length
+static int xcfs_dirty_tail(struct file *file, pgoff_t index)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct page *page;
+	int err = 0;
+
+	page = find_or_create_page(mapping, index, mapping_gfp_mask(mapping));
+	if(!page)
+		return -ENOMEM;
+	if(!PageUptodate(page)) {
+		err = xcfs_fill_page(file, page);
+		if(!err)
+			SetPageUptodate(page);
+	}
+	if(!err)
+		set_page_dirty(page);
+	unlock_page(page);
+	put_page(page);
+	return err;
+}
+
+static int xcfs_write_begin(struct file *file, struct address_space *mapping,
+			    loff_t pos, unsigned len, unsigned flags,
+			    struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t isize = i_size_read(inode);
+	pgoff_t index = pos >> PAGE_SHIFT;
+	struct page *page;
+	int err;
+
+	//writing past eof lengthens the unit eof cuts, in another page
+	if(pos > isize && (isize & (XCFS_BLOCK_SIZE - 1)) &&
+	   (isize >> PAGE_SHIFT) != index) {
+		err = xcfs_dirty_tail(file, isize >> PAGE_SHIFT);
+		if(err)
+			return err;
+	}
+
+	page = grab_cache_page_write_begin(mapping, index, flags);
+	if(!page)
+		return -ENOMEM;
+
+	//the rest of a partly written page must be there to encrypt with it
+	if(!PageUptodate(page) && len != PAGE_SIZE) {
+		if(page_offset(page) >= isize) {
+			zero_user(page, 0, PAGE_SIZE);
+		} else {
+			err = xcfs_fill_page(file, page);
+			if(err) {
+				unlock_page(page);
+				put_page(page);
+				return err;
+			}
+		}
 		SetPageUptodate(page);
 	}
+
+	*pagep = page;
+	return 0;
+}
+
+static int xcfs_write_end(struct file *file, struct address_space *mapping,
+			  loff_t pos, unsigned len, unsigned copied,
+			  struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	//a whole page that was never read must be copied whole
+	if(!PageUptodate(page)) {
+		if(copied < len)
+			copied = 0;
+		else
+			SetPageUptodate(page);
+	}
+
+	if(copied) {
+		if(pos + copied > i_size_read(inode))
+			i_size_write(inode, pos + copied);
+		set_page_dirty(page);
+	}
 	unlock_page(page);
-	return retval;
+	put_page(page);
+	return copied;
+}
+
+/*
+ * this function re-encrypts the units a truncate to size changes, before
+ * the lower file is cut or extended: the unit the new eof cuts, and when
+ * growing, the old last unit and a new partial last unit.  The units in
+ * between are zeros, which the lower file's hole or zeros already hold.
+ */
+int xcfs_block_truncate(struct inode *inode, struct path *lower_path,
+			loff_t size)
+{
+	loff_t old = i_size_read(xcfs_lower_inode(inode));
+	loff_t edge = min(size, old);
+	loff_t unit = round_down(edge, XCFS_BLOCK_SIZE);
+	size_t old_len = min_t(loff_t, XCFS_BLOCK_SIZE, old - unit);
+	size_t new_len = min_t(loff_t, XCFS_BLOCK_SIZE, size - unit);
+	loff_t done = -1;
+	struct file *lower_file;
+	char *buf;
+	ssize_t rc;
+	int err = 0;
+
+	if(size == old)
+		return 0;
+
+	buf = kzalloc(XCFS_BLOCK_SIZE, GFP_KERNEL);
+	if(!buf)
+		return -ENOMEM;
+	lower_file = dentry_open(lower_path, O_RDWR | O_LARGEFILE,
+				 current_cred());
+	if(IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out_free;
+	}
+
+	//the unit holding the edge, unless the edge starts it
+	if(edge & (XCFS_BLOCK_SIZE - 1)) {
+		rc = kernel_read(lower_file, unit, buf, old_len);
+		if(rc >= 0 && rc != old_len)
+			rc = -EIO;
+		if(rc < 0) {
+			err = rc;
+			goto out_fput;
+		}
+		xcfs_block_crypt(inode, buf, old_len, unit, false);
+		if(new_len > old_len)
+			memset(buf + old_len, 0, new_len - old_len);
+		xcfs_block_crypt(inode, buf, new_len, unit, true);
+		rc = kernel_write(lower_file, buf, new_len, unit);
+		if(rc >= 0 && rc != new_len)
+			rc = -EIO;
+		if(rc < 0) {
+			err = rc;
+			goto out_fput;
+		}
+		err = xcfs_csum_update(inode, lower_file, unit, buf, new_len);
+		if(err)
+			goto out_fput;
+		done = unit;
+	}
+
+	//a new partial last unit, zeros that do not stay zero
+	unit = round_down(size, XCFS_BLOCK_SIZE);
+	new_len = size - unit;
+	if(size > old && new_len && unit != done) {
+		memset(buf, 0, new_len);
+		xcfs_block_crypt(inode, buf, new_len, unit, true);
+		rc = kernel_write(lower_file, buf, new_len, unit);
+		if(rc >= 0 && rc != new_len)
+			rc = -EIO;
+		if(rc < 0) {
+			err = rc;
+			goto out_fput;
+		}
+		err = xcfs_csum_update(inode, lower_file, unit, buf, new_len);
+	}
+	if(!err)
+		err = xcfs_csum_flush(inode);
+
+out_fput:
+	fput(lower_file);
+out_free:
+	kzfree(buf);
+	return err;
+}
+
+//Direct I/O
+
+//alignment the lower file system needs for direct I/O
+unsigned int xcfs_dio_alignment(struct inode *inode)
+{
+	struct super_block *lower_sb = xcfs_lower_super(inode->i_sb);
+	unsigned int align = 1;
+
+	//network file systems take byte-granular direct I/O
+	if (lower_sb->s_bdev)
+		align = bdev_logical_block_size(lower_sb->s_bdev);
+	//checksummed blocks are only ever written whole
+	if (xcfs_has_integrity(inode))
+		align = max_t(unsigned int, align, PAGE_SIZE);
+	return align;
+}
+
+//issues one direct read or write of bounce pages to the lower file
+static ssize_t xcfs_dio_lower(struct file *lower_file, int rw,
+			      struct bio_vec *bvec, int nr, size_t len,
+			      loff_t pos)
+{
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	iov_iter_bvec(&iter, ITER_BVEC | rw, bvec, nr, len);
+	init_sync_kiocb(&kiocb, lower_file);
+	kiocb.ki_pos = pos;
+	kiocb.ki_flags |= IOCB_DIRECT;
+
+	if (rw == READ)
+		return lower_file->f_op->read_iter(&kiocb, &iter);
+
+	file_start_write(lower_file);
+	ret = lower_file->f_op->write_iter(&kiocb, &iter);
+	file_end_write(lower_file);
+	return ret;
+}
+
+//moves up to one batch between the user iterator and the lower file
+static ssize_t xcfs_dio_batch(struct file *file, struct iov_iter *iter,
+			      struct page **pages, int nr, size_t len,
+			      loff_t pos)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	struct bio_vec bvec[XCFS_DIO_BATCH];
+	int rw = iov_iter_rw(iter);
+	ssize_t ret;
+	size_t done, copied;
+	char *virt;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		bvec[i].bv_page = pages[i];
+		bvec[i].bv_offset = 0;
+		bvec[i].bv_len = min_t(size_t, len - i * PAGE_SIZE, PAGE_SIZE);
+	}
+
+	if (rw == WRITE) {
+		//user memory is never encrypted in place
+		for (i = 0, done = 0; i < nr; i++) {
+			copied = copy_page_from_iter(pages[i], 0,
+						     bvec[i].bv_len, iter);
+			done += copied;
+			//a short copy advanced the iterator too
+			if (copied != bvec[i].bv_len) {
+				iov_iter_revert(iter, done);
+				return -EFAULT;
+			}
+			virt = kmap(pages[i]);
+			xcfs_encrypt(inode, virt, bvec[i].bv_len,
+				     pos + i * PAGE_SIZE);
+			kunmap(pages[i]);
+		}
+		ret = xcfs_dio_lower(lower_file, WRITE, bvec, nr, len, pos);
+		if (ret > 0)
+			xcfs_stat_add(inode->i_sb, lower_write_bytes, ret);
+		for (i = 0, done = 0; ret > 0 && done < ret; i++) {
+			size_t n = min_t(size_t, ret - done, PAGE_SIZE);
+			int err;
+
+			virt = kmap(pages[i]);
+			err = xcfs_csum_update(inode, NULL, pos + done, virt, n);
+			kunmap(pages[i]);
+			if (err)
+				return err;
+			done += n;
+		}
+		if (ret > 0) {
+			int err = xcfs_csum_flush(inode);
+
+			if (err)
+				return err;
+		}
+		if (ret < (ssize_t)len)
+			iov_iter_revert(iter, len - max_t(ssize_t, ret, 0));
+		return ret;
+	}
+
+	ret = xcfs_dio_lower(lower_file, READ, bvec, nr, len, pos);
+	if (ret > 0)
+		xcfs_stat_add(inode->i_sb, lower_read_bytes, ret);
+	for (i = 0, done = 0; ret > 0 && done < ret; i++) {
+		size_t n = min_t(size_t, ret - done, PAGE_SIZE);
+
+		//the bounce page is ours, decrypt it in place
+		virt = kmap(pages[i]);
+		if (xcfs_csum_verify(inode, (pos + done) >> PAGE_SHIFT,
+				     virt, n)) {
+			kunmap(pages[i]);
+			return done ? done : -EIO;
+		}
+		xcfs_decrypt(inode, virt, n, pos + done);
+		kunmap(pages[i]);
+		copied = copy_page_to_iter(pages[i], 0, n, iter);
+		if (copied != n) {
+			iov_iter_revert(iter, copied);
+			return done ? done : -EFAULT;
+		}
+		done += n;
+	}
+	return ret;
+}
+
+/*
+ * Direct I/O: the data is encrypted or decrypted in pooled, page-aligned
+ * bounce pages and moved to and from the lower file with lower direct
+ * I/O, so neither page cache holds it.  The caller advances ki_pos.
+ */
+ssize_t xcfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct file *lower_file = xcfs_lower_file(file);
+	mempool_t *pool = XCFS_SB(inode->i_sb)->bounce_pool;
+	struct page *pages[XCFS_DIO_BATCH];
+	unsigned int align = xcfs_dio_alignment(inode);
+	loff_t pos = iocb->ki_pos;
+	ssize_t done = 0, ret = 0;
+	int i, nr;
+
+	if (!lower_file->f_mapping->a_ops->direct_IO ||
+	    !lower_file->f_op->read_iter || !lower_file->f_op->write_iter)
+		return -EINVAL;
+	if ((pos | iov_iter_count(iter)) & (align - 1))
+		return -EINVAL;
+
+	while (iov_iter_count(iter)) {
+		size_t len = min_t(size_t, iov_iter_count(iter),
+				   XCFS_DIO_BATCH * PAGE_SIZE);
+
+		/*
+		 * Only the first page may wait on the pool: waiting for a
+		 * second one while holding the first can deadlock.
+		 */
+		pages[0] = mempool_alloc(pool, GFP_NOFS);
+		for (nr = 1; nr < DIV_ROUND_UP(len, PAGE_SIZE); nr++) {
+			pages[nr] = mempool_alloc(pool, GFP_NOWAIT);
+			if (!pages[nr])
+				break;
+		}
+		len = min_t(size_t, len, nr * PAGE_SIZE);
+
+		ret = xcfs_dio_batch(file, iter, pages, nr, len, pos);
+
+		for (i = 0; i < nr; i++)
+			mempool_free(pages[i], pool);
+		if (ret <= 0)
+			break;
+		done += ret;
+		pos += ret;
+		if (ret < len)
+			break;
+	}
+	return done ? done : ret;
 }
 
 const struct address_space_operations xcfs_addr_ops = {
 	.readpage 	= xcfs_readpage,
+	.readpages	= xcfs_readpages,
 	.writepage 	= xcfs_writepage,
+	.writepages	= xcfs_writepages,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
+	.write_begin	= xcfs_write_begin,
+	.write_end	= xcfs_write_end,
+	.direct_IO	= xcfs_direct_IO,
 };
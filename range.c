@@ -0,0 +1,81 @@
+#include "xcfs.h"
+
+/*
+ * Per-inode byte-range lock for writers.  Everything that encrypts data
+ * and writes it to the lower file (write(2), splice, direct I/O and
+ * writeback) holds the range it writes, so that overlapping writes land
+ * whole, ciphertext and checksums alike, while writers to disjoint ranges
+ * of one file encrypt and write side by side.  Readers take no lock.
+ *
+ * A range reaching XCFS_RANGE_EOF covers whatever lies past eof: writers
+ * that append or truncate take one, so that they see a stable size.
+ *
+ * Holding a range never waits for upper page writeback, which takes
+ * ranges of its own; page-cache invalidation comes after the unlock.
+ */
+
+/* this function takes a range if nothing held overlaps it */
+static bool xcfs_range_try(struct xcfs_range_lock *rl, struct xcfs_range *r)
+{
+	struct xcfs_range *held;
+	bool ok = true;
+
+	spin_lock(&rl->lock);
+	list_for_each_entry(held, &rl->held, list) {
+		if (held->start <= r->end && r->start <= held->end) {
+			ok = false;
+			break;
+		}
+	}
+	if (ok)
+		list_add(&r->list, &rl->held);
+	spin_unlock(&rl->lock);
+	return ok;
+}
+
+void xcfs_range_lock_init(struct xcfs_range_lock *rl)
+{
+	spin_lock_init(&rl->lock);
+	INIT_LIST_HEAD(&rl->held);
+	init_waitqueue_head(&rl->wait);
+}
+
+/* this function locks bytes [start, end] of an inode against writers */
+void xcfs_range_lock(struct inode *inode, struct xcfs_range *r,
+		     loff_t start, loff_t end)
+{
+	struct xcfs_range_lock *rl = &XCFS_I(inode)->ranges;
+
+	r->start = start;
+	r->end = end;
+	wait_event(rl->wait, xcfs_range_try(rl, r));
+}
+
+void xcfs_range_unlock(struct inode *inode, struct xcfs_range *r)
+{
+	struct xcfs_range_lock *rl = &XCFS_I(inode)->ranges;
+
+	spin_lock(&rl->lock);
+	list_del(&r->list);
+	spin_unlock(&rl->lock);
+	wake_up_all(&rl->wait);
+}
+
+/*
+ * this function locks from the lower eof on, for an append; returns the
+ * eof, which cannot move while the range is held
+ */
+loff_t xcfs_range_lock_eof(struct inode *inode, struct xcfs_range *r)
+{
+	struct inode *lower_inode = xcfs_lower_inode(inode);
+	loff_t pos;
+
+	for (;;) {
+		pos = i_size_read(lower_inode);
+		xcfs_range_lock(inode, r, pos, XCFS_RANGE_EOF);
+		/* only a truncate can have cut below us meanwhile */
+		if (i_size_read(lower_inode) >= pos)
+			return i_size_read(lower_inode);
+		xcfs_range_unlock(inode, r);
+	}
+}
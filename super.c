@@ -13,15 +13,106 @@ static void xcfs_put_super(struct super_block* sb)
 	if (!spd)
 		return;
 
+	xcfs_put_meta_dir(sb);
+
 	/* decrement lower super references */
 	s = xcfs_lower_super(sb);
 	xcfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+	xcfs_sysfs_unregister(sb);
+	put_cred(spd->creator_cred);
+	xcfs_fh_cache_free(sb);
+	xcfs_ihash_free(sb);
+	xcfs_crypt_exit(sb);
+	mempool_destroy(spd->bounce_pool);
+	memzero_explicit(spd->ctr_key, sizeof(spd->ctr_key));
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
 
+/*
+ * this function calls fn on every live inode of a superblock, the way
+ * drop_pagecache_sb walks them
+ */
+static void xcfs_for_each_inode(struct super_block *sb,
+				void (*fn)(struct inode *inode, int wait),
+				int wait)
+{
+	struct inode *inode, *toput_inode = NULL;
+
+	spin_lock(&sb->s_inode_list_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		spin_lock(&inode->i_lock);
+		if ((inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW)) ||
+		    !xcfs_lower_inode(inode)) {
+			spin_unlock(&inode->i_lock);
+			continue;
+		}
+		__iget(inode);
+		spin_unlock(&inode->i_lock);
+		spin_unlock(&sb->s_inode_list_lock);
+
+		fn(inode, wait);
+
+		iput(toput_inode);
+		toput_inode = inode;
+		cond_resched();
+		spin_lock(&sb->s_inode_list_lock);
+	}
+	spin_unlock(&sb->s_inode_list_lock);
+	iput(toput_inode);
+}
+
+/* this function starts writeback of the lower pages of an inode */
+static void xcfs_sync_start(struct inode *inode, int wait)
+{
+	struct address_space *lower_mapping = xcfs_lower_inode(inode)->i_mapping;
+
+	/* checksums still in memory go to their sidecars */
+	if (inode->i_nlink)
+		xcfs_csum_flush(inode);
+	if (!mapping_tagged(lower_mapping, PAGECACHE_TAG_DIRTY))
+		return;
+	if (wait)
+		filemap_fdatawrite(lower_mapping);
+	else
+		filemap_flush(lower_mapping);
+}
+
+/* this function waits for the writeback xcfs_sync_start started */
+static void xcfs_sync_wait(struct inode *inode, int wait)
+{
+	struct address_space *lower_mapping = xcfs_lower_inode(inode)->i_mapping;
+
+	if (mapping_tagged(lower_mapping, PAGECACHE_TAG_WRITEBACK))
+		filemap_fdatawait_keep_errors(lower_mapping);
+}
+
+/*
+ * this function syncs a mount for sync(2) and syncfs(2).  The VFS has
+ * already written our dirty pages into the lower page cache; now the
+ * lower pages of all our inodes are written at once, so their I/O runs
+ * in parallel, waited for, and the lower file system commits its own
+ * metadata.  Lower inodes we never touched are left to its own sync.
+ */
+static int xcfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct super_block *lower_sb = xcfs_lower_super(sb);
+	int err = 0;
+
+	xcfs_for_each_inode(sb, xcfs_sync_start, wait);
+	if (wait)
+		xcfs_for_each_inode(sb, xcfs_sync_wait, wait);
+
+	if (lower_sb->s_op->sync_fs) {
+		down_read(&lower_sb->s_umount);
+		err = lower_sb->s_op->sync_fs(lower_sb, wait);
+		up_read(&lower_sb->s_umount);
+	}
+	return err;
+}
+
 /* copied from wrapfs */
 /* this function defines how to get information on a dentry in a superblock */
 static int xcfs_statfs(struct dentry *dentry, struct kstatfs *buf)
@@ -43,8 +134,6 @@ static int xcfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 /* this function defines how to remount a filesystem */
 static int xcfs_remount_fs(struct super_block *sb, int *flags, char *options)
 {
-	int err = 0;
-
 	/*
 	 * The VFS will take care of "ro" and "rw" flags among others.  We
 	 * can safely accept a few flags (RDONLY, MANDLOCK), and honor
@@ -53,10 +142,11 @@ static int xcfs_remount_fs(struct super_block *sb, int *flags, char *options)
 	if ((*flags & ~(MS_RDONLY | MS_MANDLOCK | MS_SILENT)) != 0) {
 		printk(KERN_ERR
 		       "xcfs: remount flags 0x%x unsupported\n", *flags);
-		err = -EINVAL;
+		return -EINVAL;
 	}
 
-	return err;
+	/* only the tunables may change, see xcfs_change_options */
+	return xcfs_change_options(sb, options);
 }
 
 /*
@@ -71,8 +161,27 @@ static void xcfs_evict_inode(struct inode *inode)
 {
 	struct inode *lower_inode;
 
+	/* the last writable release normally wrote these back already */
+	if (inode->i_nlink && XCFS_I(inode)->wb_file)
+		filemap_write_and_wait(&inode->i_data);
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	xcfs_drop_link(inode);
+	/* last chance to store checksums changed since the last close */
+	if (inode->i_nlink)
+		xcfs_csum_flush(inode);
+	xcfs_csum_free(inode);
+	/* the sidecar goes with the last link of the lower file */
+	if (!xcfs_lower_inode(inode)->i_nlink)
+		xcfs_csum_remove(inode);
+	if (XCFS_I(inode)->wb_file) {
+		fput(XCFS_I(inode)->wb_file);
+		XCFS_I(inode)->wb_file = NULL;
+	}
+	xcfs_put_lower_files(inode);
+	xcfs_xattr_cache_free(inode);
+	/* done with the lower inode, a new upper inode may take over */
+	xcfs_ihash_remove(inode);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -95,15 +204,28 @@ static struct inode *xcfs_alloc_inode(struct super_block *sb)
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct xcfs_inode_info, vfs_inode));
 
+	spin_lock_init(&i->lower_lock);
+	INIT_LIST_HEAD(&i->lower_files);
+	xcfs_xattr_cache_init(&i->vfs_inode);
+	xcfs_range_lock_init(&i->ranges);
+	mutex_init(&i->extent_lock);
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
 }
 
-/* copied from wrapfs */
+/* frees an inode once rcu-walk can no longer see it */
+static void xcfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(xcfs_inode_cachep, XCFS_I(inode));
+}
+
+/* copied from wrapfs and modified */
 /* this function defines how to destroy an inode */
 static void xcfs_destroy_inode(struct inode *inode)
 {
-	kmem_cache_free(xcfs_inode_cachep, XCFS_I(inode));
+	call_rcu(&inode->i_rcu, xcfs_i_callback);
 }
 
 /* xcfs inode cache constructor */
@@ -133,6 +255,8 @@ int xcfs_init_inode_cache(void)
 /* xcfs inode cache destructor */
 void xcfs_destroy_inode_cache(void)
 {
+	/* wait for pending xcfs_i_callback()s before tearing down the cache */
+	rcu_barrier();
 	if (xcfs_inode_cachep)
 		kmem_cache_destroy(xcfs_inode_cachep);
 }
@@ -153,55 +277,67 @@ static void xcfs_umount_begin(struct super_block *sb)
 }
 
 
+/* this function prints the mount options in /proc/mounts */
+static int xcfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(root->d_sb);
+
+	/* the key is never shown */
+	if (sbi->format == XCFS_FMT_SPARSE)
+		seq_puts(m, ",sparse");
+	else if (sbi->format == XCFS_FMT_CTR)
+		seq_puts(m, ",ctr");
+	else if (sbi->format == XCFS_FMT_BLOCK)
+		seq_puts(m, ",block");
+	seq_printf(m, ",cache=%s",
+		   sbi->cache == XCFS_CACHE_UPPER ? "upper" : "lower");
+	if (sbi->integrity)
+		seq_puts(m, ",integrity");
+	if (sbi->compress)
+		seq_puts(m, ",compress");
+	if (sbi->crypt_threshold != XCFS_CRYPT_THRESHOLD)
+		seq_printf(m, ",crypt_threshold=%u", sbi->crypt_threshold);
+	if (sbi->readahead_kb)
+		seq_printf(m, ",readahead_kb=%u", sbi->readahead_kb);
+	if (sbi->crypto_workers)
+		seq_printf(m, ",crypto_workers=%u", sbi->crypto_workers);
+	if (sbi->bounce_pool_pages != XCFS_BOUNCE_POOL_PAGES)
+		seq_printf(m, ",bounce_pool_pages=%u", sbi->bounce_pool_pages);
+	if (sbi->attr_timeout)
+		seq_printf(m, ",attr_timeout=%u", sbi->attr_timeout);
+	if (sbi->writeback == XCFS_WB_SYNC)
+		seq_puts(m, ",writeback=sync");
+	return 0;
+}
+
+/* this function prints the counters in /proc/self/mountstats */
+static int xcfs_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(root->d_sb);
+	struct xcfs_stats *st = &sbi->stats;
+
+	seq_printf(m, "cache=%s readpages=%lld lower_read_bytes=%lld "
+		   "lower_write_bytes=%lld lower_dropped=%lld "
+		   "crypt_offloaded=%lld",
+		   sbi->cache == XCFS_CACHE_UPPER ? "upper" : "lower",
+		   (long long)atomic64_read(&st->readpages),
+		   (long long)atomic64_read(&st->lower_read_bytes),
+		   (long long)atomic64_read(&st->lower_write_bytes),
+		   (long long)atomic64_read(&st->lower_dropped),
+		   (long long)atomic64_read(&st->crypt_offloaded));
+	return 0;
+}
 
 const struct super_operations xcfs_sb_ops = {
 	.put_super	    = xcfs_put_super,
+	.sync_fs	= xcfs_sync_fs,
 	.statfs		    = xcfs_statfs,
 	.remount_fs	    = xcfs_remount_fs,
 	.evict_inode	= xcfs_evict_inode,
 	.umount_begin	= xcfs_umount_begin,
-	.show_options	= generic_show_options,
+	.show_options	= xcfs_show_options,
+	.show_stats	= xcfs_show_stats,
 	.alloc_inode	= xcfs_alloc_inode,
 	.destroy_inode	= xcfs_destroy_inode,
 	.drop_inode	    = generic_delete_inode,
 };
-
-/* NFS support */
-
-static struct inode *xcfs_nfs_get_inode(struct super_block *sb, u64 ino,
-					  u32 generation)
-{
-	struct super_block *lower_sb;
-	struct inode *inode;
-	struct inode *lower_inode;
-
-	lower_sb = xcfs_lower_super(sb);
-	lower_inode = ilookup(lower_sb, ino);
-	inode = xcfs_iget(sb, lower_inode);
-	return inode;
-}
-
-static struct dentry *xcfs_fh_to_dentry(struct super_block *sb,
-					  struct fid *fid, int fh_len,
-					  int fh_type)
-{
-	return generic_fh_to_dentry(sb, fid, fh_len, fh_type,
-				    xcfs_nfs_get_inode);
-}
-
-static struct dentry *xcfs_fh_to_parent(struct super_block *sb,
-					  struct fid *fid, int fh_len,
-					  int fh_type)
-{
-	return generic_fh_to_parent(sb, fid, fh_len, fh_type,
-				    xcfs_nfs_get_inode);
-}
-
-/*
- * all other funcs are default as defined in exportfs/expfs.c
- */
-
-const struct export_operations xcfs_export_ops = {
-	.fh_to_dentry	   = xcfs_fh_to_dentry,
-	.fh_to_parent	   = xcfs_fh_to_parent
-};
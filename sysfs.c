@@ -0,0 +1,160 @@
+#include "xcfs.h"
+
+/*
+ * /sys/fs/xcfs/<major>:<minor>/ holds one file per tunable of a mount.
+ * Reading a file shows the live value; writing one goes through the same
+ * path as "mount -o remount,<name>=<value>", so both accept and refuse
+ * the same things.
+ */
+
+static struct kset *xcfs_kset;
+
+struct xcfs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct xcfs_sb_info *sbi, char *buf);
+};
+
+#define XCFS_UINT_ATTR(_name)						\
+static ssize_t xcfs_show_##_name(struct xcfs_sb_info *sbi, char *buf)	\
+{									\
+	return sprintf(buf, "%u\n", READ_ONCE(sbi->_name));		\
+}									\
+static struct xcfs_attr xcfs_attr_##_name = {				\
+	.attr = { .name = #_name, .mode = 0644 },			\
+	.show = xcfs_show_##_name,					\
+}
+
+XCFS_UINT_ATTR(readahead_kb);
+XCFS_UINT_ATTR(crypto_workers);
+XCFS_UINT_ATTR(bounce_pool_pages);
+XCFS_UINT_ATTR(attr_timeout);
+XCFS_UINT_ATTR(crypt_threshold);
+
+static ssize_t xcfs_show_cache(struct xcfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%s\n", READ_ONCE(sbi->cache) == XCFS_CACHE_UPPER ?
+		       "upper" : "lower");
+}
+
+static struct xcfs_attr xcfs_attr_cache = {
+	.attr = { .name = "cache", .mode = 0644 },
+	.show = xcfs_show_cache,
+};
+
+static ssize_t xcfs_show_writeback(struct xcfs_sb_info *sbi, char *buf)
+{
+	return sprintf(buf, "%s\n", READ_ONCE(sbi->writeback) == XCFS_WB_SYNC ?
+		       "sync" : "async");
+}
+
+static struct xcfs_attr xcfs_attr_writeback = {
+	.attr = { .name = "writeback", .mode = 0644 },
+	.show = xcfs_show_writeback,
+};
+
+static struct attribute *xcfs_attrs[] = {
+	&xcfs_attr_cache.attr,
+	&xcfs_attr_readahead_kb.attr,
+	&xcfs_attr_crypto_workers.attr,
+	&xcfs_attr_bounce_pool_pages.attr,
+	&xcfs_attr_attr_timeout.attr,
+	&xcfs_attr_writeback.attr,
+	&xcfs_attr_crypt_threshold.attr,
+	NULL,
+};
+
+static ssize_t xcfs_attr_show(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	struct xcfs_sb_info *sbi = container_of(kobj, struct xcfs_sb_info,
+						kobj);
+	struct xcfs_attr *a = container_of(attr, struct xcfs_attr, attr);
+
+	return a->show(sbi, buf);
+}
+
+/* this function turns "value\n" into "name=value" and remounts with it */
+static ssize_t xcfs_attr_store(struct kobject *kobj, struct attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct xcfs_sb_info *sbi = container_of(kobj, struct xcfs_sb_info,
+						kobj);
+	char *option;
+	int err;
+
+	option = kasprintf(GFP_KERNEL, "%s=%.*s", attr->name,
+			   (int)strcspn(buf, "\n"), buf);
+	if (!option)
+		return -ENOMEM;
+	/* a comma would smuggle in a second option */
+	err = -EINVAL;
+	if (!strchr(option, ','))
+		err = xcfs_change_options(sbi->sb, option);
+	kfree(option);
+	return err ? err : len;
+}
+
+static const struct sysfs_ops xcfs_sysfs_ops = {
+	.show	= xcfs_attr_show,
+	.store	= xcfs_attr_store,
+};
+
+static void xcfs_sb_release(struct kobject *kobj)
+{
+	struct xcfs_sb_info *sbi = container_of(kobj, struct xcfs_sb_info,
+						kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type xcfs_sb_ktype = {
+	.default_attrs	= xcfs_attrs,
+	.sysfs_ops	= &xcfs_sysfs_ops,
+	.release	= xcfs_sb_release,
+};
+
+/* this function adds the directory of a mount */
+int xcfs_sysfs_register(struct super_block *sb)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+	int err;
+
+	sbi->sb = sb;
+	sbi->kobj.kset = xcfs_kset;
+	init_completion(&sbi->kobj_unregister);
+	err = kobject_init_and_add(&sbi->kobj, &xcfs_sb_ktype, NULL,
+				   "%u:%u", MAJOR(sb->s_dev),
+				   MINOR(sb->s_dev));
+	if (err) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+		/* xcfs_sysfs_unregister has nothing left to do */
+		memset(&sbi->kobj, 0, sizeof(sbi->kobj));
+	}
+	return err;
+}
+
+/* this function removes the directory of a mount, before sbi is freed */
+void xcfs_sysfs_unregister(struct super_block *sb)
+{
+	struct xcfs_sb_info *sbi = XCFS_SB(sb);
+
+	if (!sbi->kobj.state_initialized)
+		return;
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+}
+
+int xcfs_init_sysfs(void)
+{
+	xcfs_kset = kset_create_and_add("xcfs", NULL, fs_kobj);
+	if (!xcfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void xcfs_exit_sysfs(void)
+{
+	kset_unregister(xcfs_kset);
+}
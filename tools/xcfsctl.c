@@ -0,0 +1,1882 @@
+/*
+ * xcfsctl - offline tools for xcfs lower trees
+ *
+ *	xcfsctl migrate [options] SRC DST
+ *		writes every file of SRC into DST, a new lower tree
+ *	xcfsctl convert [options] DIR
+ *		rewrites every file of the lower tree DIR in place
+ *	xcfsctl scrub [options] DIR
+ *		reads every file of the lower tree DIR and checks it
+ *
+ * Data is transformed with the same code as the module, see
+ * ../xcfs_format.h, so that a mount reads back exactly what was written.
+ * The lower trees must not be mounted while migrate or convert runs;
+ * scrub only reads, and is meant to run under a live mount.
+ *
+ * The tree is walked by a pool of threads, each with its own deque of
+ * directories and files to do; an idle thread steals the oldest task of
+ * another, which tends to be a directory high up with lots of work
+ * below it.  Files are moved in large sequential chunks with pread and
+ * pwrite, and the page cache behind them is dropped as they go.
+ *
+ * With --journal, finished files are recorded and skipped by the next
+ * run with the same journal.  Converting in place then also saves the
+ * old contents of every --checkpoint window to an undo file before the
+ * window is rewritten, so a run killed part way resumes without losing
+ * data.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <linux/types.h>
+
+#include "../xcfs_format.h"
+
+#define FMT_PLAIN		(-1)	/* no transform, no header */
+#define DEF_CHUNK		(1 << 20)
+#define DEF_CHECKPOINT		(64 << 20)
+#define HDR_EXTENT_SHIFT	12	/* PAGE_SHIFT of the module */
+#define SET_BUCKETS		65536
+
+static struct {
+	const char *cmd;
+	const char *src;	/* tree read from */
+	const char *dst;	/* tree written to, == src to convert */
+	bool src_plain;		/* source files hold plaintext */
+	int format;		/* XCFS_FMT_* or FMT_PLAIN to write */
+	__u32 key[8];
+	__u32 new_key[8];	/* key to write with, key by default */
+	bool has_key, has_new_key;
+	int threads;
+	size_t chunk;
+	size_t checkpoint;
+	double bwlimit;		/* bytes per second, 0: no limit */
+	double iops;		/* reads and writes per second, 0: no limit */
+	const char *journal;
+	int settle;		/* scrub: seconds a file must be left alone */
+	bool verbose;
+} opt = {
+	.format = XCFS_FMT_CTR,
+	.chunk = DEF_CHUNK,
+	.checkpoint = DEF_CHECKPOINT,
+	.settle = 60,
+};
+
+static long nr_errors;
+static long nr_files;
+static unsigned long long nr_bytes;
+static long nr_bad;		/* scrub: bad extents found */
+static long nr_busy;		/* scrub: files changed while read */
+static volatile sig_atomic_t paused;
+
+static void msg(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "xcfsctl: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+}
+
+/* reports a failure that does not stop the run */
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "xcfsctl: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	__atomic_add_fetch(&nr_errors, 1, __ATOMIC_RELAXED);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		msg("out of memory");
+		exit(2);
+	}
+	return p;
+}
+
+static char *join(const char *root, const char *rel)
+{
+	char *p;
+
+	if (asprintf(&p, "%s%s%s", root, *rel ? "/" : "", rel) < 0) {
+		msg("out of memory");
+		exit(2);
+	}
+	return p;
+}
+
+/* ChaCha20 block function, as lib/chacha20.c of the kernel */
+#define ROTL32(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d)						\
+	do {							\
+		x[a] += x[b]; x[d] = ROTL32(x[d] ^ x[a], 16);	\
+		x[c] += x[d]; x[b] = ROTL32(x[b] ^ x[c], 12);	\
+		x[a] += x[b]; x[d] = ROTL32(x[d] ^ x[a], 8);	\
+		x[c] += x[d]; x[b] = ROTL32(x[b] ^ x[c], 7);	\
+	} while (0)
+
+static void chacha20_block(const __u32 state[16], __u8 stream[64])
+{
+	__u32 x[16], out;
+	int i;
+
+	memcpy(x, state, sizeof(x));
+	for (i = 0; i < 20; i += 2) {
+		QR(0, 4, 8, 12);
+		QR(1, 5, 9, 13);
+		QR(2, 6, 10, 14);
+		QR(3, 7, 11, 15);
+		QR(0, 5, 10, 15);
+		QR(1, 6, 11, 12);
+		QR(2, 7, 8, 13);
+		QR(3, 4, 9, 14);
+	}
+	for (i = 0; i < 16; i++) {
+		out = htole32(x[i] + state[i]);
+		memcpy(stream + 4 * i, &out, 4);
+	}
+}
+
+/* how the data of one file is transformed */
+struct xform {
+	int format;		/* XCFS_FMT_* or FMT_PLAIN */
+	__u64 nonce;
+	const __u32 *key;
+};
+
+static bool keyed(int format)
+{
+	return format == XCFS_FMT_CTR || format == XCFS_FMT_BLOCK;
+}
+
+static void ctr_xor(const struct xform *x, __u8 *buf, size_t len, __u64 pos)
+{
+	size_t skip = pos & 63, n, i;
+	__u64 block = pos / 64;
+	__u32 state[16];
+	__u8 ks[64];
+
+	while (len) {
+		n = len < 64 - skip ? len : 64 - skip;
+		xcfs_ctr_state(state, x->key, x->nonce, block);
+		chacha20_block(state, ks);
+		for (i = 0; i < n; i++)
+			buf[i] ^= ks[skip + i];
+		buf += n;
+		len -= n;
+		skip = 0;
+		block++;
+	}
+}
+
+static bool all_zero(const __u8 *p, size_t len)
+{
+	return !len || (!p[0] && !memcmp(p, p + 1, len - 1));
+}
+
+/* transforms len bytes at pos; pos starts a chunk, len ends one or eof */
+static void xform_apply(const struct xform *x, __u8 *buf, size_t len,
+			__u64 pos, bool encrypt)
+{
+	size_t n;
+
+	switch (x->format) {
+	case FMT_PLAIN:
+		break;
+	case XCFS_FMT_SHIFT:
+		if (encrypt)
+			xcfs_shift_encrypt(buf, len);
+		else
+			xcfs_shift_decrypt(buf, len);
+		break;
+	case XCFS_FMT_SPARSE:
+		if (encrypt)
+			xcfs_sparse_encrypt(buf, len);
+		else
+			xcfs_sparse_decrypt(buf, len);
+		break;
+	case XCFS_FMT_CTR:
+		ctr_xor(x, buf, len, pos);
+		break;
+	case XCFS_FMT_BLOCK:
+		for (; len; buf += n, pos += n, len -= n) {
+			n = len < XCFS_BLOCK_SIZE ? len : XCFS_BLOCK_SIZE;
+			/* full units of zeros stay zeros */
+			if (n == XCFS_BLOCK_SIZE && all_zero(buf, n))
+				continue;
+			if (encrypt) {
+				xcfs_block_mix(buf, n);
+				ctr_xor(x, buf, n, pos);
+			} else {
+				ctr_xor(x, buf, n, pos);
+				xcfs_block_unmix(buf, n);
+			}
+		}
+		break;
+	}
+}
+
+static const char *format_name(int format)
+{
+	switch (format) {
+	case FMT_PLAIN:		return "plain";
+	case XCFS_FMT_SHIFT:	return "shift";
+	case XCFS_FMT_SPARSE:	return "sparse";
+	case XCFS_FMT_CTR:	return "ctr";
+	case XCFS_FMT_BLOCK:	return "block";
+	}
+	return "unknown";
+}
+
+static int parse_format(const char *name)
+{
+	int f;
+
+	for (f = FMT_PLAIN; f <= XCFS_FMT_MAX; f++)
+		if (!strcmp(name, format_name(f)))
+			return f;
+	msg("unknown format %s", name);
+	exit(2);
+}
+
+/* a key is 64 hex digits, the payload of the mount's key_desc= key */
+static void parse_key(const char *hex, __u32 key[8])
+{
+	unsigned int byte;
+	__u8 raw[32];
+	__u32 word;
+	int i;
+
+	if (strlen(hex) != 64)
+		goto bad;
+	for (i = 0; i < 32; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			goto bad;
+		raw[i] = byte;
+	}
+	for (i = 0; i < 8; i++) {
+		memcpy(&word, raw + 4 * i, 4);
+		key[i] = le32toh(word);
+	}
+	memset(raw, 0, sizeof(raw));
+	return;
+bad:
+	msg("a key is 64 hex digits");
+	exit(2);
+}
+
+static __u64 new_nonce(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static int fd = -1;
+	__u64 nonce;
+
+	pthread_mutex_lock(&lock);
+	if (fd < 0)
+		fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || read(fd, &nonce, sizeof(nonce)) != sizeof(nonce)) {
+		msg("cannot read /dev/urandom");
+		exit(2);
+	}
+	pthread_mutex_unlock(&lock);
+	return nonce & ((1ULL << 56) - 1);
+}
+
+/*
+ * reads the header of a lower file, as xcfs_read_header does.  With
+ * flags, the file's optional features are returned there and only the
+ * header is checked; without, files this tool cannot transform are
+ * refused.  Returns 1 if the file can be used, 0 if it must be left
+ * alone and -1 if its header is damaged.
+ */
+static int header_read(int fd, const char *path, struct xform *x,
+		       __u16 *flagsp)
+{
+	struct xcfs_disk_header disk;
+	__u64 nonce = 0;
+	ssize_t len;
+	__u16 flags;
+
+	x->format = XCFS_FMT_SHIFT;
+	x->nonce = 0;
+	x->key = opt.key;
+	if (flagsp)
+		*flagsp = 0;
+	len = fgetxattr(fd, XCFS_HDR_XATTR, &disk, sizeof(disk));
+	if (len < 0 && (errno == ENODATA || errno == ENOTSUP))
+		return 1;
+	if (len < 0 && errno != ERANGE) {
+		fail("%s: cannot read header: %s", path, strerror(errno));
+		return -1;
+	}
+	if (len != sizeof(disk) || le32toh(disk.magic) != XCFS_HDR_MAGIC) {
+		fail("%s: damaged header", path);
+		return -1;
+	}
+	flags = le16toh(disk.flags);
+	if (disk.version > XCFS_HDR_VERSION || disk.format > XCFS_FMT_MAX ||
+	    (flags & ~XCFS_HDR_KNOWN_FLAGS)) {
+		fail("%s: written by a newer xcfs, skipped", path);
+		return 0;
+	}
+	x->format = disk.format;
+	memcpy(&nonce, disk.nonce, sizeof(disk.nonce));
+	x->nonce = le64toh(nonce);
+	if (flagsp) {
+		*flagsp = flags;
+		return 1;
+	}
+
+	/* checksums and extent maps are only kept up by the module */
+	if (flags) {
+		fail("%s: checksummed or compressed, copy it through a mount",
+		     path);
+		return 0;
+	}
+	if (keyed(disk.format) && !opt.has_key) {
+		fail("%s: %s format needs --key", path,
+		     format_name(disk.format));
+		return 0;
+	}
+	return 1;
+}
+
+static int header_write(int fd, const struct xform *x)
+{
+	struct xcfs_disk_header disk;
+	__u64 nonce = htole64(x->nonce);
+
+	if (x->format == FMT_PLAIN) {
+		if (fremovexattr(fd, XCFS_HDR_XATTR) && errno != ENODATA)
+			return -1;
+		return 0;
+	}
+	memset(&disk, 0, sizeof(disk));
+	disk.magic = htole32(XCFS_HDR_MAGIC);
+	disk.version = XCFS_HDR_VERSION;
+	disk.format = x->format;
+	disk.extent_shift = HDR_EXTENT_SHIFT;
+	if (keyed(x->format))
+		memcpy(disk.nonce, &nonce, sizeof(disk.nonce));
+	return fsetxattr(fd, XCFS_HDR_XATTR, &disk, sizeof(disk), 0);
+}
+
+/* the transform files are written with */
+static void target_xform(struct xform *x)
+{
+	x->format = opt.format;
+	x->key = opt.has_new_key ? opt.new_key : opt.key;
+	x->nonce = keyed(x->format) ? new_nonce() : 0;
+}
+
+/*
+ * I/O budget: token buckets refilled at --bwlimit bytes and --iops
+ * operations per second, shared by all threads, with a second of burst.
+ */
+struct bucket {
+	pthread_mutex_t lock;
+	double rate;
+	double tokens;
+	struct timespec last;
+};
+
+static struct bucket bw_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct bucket iops_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void bucket_take(struct bucket *b, double n)
+{
+	struct timespec now, ts;
+	double wait = 0;
+
+	if (!b->rate)
+		return;
+	pthread_mutex_lock(&b->lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (b->last.tv_sec || b->last.tv_nsec)
+		b->tokens += ((now.tv_sec - b->last.tv_sec) +
+			      (now.tv_nsec - b->last.tv_nsec) / 1e9) * b->rate;
+	else
+		b->tokens = b->rate;
+	if (b->tokens > b->rate)
+		b->tokens = b->rate;
+	b->last = now;
+	b->tokens -= n;
+	if (b->tokens < 0)
+		wait = -b->tokens / b->rate;
+	pthread_mutex_unlock(&b->lock);
+
+	if (wait > 0) {
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+	}
+}
+
+/* SIGUSR1 pauses the run before its next I/O, SIGUSR2 resumes it */
+static void pause_signal(int sig)
+{
+	paused = sig == SIGUSR1;
+}
+
+static void throttle(size_t bytes)
+{
+	struct timespec ts = { 0, 100 * 1000 * 1000 };
+
+	while (paused)
+		nanosleep(&ts, NULL);
+	bucket_take(&bw_bucket, bytes);
+	bucket_take(&iops_bucket, 1);
+}
+
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, (char *)buf + done, len - done, pos + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (!n)
+			break;
+		done += n;
+	}
+	throttle(done);
+	return done;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	throttle(len);
+	while (done < len) {
+		n = pwrite(fd, (const char *)buf + done, len - done, pos + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* string and inode sets, for the journal and for hard links */
+struct entry {
+	struct entry *next;
+	dev_t dev;
+	ino_t ino;
+	char *path;
+	/* in-place progress, see convert_file */
+	off_t off;
+	size_t len;
+	__u64 nonce;
+	char *undo;
+	/* hard links, see claim_inode */
+	bool done;		/* the first name is finished with the inode */
+	char **waiting;		/* further names, to link once it is */
+	size_t nr_waiting;
+};
+
+struct set {
+	pthread_mutex_t lock;
+	struct entry *buckets[SET_BUCKETS];
+};
+
+static unsigned int hash_str(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % SET_BUCKETS;
+}
+
+static unsigned int hash_ino(dev_t dev, ino_t ino)
+{
+	return (unsigned int)((ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 16) %
+	       SET_BUCKETS;
+}
+
+static struct entry *set_find_path(struct set *s, const char *path)
+{
+	struct entry *e;
+
+	for (e = s->buckets[hash_str(path)]; e; e = e->next)
+		if (!strcmp(e->path, path))
+			return e;
+	return NULL;
+}
+
+static struct entry *set_add_path(struct set *s, const char *path)
+{
+	struct entry *e = set_find_path(s, path);
+	unsigned int h;
+
+	if (e)
+		return e;
+	e = calloc(1, sizeof(*e));
+	if (!e || !(e->path = strdup(path))) {
+		msg("out of memory");
+		exit(2);
+	}
+	h = hash_str(path);
+	e->next = s->buckets[h];
+	s->buckets[h] = e;
+	return e;
+}
+
+static struct set done_set = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct set progress_set = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct set inode_set = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Journal, one record per line:
+ *	D <path>				file finished
+ *	I <dev> <ino> <path>			inode with more links, done
+ *						under the name path
+ *	P <off> <len> <nonce> <dev> <ino> <undo> <path>
+ *						window at off being rewritten,
+ *						its old bytes are in undo; an
+ *						empty one at eof: the header
+ * Paths are relative to the tree and come last, so may hold spaces.
+ * Progress is kept by inode, which any of its names may pick up.
+ */
+static FILE *journal;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* what claim_inode found */
+enum { CLAIM_FIRST, CLAIM_DONE, CLAIM_BUSY };
+
+static struct entry *find_inode(dev_t dev, ino_t ino)
+{
+	struct entry *e;
+
+	for (e = inode_set.buckets[hash_ino(dev, ino)]; e; e = e->next)
+		if (e->dev == dev && e->ino == ino)
+			return e;
+	return NULL;
+}
+
+static struct entry *add_inode(dev_t dev, ino_t ino, const char *path)
+{
+	struct entry *e = calloc(1, sizeof(*e));
+	unsigned int h = hash_ino(dev, ino);
+
+	if (!e || !(e->path = strdup(path))) {
+		msg("out of memory");
+		exit(2);
+	}
+	e->dev = dev;
+	e->ino = ino;
+	e->next = inode_set.buckets[h];
+	inode_set.buckets[h] = e;
+	return e;
+}
+
+/*
+ * this function claims an inode with more than one link.  The first name
+ * to come gets CLAIM_FIRST and must call release_inode when it is done
+ * with the inode.  Later names get CLAIM_DONE, with the first name in
+ * *first, once that happened, and CLAIM_BUSY before; with wait set they
+ * are then kept for release_inode to hand back to the caller.
+ */
+static int claim_inode(const struct stat *st, const char *path, bool wait,
+		       char **first)
+{
+	struct entry *e;
+	int ret = CLAIM_BUSY;
+	char *name;
+
+	pthread_mutex_lock(&inode_set.lock);
+	e = find_inode(st->st_dev, st->st_ino);
+	if (!e) {
+		add_inode(st->st_dev, st->st_ino, path);
+		ret = CLAIM_FIRST;
+	} else if (e->done) {
+		*first = strdup(e->path);
+		ret = CLAIM_DONE;
+	} else if (wait) {
+		name = strdup(path);
+		e->waiting = realloc(e->waiting, (e->nr_waiting + 1) *
+				     sizeof(*e->waiting));
+		if (!name || !e->waiting)
+			exit(2);
+		e->waiting[e->nr_waiting++] = name;
+	}
+	pthread_mutex_unlock(&inode_set.lock);
+	return ret;
+}
+
+/*
+ * this function gives up the claim of the first name on an inode and
+ * returns the names that waited for it, *nr of them.  Done with ok
+ * clear, the inode is up for grabs again: the next name claims it.
+ */
+static char **release_inode(const struct stat *st, bool ok, size_t *nr)
+{
+	struct entry *e, **p;
+	char **waiting;
+
+	pthread_mutex_lock(&inode_set.lock);
+	e = find_inode(st->st_dev, st->st_ino);
+	waiting = e->waiting;
+	*nr = e->nr_waiting;
+	e->waiting = NULL;
+	e->nr_waiting = 0;
+	if (ok) {
+		e->done = true;
+	} else {
+		p = &inode_set.buckets[hash_ino(st->st_dev, st->st_ino)];
+		while (*p != e)
+			p = &(*p)->next;
+		*p = e->next;
+		free(e->path);
+		free(e);
+	}
+	pthread_mutex_unlock(&inode_set.lock);
+	return waiting;
+}
+
+static void journal_load(void)
+{
+	char *line = NULL, undo[PATH_MAX], key[40];
+	size_t cap = 0;
+	long long off;
+	unsigned long long nonce, dev, ino;
+	size_t len;
+	ssize_t n;
+	int skip;
+	struct entry *e;
+	FILE *f;
+
+	f = fopen(opt.journal, "r");
+	if (f) {
+		while ((n = getline(&line, &cap, f)) > 0) {
+			if (line[n - 1] != '\n')
+				break;	/* torn last record */
+			line[n - 1] = 0;
+			if (!strncmp(line, "D ", 2)) {
+				set_add_path(&done_set, line + 2);
+			} else if (sscanf(line, "P %lld %zu %llx %llx %llx "
+					  "%4095s %n", &off, &len, &nonce,
+					  &dev, &ino, undo, &skip) == 6) {
+				snprintf(key, sizeof(key), "%llx:%llx", dev,
+					 ino);
+				e = set_add_path(&progress_set, key);
+				free(e->undo);
+				e->off = off;
+				e->len = len;
+				e->nonce = nonce;
+				e->undo = strdup(undo);
+			} else if (sscanf(line, "I %llu %llu %n", &dev, &ino,
+					  &skip) == 2 && !find_inode(dev, ino)) {
+				add_inode(dev, ino, line + skip)->done = true;
+			}
+		}
+		free(line);
+		fclose(f);
+	}
+
+	journal = fopen(opt.journal, "a");
+	if (!journal) {
+		msg("%s: %s", opt.journal, strerror(errno));
+		exit(2);
+	}
+}
+
+static void journal_write(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!journal)
+		return;
+	pthread_mutex_lock(&journal_lock);
+	va_start(ap, fmt);
+	vfprintf(journal, fmt, ap);
+	va_end(ap);
+	if (fflush(journal) || fdatasync(fileno(journal))) {
+		msg("%s: %s", opt.journal, strerror(errno));
+		exit(2);
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+static bool journal_done(const char *rel)
+{
+	bool done;
+
+	pthread_mutex_lock(&done_set.lock);
+	done = set_find_path(&done_set, rel) != NULL;
+	pthread_mutex_unlock(&done_set.lock);
+	return done;
+}
+
+/* work-stealing pool */
+struct task {
+	char *rel;		/* relative to the tree, "" for its root */
+	bool dir;
+};
+
+struct worker {
+	pthread_t tid;
+	int id;
+	pthread_mutex_t lock;	/* protects the deque */
+	struct task **tasks;	/* ring, owner works at the tail */
+	size_t head, tail, cap;
+	__u8 *buf;		/* one chunk */
+};
+
+static struct worker *workers;
+static long pending;		/* tasks queued or running */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void push_task(struct worker *w, const char *rel, bool dir)
+{
+	struct task *t = xmalloc(sizeof(*t)), **tasks;
+	size_t i, n;
+
+	t->rel = strdup(rel);
+	t->dir = dir;
+	if (!t->rel) {
+		msg("out of memory");
+		exit(2);
+	}
+	/* counted before anyone can see it, so pending never drops early */
+	__atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&w->lock);
+	n = w->tail - w->head;
+	if (n == w->cap) {
+		tasks = xmalloc((w->cap ? 2 * w->cap : 64) * sizeof(*tasks));
+		for (i = 0; i < n; i++)
+			tasks[i] = w->tasks[(w->head + i) % w->cap];
+		free(w->tasks);
+		w->tasks = tasks;
+		w->cap = w->cap ? 2 * w->cap : 64;
+		w->head = 0;
+		w->tail = n;
+	}
+	w->tasks[w->tail++ % w->cap] = t;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&idle_lock);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+/* the owner takes its newest task, depth first */
+static struct task *pop_task(struct worker *w)
+{
+	struct task *t = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail != w->head)
+		t = w->tasks[--w->tail % w->cap];
+	pthread_mutex_unlock(&w->lock);
+	return t;
+}
+
+/* a thief takes the oldest task of another thread */
+static struct task *steal_task(struct worker *w)
+{
+	struct worker *v;
+	struct task *t = NULL;
+	int i;
+
+	for (i = 1; i < opt.threads && !t; i++) {
+		v = &workers[(w->id + i) % opt.threads];
+		pthread_mutex_lock(&v->lock);
+		if (v->tail != v->head)
+			t = v->tasks[v->head++ % v->cap];
+		pthread_mutex_unlock(&v->lock);
+	}
+	return t;
+}
+
+/* this function copies a symlink into the new tree */
+static void migrate_symlink(const char *rel)
+{
+	char *src = join(opt.src, rel), *dst = join(opt.dst, rel);
+	char target[PATH_MAX];
+	ssize_t n;
+
+	n = readlink(src, target, sizeof(target) - 1);
+	if (n < 0) {
+		fail("%s: %s", src, strerror(errno));
+	} else {
+		target[n] = 0;
+		if (symlink(target, dst) && errno != EEXIST)
+			fail("%s: %s", dst, strerror(errno));
+	}
+	free(src);
+	free(dst);
+}
+
+struct dir_entry {
+	ino_t ino;
+	int type;
+	char *name;
+};
+
+static int cmp_ino(const void *a, const void *b)
+{
+	const struct dir_entry *x = a, *y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * this function queues everything in a directory, in inode order: on
+ * most file systems that is close to the order of the inodes, and often
+ * of the data, on disk
+ */
+static void walk_dir(struct worker *w, const char *rel)
+{
+	char *path = join(opt.src, rel), *child;
+	struct dir_entry *ents = NULL;
+	size_t nr = 0, cap = 0, i;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	if (strcmp(opt.cmd, "migrate") == 0) {
+		char *dst = join(opt.dst, rel);
+
+		if (stat(path, &st) || (mkdir(dst, (st.st_mode & 07777) |
+					      S_IRWXU) && errno != EEXIST))
+			fail("%s: %s", dst, strerror(errno));
+		else if (geteuid() == 0 &&
+			 lchown(dst, st.st_uid, st.st_gid))
+			fail("%s: %s", dst, strerror(errno));
+		free(dst);
+	}
+
+	d = opendir(path);
+	if (!d) {
+		fail("%s: %s", path, strerror(errno));
+		free(path);
+		return;
+	}
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		/* the module's own files, see integrity.c */
+		if (!*rel && !strcmp(de->d_name, XCFS_META_DIR))
+			continue;
+		if (nr == cap) {
+			cap = cap ? 2 * cap : 64;
+			ents = realloc(ents, cap * sizeof(*ents));
+			if (!ents)
+				exit(2);
+		}
+		ents[nr].ino = de->d_ino;
+		ents[nr].type = de->d_type;
+		ents[nr].name = strdup(de->d_name);
+		if (!ents[nr].name)
+			exit(2);
+		nr++;
+	}
+	closedir(d);
+	qsort(ents, nr, sizeof(*ents), cmp_ino);
+
+	/* the deque pops its newest task first, so push them backwards */
+	for (i = nr; i-- > 0; ) {
+		if (*rel) {
+			if (asprintf(&child, "%s/%s", rel, ents[i].name) < 0)
+				exit(2);
+		} else {
+			child = strdup(ents[i].name);
+		}
+		if (ents[i].type == DT_UNKNOWN) {
+			char *full = join(opt.src, child);
+
+			ents[i].type = lstat(full, &st) ? DT_UNKNOWN :
+				       S_ISDIR(st.st_mode) ? DT_DIR :
+				       S_ISREG(st.st_mode) ? DT_REG :
+				       S_ISLNK(st.st_mode) ? DT_LNK :
+				       DT_UNKNOWN;
+			free(full);
+		}
+		if (ents[i].type == DT_DIR)
+			push_task(w, child, true);
+		else if (ents[i].type == DT_REG)
+			push_task(w, child, false);
+		else if (ents[i].type == DT_LNK && !strcmp(opt.cmd, "migrate"))
+			migrate_symlink(child);
+		else if (ents[i].type != DT_LNK)
+			msg("%s/%s: not a file or directory, skipped", path,
+			    ents[i].name);
+		free(child);
+		free(ents[i].name);
+	}
+	free(ents);
+	free(path);
+}
+
+/* this function copies the user's xattrs, never our own */
+static void copy_xattrs(int in, int out, const char *path)
+{
+	char *names, *name, *value = NULL;
+	ssize_t len, vlen;
+
+	len = flistxattr(in, NULL, 0);
+	if (len <= 0)
+		return;
+	names = xmalloc(len);
+	len = flistxattr(in, names, len);
+	for (name = names; len > 0 && name < names + len;
+	     name += strlen(name) + 1) {
+		if (!strncmp(name, XCFS_XATTR_PREFIX,
+			     sizeof(XCFS_XATTR_PREFIX) - 1))
+			continue;
+		vlen = fgetxattr(in, name, NULL, 0);
+		if (vlen < 0)
+			continue;
+		value = realloc(value, vlen ? vlen : 1);
+		if (!value)
+			exit(2);
+		vlen = fgetxattr(in, name, value, vlen);
+		if (vlen < 0 || fsetxattr(out, name, value, vlen, 0))
+			msg("%s: cannot copy xattr %s: %s", path, name,
+			    strerror(errno));
+	}
+	free(value);
+	free(names);
+}
+
+/* this function adds a further name of a migrated inode */
+static void migrate_link(const char *first, const char *rel)
+{
+	char *target = join(opt.dst, first), *dst = join(opt.dst, rel);
+
+	if (link(target, dst) && errno != EEXIST)
+		fail("%s: %s", dst, strerror(errno));
+	else
+		journal_write("D %s\n", rel);
+	free(target);
+	free(dst);
+}
+
+/*
+ * this function finishes with an inode of more names: they become links
+ * to the new file, or, if it could not be written, one of them tries
+ * again
+ */
+static void migrate_release(struct worker *w, const struct stat *st,
+			    const char *rel, bool ok)
+{
+	char **waiting;
+	size_t nr, i;
+
+	waiting = release_inode(st, ok, &nr);
+	if (ok)
+		journal_write("I %llu %llu %s\n",
+			      (unsigned long long)st->st_dev,
+			      (unsigned long long)st->st_ino, rel);
+	for (i = 0; i < nr; i++) {
+		if (ok)
+			migrate_link(rel, waiting[i]);
+		else
+			push_task(w, waiting[i], false);
+		free(waiting[i]);
+	}
+	free(waiting);
+}
+
+/* this function writes one file of the old tree into the new one */
+static void migrate_file(struct worker *w, const char *rel)
+{
+	char *src = join(opt.src, rel), *dst = join(opt.dst, rel), *first;
+	struct xform in, out;
+	struct timespec times[2];
+	struct stat st;
+	int ifd = -1, ofd = -1;
+	bool claimed = false, ok = false;
+	off_t pos;
+	ssize_t n;
+
+	if (journal_done(rel))
+		goto out;
+
+	ifd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (ifd < 0 || fstat(ifd, &st)) {
+		fail("%s: %s", src, strerror(errno));
+		goto out;
+	}
+	/*
+	 * further names of an inode become links to the first one, once it
+	 * is written; those that come earlier wait for it
+	 */
+	if (st.st_nlink > 1) {
+		switch (claim_inode(&st, rel, true, &first)) {
+		case CLAIM_DONE:
+			migrate_link(first, rel);
+			free(first);
+			/* fall through */
+		case CLAIM_BUSY:
+			goto out;
+		}
+		claimed = true;
+	}
+
+	if (opt.src_plain) {
+		in.format = FMT_PLAIN;
+	} else if (header_read(ifd, src, &in, NULL) <= 0) {
+		goto out;
+	}
+	target_xform(&out);
+
+	ofd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		   0600);
+	if (ofd < 0) {
+		fail("%s: %s", dst, strerror(errno));
+		goto out;
+	}
+	posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (pos = 0; pos < st.st_size; pos += n) {
+		n = pread_full(ifd, w->buf, opt.chunk, pos);
+		if (n < 0) {
+			fail("%s: %s", src, strerror(errno));
+			goto out;
+		}
+		if (!n)
+			break;
+		xform_apply(&in, w->buf, n, pos, false);
+		xform_apply(&out, w->buf, n, pos, true);
+		/* the new file reads back zeros there already: a hole */
+		if (!all_zero(w->buf, n) &&
+		    pwrite_full(ofd, w->buf, n, pos)) {
+			fail("%s: %s", dst, strerror(errno));
+			goto out;
+		}
+		posix_fadvise(ifd, pos, n, POSIX_FADV_DONTNEED);
+		__atomic_add_fetch(&nr_bytes, n, __ATOMIC_RELAXED);
+	}
+
+	copy_xattrs(ifd, ofd, dst);
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (ftruncate(ofd, pos) || header_write(ofd, &out) ||
+	    (geteuid() == 0 && fchown(ofd, st.st_uid, st.st_gid)) ||
+	    fchmod(ofd, st.st_mode & 07777) || futimens(ofd, times) ||
+	    (journal && fsync(ofd))) {
+		fail("%s: %s", dst, strerror(errno));
+		goto out;
+	}
+	posix_fadvise(ofd, 0, 0, POSIX_FADV_DONTNEED);
+	journal_write("D %s\n", rel);
+	ok = true;
+	__atomic_add_fetch(&nr_files, 1, __ATOMIC_RELAXED);
+	if (opt.verbose)
+		msg("%s: %s -> %s", rel, format_name(in.format),
+		    format_name(out.format));
+out:
+	if (ifd >= 0)
+		close(ifd);
+	if (ofd >= 0)
+		close(ofd);
+	if (claimed)
+		migrate_release(w, &st, rel, ok);
+	free(src);
+	free(dst);
+}
+
+/* this function copies len bytes at pos between two files */
+static int copy_range(struct worker *w, int from, int to, off_t from_pos,
+		      off_t to_pos, size_t len)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = pread_full(from, w->buf, len - done < opt.chunk ?
+			       len - done : opt.chunk, from_pos + done);
+		if (n <= 0)
+			return -1;
+		if (pwrite_full(to, w->buf, n, to_pos + done))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * this function saves the old bytes of a window and records it, so that
+ * a later run can put them back before rewriting the window again
+ */
+static int save_window(struct worker *w, int fd, const struct stat *st,
+		       const char *rel, off_t pos, size_t len, __u64 nonce,
+		       const char *undo)
+{
+	int ufd;
+
+	ufd = open(undo, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (ufd < 0)
+		return -1;
+	if (copy_range(w, fd, ufd, pos, 0, len) || fdatasync(ufd)) {
+		close(ufd);
+		return -1;
+	}
+	close(ufd);
+	journal_write("P %lld %zu %llx %llx %llx %s %s\n", (long long)pos,
+		      len, (unsigned long long)nonce,
+		      (unsigned long long)st->st_dev,
+		      (unsigned long long)st->st_ino, undo, rel);
+	return 0;
+}
+
+/* this function puts back a window a killed run was rewriting */
+static int restore_window(struct worker *w, int fd, const struct entry *e)
+{
+	int ufd, err;
+
+	if (!e->len)
+		return 0;
+	ufd = open(e->undo, O_RDONLY | O_CLOEXEC);
+	if (ufd < 0)
+		return -1;
+	err = copy_range(w, ufd, fd, 0, e->off, e->len) || fdatasync(fd);
+	close(ufd);
+	return err ? -1 : 0;
+}
+
+/* this function rewrites one file in place */
+static void convert_file(struct worker *w, const char *rel)
+{
+	char *path = join(opt.src, rel), *first, *undo[2] = { NULL, NULL };
+	struct xform in, out;
+	struct entry *prog;
+	struct stat st;
+	off_t start = 0, pos, end;
+	bool claimed = false, ok = false;
+	int fd, next = 0;
+	char key[40];
+	size_t nr;
+	ssize_t n;
+
+	if (journal_done(rel))
+		goto out_free;
+
+	fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		fail("%s: %s", path, strerror(errno));
+		goto out_free;
+	}
+	/* every name of an inode would convert it once more */
+	if (st.st_nlink > 1) {
+		first = NULL;
+		if (claim_inode(&st, rel, false, &first) != CLAIM_FIRST) {
+			free(first);
+			goto out;
+		}
+		claimed = true;
+	}
+
+	if (opt.src_plain)
+		in.format = FMT_PLAIN;
+	else if (header_read(fd, path, &in, NULL) <= 0)
+		goto out;
+	target_xform(&out);
+
+	snprintf(key, sizeof(key), "%llx:%llx", (unsigned long long)st.st_dev,
+		 (unsigned long long)st.st_ino);
+	pthread_mutex_lock(&progress_set.lock);
+	prog = set_find_path(&progress_set, key);
+	pthread_mutex_unlock(&progress_set.lock);
+
+	/*
+	 * undo files belong to the inode, so that a resumed run never hands
+	 * them to another file before this one is restored; the one the
+	 * last record names must survive until the next record is written
+	 */
+	if (journal) {
+		if (asprintf(&undo[0], "%s.undo.%llx.%llx.0", opt.journal,
+			     (unsigned long long)st.st_dev,
+			     (unsigned long long)st.st_ino) < 0 ||
+		    asprintf(&undo[1], "%s.undo.%llx.%llx.1", opt.journal,
+			     (unsigned long long)st.st_dev,
+			     (unsigned long long)st.st_ino) < 0)
+			exit(2);
+		if (prog && prog->undo && !strcmp(prog->undo, undo[0]))
+			next = 1;
+	}
+
+	if (prog) {
+		out.nonce = prog->nonce;
+		if (restore_window(w, fd, prog)) {
+			fail("%s: cannot restore from %s: %s", path,
+			     prog->undo, strerror(errno));
+			goto out;
+		}
+		start = prog->off;
+	} else if (in.format == out.format &&
+		   (!keyed(out.format) || !opt.has_new_key)) {
+		goto out;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (pos = start; pos < st.st_size; pos = end) {
+		end = pos + opt.checkpoint;
+		if (end > st.st_size)
+			end = st.st_size;
+		if (journal && save_window(w, fd, &st, rel, pos, end - pos,
+					   out.nonce, undo[next])) {
+			fail("%s: cannot save undo data: %s", path,
+			     strerror(errno));
+			goto out;
+		}
+		next ^= 1;
+		for (; pos < end; pos += n) {
+			n = pread_full(fd, w->buf, end - pos < opt.chunk ?
+				       end - pos : opt.chunk, pos);
+			if (n <= 0) {
+				fail("%s: %s", path, n ? strerror(errno) :
+				     "shrank while converting");
+				goto out;
+			}
+			xform_apply(&in, w->buf, n, pos, false);
+			xform_apply(&out, w->buf, n, pos, true);
+			if (pwrite_full(fd, w->buf, n, pos)) {
+				fail("%s: %s", path, strerror(errno));
+				goto out;
+			}
+			__atomic_add_fetch(&nr_bytes, n, __ATOMIC_RELAXED);
+		}
+		if (journal && fdatasync(fd)) {
+			fail("%s: %s", path, strerror(errno));
+			goto out;
+		}
+		posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+	}
+
+	/* the header cannot tell a finished file apart, the journal can */
+	journal_write("P %lld 0 %llx %llx %llx - %s\n", (long long)st.st_size,
+		      (unsigned long long)out.nonce,
+		      (unsigned long long)st.st_dev,
+		      (unsigned long long)st.st_ino, rel);
+	if (header_write(fd, &out) || (journal && fsync(fd))) {
+		fail("%s: cannot store header: %s", path, strerror(errno));
+		goto out;
+	}
+	journal_write("D %s\n", rel);
+	if (journal) {
+		unlink(undo[0]);
+		unlink(undo[1]);
+	}
+	ok = true;
+	__atomic_add_fetch(&nr_files, 1, __ATOMIC_RELAXED);
+	if (opt.verbose)
+		msg("%s: %s -> %s", rel, format_name(in.format),
+		    format_name(out.format));
+out:
+	if (claimed) {
+		free(release_inode(&st, ok, &nr));
+		if (ok)
+			journal_write("I %llu %llu %s\n",
+				      (unsigned long long)st.st_dev,
+				      (unsigned long long)st.st_ino, rel);
+	}
+	close(fd);
+out_free:
+	free(undo[0]);
+	free(undo[1]);
+	free(path);
+}
+
+/*
+ * Scrub.  Every file is read whole, in large sequential reads that go
+ * around the page cache (O_DIRECT where the lower file system has it,
+ * dropped behind otherwise), so that the disk, not the cache, is checked
+ * and foreground work keeps its cache.  The header must parse and, for
+ * files with integrity, every block must match its crc32c, every
+ * checksum leaf the crc32c at its end and its index entry, and the index
+ * the root in the header, as in integrity.c.  The sidecars with the
+ * checksums are in XCFS_META_DIR of DIR, which must be the top of the
+ * lower tree.  Data is never decrypted, so no key is needed.
+ *
+ * A mount stores the checksums of a write only after its data, so files
+ * changed in the last --settle seconds are left for the next run, and so
+ * are files whose lower ctime or size moved while they were read.
+ * Storing checksums ends with the root in the header, an xattr change,
+ * which moves the ctime but not the mtime of the lower file, while a data
+ * write moves both: a checksummed file whose ctime is not past its mtime
+ * has data newer than its checksums, however long ago it was written,
+ * and is left for later as well.  A chmod or chown after the last write
+ * hides that, so a file still open for writing through the mount may
+ * then be reported wrongly.  What is left is printed, one line per bad
+ * extent, to stdout:
+ *
+ *	<path> <offset> <length> <reason>
+ */
+
+static __u32 crc32c_table[256];
+static size_t page_size;	/* checksummed block, PAGE_SIZE of the module */
+
+static void crc32c_init(void)
+{
+	__u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+/* as xcfs_crc: crc32c seeded with ~0, 0 kept free for "none" */
+static __u32 xcfs_crc(const __u8 *p, size_t len)
+{
+	__u32 crc = ~0U;
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ? crc : 1;
+}
+
+struct bad_extent {
+	off_t start;
+	off_t len;
+	const char *why;
+};
+
+/* what scrubbing one file found */
+struct scrub {
+	const char *rel;
+	int fd;
+	off_t size;
+	bool direct;		/* reads go around the page cache */
+	__le32 *leaf;		/* the leaf read last, NULL without integrity */
+	size_t leaf_n;
+	bool leaf_ok;
+	int csum_fd;		/* the sidecar, -1 without one */
+	__le32 *index;		/* its index, checked against the root */
+	size_t nr_leaves;
+	struct bad_extent *bad;
+	size_t nr_bad, cap_bad;
+};
+
+/* this function records a bad range, merged with the one before */
+static void bad_add(struct scrub *sc, off_t start, off_t len, const char *why)
+{
+	struct bad_extent *b = sc->nr_bad ? &sc->bad[sc->nr_bad - 1] : NULL;
+
+	if (b && b->why == why && b->start + b->len == start) {
+		b->len += len;
+		return;
+	}
+	if (sc->nr_bad == sc->cap_bad) {
+		sc->cap_bad = sc->cap_bad ? 2 * sc->cap_bad : 16;
+		sc->bad = realloc(sc->bad, sc->cap_bad * sizeof(*sc->bad));
+		if (!sc->bad)
+			exit(2);
+	}
+	b = &sc->bad[sc->nr_bad++];
+	b->start = start;
+	b->len = len;
+	b->why = why;
+}
+
+/*
+ * this function opens the sidecar of a file and checks its index against
+ * the root, as xcfs_csum_load does; false if they do not match
+ */
+static bool scrub_load_leaves(struct scrub *sc)
+{
+	struct xcfs_disk_header disk;
+	__le32 sums[XCFS_CSUM_MAX_LEAVES / XCFS_CSUM_INDEX_BLOCK];
+	size_t len, i, nr_sums, n;
+	char *path, name[64];
+	__u32 root = 0;
+
+	sc->leaf = xmalloc(XCFS_CSUM_LEAF_SIZE);
+	sc->leaf_n = (size_t)-1;
+	if (fgetxattr(sc->fd, XCFS_HDR_XATTR, &disk, sizeof(disk)) !=
+	    sizeof(disk))
+		return false;
+	sc->nr_leaves = le32toh(disk.csum_leaves);
+	if (!sc->nr_leaves)
+		return !le32toh(disk.csum_root);
+	if (sc->nr_leaves > XCFS_CSUM_MAX_LEAVES)
+		return false;
+
+	snprintf(name, sizeof(name), XCFS_META_DIR "/" XCFS_CSUM_NAME,
+		 (unsigned long long)le64toh(disk.csum_id));
+	path = join(opt.src, name);
+	sc->csum_fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+	if (sc->csum_fd < 0 && errno == EPERM)
+		sc->csum_fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	len = sc->nr_leaves * sizeof(__le32);
+	sc->index = xmalloc(len);
+	if (sc->csum_fd < 0 ||
+	    pread(sc->csum_fd, sc->index, len, 0) != (ssize_t)len)
+		return false;
+
+	nr_sums = (sc->nr_leaves + XCFS_CSUM_INDEX_BLOCK - 1) /
+		  XCFS_CSUM_INDEX_BLOCK;
+	for (i = 0; i < nr_sums; i++) {
+		n = sc->nr_leaves - i * XCFS_CSUM_INDEX_BLOCK;
+		if (n > XCFS_CSUM_INDEX_BLOCK)
+			n = XCFS_CSUM_INDEX_BLOCK;
+		sums[i] = htole32(xcfs_crc((__u8 *)(sc->index +
+					   i * XCFS_CSUM_INDEX_BLOCK),
+					   n * sizeof(__le32)));
+	}
+	root = xcfs_crc((__u8 *)sums, nr_sums * sizeof(__le32));
+	return root == le32toh(disk.csum_root);
+}
+
+/* this function returns the checksum of a block, 0 if it has none */
+static __u32 scrub_csum(struct scrub *sc, size_t index)
+{
+	size_t n = index / XCFS_CSUM_PER_LEAF;
+	off_t start;
+	ssize_t len;
+
+	if (n != sc->leaf_n) {
+		sc->leaf_n = n;
+		/* a leaf never stored checks nothing */
+		if (n >= sc->nr_leaves || !sc->index[n]) {
+			memset(sc->leaf, 0, XCFS_CSUM_LEAF_SIZE);
+			sc->leaf_ok = true;
+			return 0;
+		}
+		len = pread(sc->csum_fd, sc->leaf, XCFS_CSUM_LEAF_SIZE,
+			    XCFS_CSUM_LEAF_POS(n));
+		sc->leaf_ok = len == XCFS_CSUM_LEAF_SIZE &&
+			      sc->leaf[XCFS_CSUM_PER_LEAF] == sc->index[n] &&
+			      xcfs_crc((__u8 *)sc->leaf,
+				       XCFS_CSUM_PER_LEAF * sizeof(__le32)) ==
+			      le32toh(sc->leaf[XCFS_CSUM_PER_LEAF]);
+		/* the blocks of a bad leaf cannot be checked */
+		if (!sc->leaf_ok) {
+			start = (off_t)n * XCFS_CSUM_PER_LEAF * page_size;
+			len = (off_t)XCFS_CSUM_PER_LEAF * page_size;
+			if (start + len > sc->size)
+				len = sc->size - start;
+			bad_add(sc, start, len, "bad-checksum-leaf");
+		}
+	}
+	return sc->leaf_ok ? le32toh(sc->leaf[index % XCFS_CSUM_PER_LEAF]) : 0;
+}
+
+/* this function checks len bytes of ciphertext read at pos */
+static void scrub_verify(struct scrub *sc, const __u8 *buf, size_t len,
+			 off_t pos)
+{
+	size_t done, n;
+	__u32 crc;
+
+	if (!sc->leaf)
+		return;
+	for (done = 0; done < len; done += n) {
+		n = len - done < page_size ? len - done : page_size;
+		crc = scrub_csum(sc, (pos + done) / page_size);
+		if (crc && xcfs_crc(buf + done, n) != crc)
+			bad_add(sc, pos + done, n, "checksum-mismatch");
+	}
+}
+
+/*
+ * this function reads len bytes at pos, or up to eof; O_DIRECT wants
+ * whole blocks, and is given up if the lower file system refuses it
+ */
+static ssize_t scrub_read(struct scrub *sc, void *buf, size_t len, off_t pos)
+{
+	size_t want = len;
+	ssize_t n;
+
+	if (sc->direct)
+		want = (len + page_size - 1) / page_size * page_size;
+	throttle(want);
+	do {
+		n = pread(sc->fd, buf, want, pos);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0 && errno == EINVAL && sc->direct) {
+		sc->direct = false;
+		fcntl(sc->fd, F_SETFL, fcntl(sc->fd, F_GETFL) & ~O_DIRECT);
+		posix_fadvise(sc->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		return scrub_read(sc, buf, len, pos);
+	}
+	return n > (ssize_t)len ? (ssize_t)len : n;
+}
+
+/* this function reads a chunk that failed block by block, to narrow it */
+static void scrub_narrow(struct worker *w, struct scrub *sc, off_t pos,
+			 size_t len)
+{
+	size_t done, n;
+	ssize_t rc;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < page_size ? len - done : page_size;
+		rc = scrub_read(sc, w->buf, n, pos + done);
+		if (rc != (ssize_t)n)
+			bad_add(sc, pos + done, n, "read-error");
+		else
+			scrub_verify(sc, w->buf, n, pos + done);
+	}
+}
+
+static bool same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static bool time_after(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec > b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/* this function reads one file whole and checks it */
+static void scrub_file(struct worker *w, const char *rel)
+{
+	char *path = join(opt.src, rel), *first;
+	struct scrub sc = { .rel = rel, .fd = -1, .direct = true,
+			    .csum_fd = -1 };
+	struct stat st, after;
+	struct xform x;
+	bool claimed = false, ok = false;
+	__u16 flags;
+	off_t pos;
+	ssize_t n;
+	size_t i, len;
+	int rc;
+
+	if (journal_done(rel))
+		goto out;
+
+	sc.fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOATIME |
+		     O_DIRECT);
+	if (sc.fd < 0 && errno == EPERM)
+		sc.fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC |
+			     O_DIRECT);
+	if (sc.fd < 0 && errno == EINVAL) {
+		sc.direct = false;
+		sc.fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	if (sc.fd < 0 || fstat(sc.fd, &st)) {
+		fail("%s: %s", path, strerror(errno));
+		goto out;
+	}
+	if (st.st_nlink > 1) {
+		first = NULL;
+		if (claim_inode(&st, rel, false, &first) != CLAIM_FIRST) {
+			free(first);
+			goto out;
+		}
+		claimed = true;
+	}
+	if (time(NULL) - st.st_ctim.tv_sec < opt.settle) {
+		__atomic_add_fetch(&nr_busy, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	sc.size = st.st_size;
+
+	rc = header_read(sc.fd, path, &x, &flags);
+	if (rc < 0)
+		bad_add(&sc, 0, 0, "bad-header");
+	if (rc <= 0)
+		goto report;
+	/* checksums not stored since the last write may lag the data */
+	if ((flags & XCFS_HDR_INTEGRITY) && sc.size &&
+	    !time_after(&st.st_ctim, &st.st_mtim)) {
+		__atomic_add_fetch(&nr_busy, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	/* without an index to trust, no block can be checked */
+	if ((flags & XCFS_HDR_INTEGRITY) && !scrub_load_leaves(&sc)) {
+		bad_add(&sc, 0, sc.size, "bad-checksum-index");
+		free(sc.leaf);
+		sc.leaf = NULL;
+	}
+
+	if (!sc.direct)
+		posix_fadvise(sc.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (pos = 0; pos < sc.size; pos += n) {
+		len = sc.size - pos < (off_t)opt.chunk ? sc.size - pos :
+		      opt.chunk;
+		n = scrub_read(&sc, w->buf, len, pos);
+		if (n < 0) {
+			scrub_narrow(w, &sc, pos, len);
+			n = len;
+			continue;
+		}
+		if (!n)
+			break;
+		scrub_verify(&sc, w->buf, n, pos);
+		if (!sc.direct)
+			posix_fadvise(sc.fd, pos, n, POSIX_FADV_DONTNEED);
+		__atomic_add_fetch(&nr_bytes, n, __ATOMIC_RELAXED);
+	}
+
+report:
+	/* a file written meanwhile is checked by the next run instead */
+	if (sc.nr_bad && (fstat(sc.fd, &after) ||
+			  !same_time(&after.st_ctim, &st.st_ctim) ||
+			  after.st_size != st.st_size)) {
+		__atomic_add_fetch(&nr_busy, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	flockfile(stdout);
+	for (i = 0; i < sc.nr_bad; i++)
+		printf("%s %lld %lld %s\n", rel, (long long)sc.bad[i].start,
+		       (long long)sc.bad[i].len, sc.bad[i].why);
+	fflush(stdout);
+	funlockfile(stdout);
+	__atomic_add_fetch(&nr_bad, sc.nr_bad, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&nr_files, 1, __ATOMIC_RELAXED);
+	journal_write("D %s\n", rel);
+	ok = true;
+	if (opt.verbose)
+		msg("%s: %s%s, %zu bad", rel, format_name(x.format),
+		    sc.leaf ? " with checksums" : "", sc.nr_bad);
+out:
+	if (claimed)
+		free(release_inode(&st, ok, &i));
+	if (sc.fd >= 0)
+		close(sc.fd);
+	if (sc.csum_fd >= 0)
+		close(sc.csum_fd);
+	free(sc.index);
+	free(sc.leaf);
+	free(sc.bad);
+	free(path);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct timespec ts;
+	struct task *t;
+
+	for (;;) {
+		t = pop_task(w);
+		if (!t)
+			t = steal_task(w);
+		if (t) {
+			if (t->dir)
+				walk_dir(w, t->rel);
+			else if (!strcmp(opt.cmd, "migrate"))
+				migrate_file(w, t->rel);
+			else if (!strcmp(opt.cmd, "scrub"))
+				scrub_file(w, t->rel);
+			else
+				convert_file(w, t->rel);
+			free(t->rel);
+			free(t);
+			if (!__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&idle_lock);
+				pthread_cond_broadcast(&idle_cond);
+				pthread_mutex_unlock(&idle_lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&idle_lock);
+		if (!__atomic_load_n(&pending, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_unlock(&idle_lock);
+			break;
+		}
+		/* a steal may have raced with a push; look again soon */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+		pthread_mutex_unlock(&idle_lock);
+	}
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"usage: xcfsctl migrate [options] SRC DST\n"
+"       xcfsctl convert [options] DIR\n"
+"       xcfsctl scrub [options] DIR\n"
+"\n"
+"  -f, --format FMT      format to write: plain, shift, sparse, ctr, block\n"
+"                        (default ctr)\n"
+"  -k, --key HEX         key of the mount, its key_desc= key in hex\n"
+"  -K, --new-key HEX     key to write with, for key rotation\n"
+"  -p, --plain           SRC or DIR holds plain files, not an xcfs tree\n"
+"  -j, --threads N       worker threads (default: online cpus)\n"
+"  -c, --chunk BYTES     I/O size, a multiple of 4096 (default 1M)\n"
+"  -J, --journal FILE    record progress there and resume from it\n"
+"  -C, --checkpoint BYTES  undo window of convert (default 64M)\n"
+"  -b, --bwlimit MB/S    I/O budget in MiB per second\n"
+"  -i, --iops N          I/O budget in reads and writes per second\n"
+"  -s, --settle SECONDS  scrub: skip files changed more recently (default 60)\n"
+"  -v, --verbose         name every file done\n"
+"\n"
+"migrate and convert skip checksummed and compressed files.  Without\n"
+"--journal a killed convert leaves the file it was working on damaged.\n"
+"scrub prints \"path offset length reason\" for every bad extent.\n"
+"SIGUSR1 pauses a run, SIGUSR2 resumes it.\n");
+	exit(2);
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	case 'g': case 'G': v <<= 30; end++; break;
+	}
+	if (*end || !v)
+		usage();
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "format",	required_argument, NULL, 'f' },
+		{ "key",	required_argument, NULL, 'k' },
+		{ "new-key",	required_argument, NULL, 'K' },
+		{ "plain",	no_argument,	   NULL, 'p' },
+		{ "threads",	required_argument, NULL, 'j' },
+		{ "chunk",	required_argument, NULL, 'c' },
+		{ "journal",	required_argument, NULL, 'J' },
+		{ "checkpoint",	required_argument, NULL, 'C' },
+		{ "bwlimit",	required_argument, NULL, 'b' },
+		{ "iops",	required_argument, NULL, 'i' },
+		{ "settle",	required_argument, NULL, 's' },
+		{ "verbose",	no_argument,	   NULL, 'v' },
+		{ NULL }
+	};
+	int c, i;
+
+	if (argc < 2)
+		usage();
+	opt.cmd = argv[1];
+	if (strcmp(opt.cmd, "migrate") && strcmp(opt.cmd, "convert") &&
+	    strcmp(opt.cmd, "scrub"))
+		usage();
+	optind = 2;
+	while ((c = getopt_long(argc, argv, "f:k:K:pj:c:J:C:b:i:s:v", longopts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'f': opt.format = parse_format(optarg); break;
+		case 'k': parse_key(optarg, opt.key); opt.has_key = true;
+			  break;
+		case 'K': parse_key(optarg, opt.new_key);
+			  opt.has_new_key = true; break;
+		case 'p': opt.src_plain = true; break;
+		case 'j': opt.threads = atoi(optarg); break;
+		case 'c': opt.chunk = parse_size(optarg); break;
+		case 'J': opt.journal = optarg; break;
+		case 'C': opt.checkpoint = parse_size(optarg); break;
+		case 'b': bw_bucket.rate = atof(optarg) * (1 << 20); break;
+		case 'i': iops_bucket.rate = atof(optarg); break;
+		case 's': opt.settle = atoi(optarg); break;
+		case 'v': opt.verbose = true; break;
+		default: usage();
+		}
+	}
+	if (!strcmp(opt.cmd, "migrate") && argc - optind == 2) {
+		opt.src = argv[optind];
+		opt.dst = argv[optind + 1];
+	} else if (strcmp(opt.cmd, "migrate") && argc - optind == 1) {
+		opt.src = opt.dst = argv[optind];
+	} else {
+		usage();
+	}
+
+	/* block units and checksummed blocks must not straddle two chunks */
+	page_size = sysconf(_SC_PAGESIZE);
+	if (opt.chunk % XCFS_BLOCK_SIZE || opt.chunk % page_size ||
+	    opt.checkpoint % opt.chunk) {
+		msg("chunk must be a multiple of 4096, checkpoint of chunk");
+		exit(2);
+	}
+	if (keyed(opt.format) && !opt.has_key && !opt.has_new_key &&
+	    strcmp(opt.cmd, "scrub")) {
+		msg("%s format needs --key", format_name(opt.format));
+		exit(2);
+	}
+	if (opt.has_new_key && !opt.has_key)
+		memcpy(opt.key, opt.new_key, sizeof(opt.key));
+	if (opt.threads <= 0)
+		opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opt.threads <= 0)
+		opt.threads = 1;
+	if (opt.journal)
+		journal_load();
+	crc32c_init();
+	signal(SIGUSR1, pause_signal);
+	signal(SIGUSR2, pause_signal);
+
+	workers = calloc(opt.threads, sizeof(*workers));
+	if (!workers)
+		exit(2);
+	for (i = 0; i < opt.threads; i++) {
+		workers[i].id = i;
+		pthread_mutex_init(&workers[i].lock, NULL);
+		if (posix_memalign((void **)&workers[i].buf, 4096, opt.chunk))
+			exit(2);
+	}
+
+	push_task(&workers[0], "", true);
+	for (i = 0; i < opt.threads; i++) {
+		if (pthread_create(&workers[i].tid, NULL, worker_main,
+				   &workers[i])) {
+			msg("cannot start threads");
+			exit(2);
+		}
+	}
+	for (i = 0; i < opt.threads; i++)
+		pthread_join(workers[i].tid, NULL);
+
+	if (!strcmp(opt.cmd, "scrub"))
+		msg("%ld files, %llu bytes, %ld bad extents, %ld left for "
+		    "later, %ld errors", nr_files, nr_bytes, nr_bad, nr_busy,
+		    nr_errors);
+	else
+		msg("%ld files, %llu bytes, %ld errors", nr_files, nr_bytes,
+		    nr_errors);
+	return nr_errors || nr_bad ? 1 : 0;
+}
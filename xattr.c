@@ -0,0 +1,170 @@
+#include "xcfs.h"
+
+/*
+ * Per-inode cache of extended attributes.  getxattr results, including
+ * "no such attribute" (what most ACL checks get), are kept on the upper
+ * inode so that hot files answer without calling the lower file system.
+ * Values up to XCFS_XATTR_CACHE_VALUE bytes are kept; size queries are
+ * remembered without their value.  Name lists are not cached: the lower
+ * file system filters them by caller (ext4 lists trusted.* only to
+ * CAP_SYS_ADMIN), so one caller's list is not another's.
+ *
+ * Everything cached is dropped by our own setxattr/removexattr and
+ * whenever the lower ctime moves, which catches changes made to the
+ * lower file system directly.  ctime only has the granularity of the
+ * clock tick, so a result is only cached when the ctime read before the
+ * lower call is from an earlier tick (see xcfs_xattr_cacheable); a later
+ * change then always moves it.
+ */
+
+struct xcfs_xattr {
+	struct list_head list;
+	ssize_t size;		/* value size, or -ENODATA */
+	bool has_value;		/* false: only the size is known */
+	char *value;		/* points into name[] */
+	char name[];
+};
+
+/* this function drops everything cached, under the lock */
+static void __xcfs_xattr_drop(struct xcfs_xattr_cache *xc)
+{
+	struct xcfs_xattr *xa, *next;
+
+	list_for_each_entry_safe(xa, next, &xc->entries, list) {
+		list_del(&xa->list);
+		kfree(xa);
+	}
+	xc->nr = 0;
+}
+
+/* this function checks the cache against the lower inode, under the lock */
+static bool xcfs_xattr_valid(struct inode *inode, struct xcfs_xattr_cache *xc)
+{
+	struct inode *lower_inode = xcfs_lower_inode(inode);
+
+	if (timespec_equal(&xc->lower_ctime, &lower_inode->i_ctime))
+		return true;
+	__xcfs_xattr_drop(xc);
+	xc->lower_ctime = lower_inode->i_ctime;
+	return false;
+}
+
+void xcfs_xattr_cache_init(struct inode *inode)
+{
+	struct xcfs_xattr_cache *xc = &XCFS_I(inode)->xattrs;
+
+	spin_lock_init(&xc->lock);
+	INIT_LIST_HEAD(&xc->entries);
+}
+
+void xcfs_xattr_invalidate(struct inode *inode)
+{
+	struct xcfs_xattr_cache *xc = &XCFS_I(inode)->xattrs;
+
+	spin_lock(&xc->lock);
+	__xcfs_xattr_drop(xc);
+	spin_unlock(&xc->lock);
+}
+
+/* this function answers a getxattr from the cache, -EAGAIN on a miss */
+ssize_t xcfs_xattr_cache_get(struct inode *inode, const char *name,
+			     void *buffer, size_t size)
+{
+	struct xcfs_xattr_cache *xc = &XCFS_I(inode)->xattrs;
+	struct xcfs_xattr *xa;
+	ssize_t ret = -EAGAIN;
+
+	spin_lock(&xc->lock);
+	if (!xcfs_xattr_valid(inode, xc))
+		goto out;
+	list_for_each_entry(xa, &xc->entries, list) {
+		if (strcmp(xa->name, name))
+			continue;
+		if (xa->size < 0 || !size)
+			ret = xa->size;
+		else if (size < xa->size)
+			ret = -ERANGE;
+		else if (xa->has_value) {
+			memcpy(buffer, xa->value, xa->size);
+			ret = xa->size;
+		}
+		break;
+	}
+out:
+	spin_unlock(&xc->lock);
+	return ret;
+}
+
+/*
+ * this function tells whether a lower result may be cached: lower_ctime
+ * and now are the lower ctime and the time, both read before the call.
+ * A change in the tick lower_ctime is from could leave it unchanged.
+ */
+bool xcfs_xattr_cacheable(const struct timespec *lower_ctime,
+			  const struct timespec *now)
+{
+	return timespec_compare(lower_ctime, now) < 0;
+}
+
+/*
+ * this function remembers what the lower getxattr returned; lower_ctime
+ * is the lower ctime from before the call, checked with
+ * xcfs_xattr_cacheable(), so a racing change is never cached as current
+ * (barring the clock being set back)
+ */
+void xcfs_xattr_cache_set(struct inode *inode, const char *name,
+			  const void *value, ssize_t size,
+			  const struct timespec *lower_ctime)
+{
+	struct xcfs_xattr_cache *xc = &XCFS_I(inode)->xattrs;
+	struct xcfs_xattr *xa, *old;
+	size_t name_len = strlen(name) + 1;
+	bool has_value = value && size >= 0;
+
+	if (size != -ENODATA && size < 0)
+		return;
+	if (size > XCFS_XATTR_CACHE_VALUE)
+		has_value = false;
+
+	xa = kmalloc(sizeof(*xa) + name_len + (has_value ? size : 0),
+		     GFP_KERNEL);
+	if (!xa)
+		return;
+	memcpy(xa->name, name, name_len);
+	xa->size = size;
+	xa->has_value = has_value;
+	xa->value = xa->name + name_len;
+	if (has_value)
+		memcpy(xa->value, value, size);
+
+	spin_lock(&xc->lock);
+	xcfs_xattr_valid(inode, xc);
+	if (!timespec_equal(&xc->lower_ctime, lower_ctime)) {
+		kfree(xa);
+		goto out;
+	}
+	list_for_each_entry(old, &xc->entries, list) {
+		if (!strcmp(old->name, name)) {
+			list_del(&old->list);
+			kfree(old);
+			xc->nr--;
+			break;
+		}
+	}
+	/* the least recently filled entry makes room */
+	if (xc->nr == XCFS_XATTR_CACHE_MAX) {
+		old = list_last_entry(&xc->entries, struct xcfs_xattr, list);
+		list_del(&old->list);
+		kfree(old);
+		xc->nr--;
+	}
+	list_add(&xa->list, &xc->entries);
+	xc->nr++;
+out:
+	spin_unlock(&xc->lock);
+}
+
+void xcfs_xattr_cache_free(struct inode *inode)
+{
+	__xcfs_xattr_drop(&XCFS_I(inode)->xattrs);
+}
@@ -15,17 +15,85 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/cred.h>
 #include <linux/xattr.h>
 #include <linux/exportfs.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/list_bl.h>
+
+#include "xcfs_format.h"
 
 #define XCFS_MAGIC_NUMBER 	0x69
 #define CURRENT_TIME		1000
 #define XCFS_NAME           "xcfs"
 #define PRINT_PREF KERN_INFO "[xcfs]: "
 
-void xcfs_decrypt(char* buf, size_t count);
-void xcfs_encrypt(char* buf, size_t count);
+/* cache modes */
+#define XCFS_CACHE_LOWER	0	/* read(2) served from lower page cache */
+#define XCFS_CACHE_UPPER	1	/* plaintext only, lower pages dropped */
+
+/* writeback modes */
+#define XCFS_WB_ASYNC		0	/* write(2) returns once data is cached */
+#define XCFS_WB_SYNC		1	/* write(2) waits for the lower file */
+
+#define XCFS_BOUNCE_POOL_PAGES	32	/* reserved direct I/O bounce pages */
+#define XCFS_DIO_BATCH		16	/* bounce pages per lower direct I/O */
+#define XCFS_IO_BATCH_PAGES	512	/* pages per lower buffered I/O, 2 MiB */
+#define XCFS_CRYPT_CHUNK	(64 * 1024)	/* least work per crypto worker */
+#define XCFS_CRYPT_THRESHOLD	(256 * 1024)	/* smaller runs stay inline */
+#define XCFS_READ_CHUNK_PAGES	32	/* pages per pipelined lower read */
+#define XCFS_READ_DEPTH		4	/* pipelined lower reads in flight */
+#define XCFS_FUSE_CHUNK		4096	/* bytes per fused transform and copy */
+#define XCFS_READ_BOUNCE	(16 * 1024)	/* lower-cache read buffer */
+#define XCFS_WRITE_CHUNK	(1024 * 1024)	/* ciphertext per lower write */
+#define XCFS_DROP_WINDOW	(4 * 1024 * 1024)	/* written per drop-behind */
+#define XCFS_LOWER_IDLE_MAX	2	/* closed lower files kept per inode */
+#define XCFS_XATTR_CACHE_MAX	8	/* xattrs cached per inode */
+#define XCFS_XATTR_CACHE_VALUE	512	/* largest xattr value cached */
+#define XCFS_IHASH_MIN_BITS	10	/* lower->upper inode hash buckets */
+#define XCFS_IHASH_MAX_BITS	20
+#define XCFS_FH_CACHE_SIZE	256	/* decoded NFS handles kept, power of 2 */
+#define XCFS_FH_MAX_WORDS	32	/* longest lower handle cached */
+#define XCFS_FILEID		0xf5	/* fh_type of every xcfs handle */
+
+#define XCFS_COMPRESS_SHIFT	16	/* 64 KiB compressed extents */
+#define XCFS_COMPRESS_MAX_SHIFT	20
+
+/* decoded header, kept in xcfs_inode_info */
+struct xcfs_header {
+	u8 version;		/* 0: no header, legacy file */
+	u8 format;
+	u16 flags;
+	u8 extent_shift;
+	u64 nonce;		/* 56 bits */
+	u64 csum_id;		/* sidecar of the checksums, see integrity.c */
+	u32 csum_root;
+	u32 csum_leaves;
+};
+
+void xcfs_decrypt(struct inode *inode, char* buf, size_t count, loff_t pos);
+void xcfs_encrypt(struct inode *inode, char* buf, size_t count, loff_t pos);
+void xcfs_decrypt_buf(struct inode *inode, char *buf, size_t count,
+		      loff_t pos);
+void xcfs_encrypt_buf(struct inode *inode, char *buf, size_t count,
+		      loff_t pos);
+bool xcfs_crypt_inline(struct inode *inode, size_t count);
+size_t xcfs_decrypt_to_iter(struct inode *inode, char *buf, size_t count,
+			    loff_t pos, struct iov_iter *to);
+size_t xcfs_encrypt_from_iter(struct inode *inode, char *buf, size_t count,
+			      loff_t pos, struct iov_iter *from);
+void xcfs_ctr_xor(struct inode *inode, char *buf, size_t count, loff_t pos);
+void xcfs_ctr_keystream(struct inode *inode, u8 *ks, size_t count,
+			loff_t pos);
+void xcfs_block_crypt(struct inode *inode, char *buf, size_t count,
+		      loff_t pos, bool encrypt);
+int xcfs_block_truncate(struct inode *inode, struct path *lower_path,
+			loff_t size);
 
 /* operations vectors defined in specific files */
 extern const struct file_operations xcfs_file_ops;
@@ -48,10 +116,74 @@ extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
 extern struct dentry *xcfs_lookup(struct inode *dir, struct dentry *dentry,
 				    unsigned int flags);
+extern int xcfs_init_file_cache(void);
+extern void xcfs_destroy_file_cache(void);
+extern void xcfs_put_lower_files(struct inode *inode);
+extern struct file *xcfs_get_wb_file(struct inode *inode);
+extern void xcfs_xattr_cache_init(struct inode *inode);
+extern void xcfs_xattr_cache_free(struct inode *inode);
+extern void xcfs_xattr_invalidate(struct inode *inode);
+extern ssize_t xcfs_xattr_cache_get(struct inode *inode, const char *name,
+				    void *buffer, size_t size);
+extern void xcfs_xattr_cache_set(struct inode *inode, const char *name,
+				 const void *value, ssize_t size,
+				 const struct timespec *lower_ctime);
+extern bool xcfs_xattr_cacheable(const struct timespec *lower_ctime,
+				 const struct timespec *now);
+extern void xcfs_range_lock_init(struct xcfs_range_lock *rl);
+extern void xcfs_range_lock(struct inode *inode, struct xcfs_range *r,
+			    loff_t start, loff_t end);
+extern void xcfs_range_unlock(struct inode *inode, struct xcfs_range *r);
+extern loff_t xcfs_range_lock_eof(struct inode *inode, struct xcfs_range *r);
+extern int xcfs_ihash_init(struct super_block *sb);
+extern void xcfs_ihash_free(struct super_block *sb);
+extern void xcfs_ihash_remove(struct inode *inode);
 extern struct inode *xcfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
+extern struct dentry *xcfs_obtain_alias(struct super_block *sb,
+					struct path *lower_path);
+extern int xcfs_fh_cache_init(struct super_block *sb);
+extern void xcfs_fh_cache_drop(struct super_block *sb);
+extern void xcfs_fh_cache_forget(struct inode *inode);
+extern void xcfs_fh_cache_free(struct super_block *sb);
 extern int xcfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+extern int xcfs_parse_options(struct super_block *sb, char *options);
+extern int xcfs_change_options(struct super_block *sb, char *options);
+extern int xcfs_init_sysfs(void);
+extern void xcfs_exit_sysfs(void);
+extern int xcfs_sysfs_register(struct super_block *sb);
+extern void xcfs_sysfs_unregister(struct super_block *sb);
+extern int xcfs_crypt_init(struct super_block *sb);
+extern void xcfs_crypt_exit(struct super_block *sb);
+extern void xcfs_read_header(struct inode *inode, struct inode *lower_inode);
+extern int xcfs_store_header(struct inode *inode, struct dentry *lower_dentry);
+extern void xcfs_init_header(struct inode *inode, struct dentry *lower_dentry);
+extern int xcfs_csum_verify(struct inode *inode, pgoff_t index,
+			    const void *data, size_t len);
+extern int xcfs_csum_update(struct inode *inode, struct file *lower_file,
+			    loff_t pos, const char *buf, size_t len);
+extern int xcfs_csum_truncate(struct inode *inode, struct file *lower_file,
+			      loff_t size);
+extern int xcfs_csum_flush(struct inode *inode);
+extern int xcfs_csum_sync(struct inode *inode, int datasync);
+extern void xcfs_csum_remove(struct inode *inode);
+extern void xcfs_csum_free(struct inode *inode);
+extern void xcfs_put_meta_dir(struct super_block *sb);
+extern int xcfs_compress_readpage(struct file *file, struct page *page);
+extern int xcfs_compress_writepage(struct page *page,
+				   struct writeback_control *wbc);
+extern int xcfs_compress_writepages(struct address_space *mapping,
+				    struct writeback_control *wbc);
+extern ssize_t xcfs_compress_write(struct inode *inode,
+				   struct file *lower_file, const char *buf,
+				   size_t count, loff_t pos);
+extern int xcfs_compress_truncate(struct inode *inode,
+				  struct path *lower_path, loff_t size);
+extern ssize_t xcfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter);
+extern unsigned int xcfs_dio_alignment(struct inode *inode);
+extern void xcfs_put_link(void *arg);
+extern void xcfs_drop_link(struct inode *inode);
 
 /* vfs_path_lookup is exported but not included in any headers */
 int vfs_path_lookup(struct dentry *dentry, struct vfsmount *mnt,
@@ -70,12 +202,59 @@ int vfs_removexattr(struct dentry *dentry, const char *name);
 /* file private data */
 struct xcfs_file_info {
 	struct file *lower_file;
+	struct xcfs_lower_file *shared;	/* regular files, see file.c */
 	const struct vm_operations_struct *lower_vm_ops;
 };
 
+/*
+ * cached symlink body, sized to the target.  The inode holds one
+ * reference, every follower holds another until its delayed call runs;
+ * rcu-walk takes its own with atomic_inc_not_zero, and the grace period
+ * only keeps a body being dropped readable until then.
+ */
+struct xcfs_link {
+	struct rcu_head rcu;
+	atomic_t count;
+	struct timespec lower_ctime;	/* lower ctime when body was read */
+	char body[];
+};
+
+/* cached extended attributes of an inode, see xattr.c */
+struct xcfs_xattr_cache {
+	spinlock_t lock;
+	struct timespec lower_ctime;	/* lower ctime the cache is valid for */
+	struct list_head entries;	/* struct xcfs_xattr, newest first */
+	int nr;
+};
+
+/* byte ranges of an inode held by writers, see range.c */
+struct xcfs_range_lock {
+	spinlock_t lock;
+	struct list_head held;		/* struct xcfs_range */
+	wait_queue_head_t wait;
+};
+
+#define XCFS_RANGE_EOF		LLONG_MAX	/* end of a range past eof */
+
+struct xcfs_range {
+	struct list_head list;
+	loff_t start, end;		/* inclusive */
+};
+
 /* xcfs inode data in memory */
 struct xcfs_inode_info {
 	struct inode *lower_inode;
+	struct hlist_bl_node hash_node;	/* in sbi->inode_hash, see lookup.c */
+	struct xcfs_header hdr;
+	struct xcfs_csum *csum;		/* block checksums, see integrity.c */
+	struct mutex extent_lock;	/* compressed extents, see compress.c */
+	struct file *wb_file;		/* lower file for writeback, while open for write */
+	spinlock_t lower_lock;		/* protects lower_files, wb_file */
+	struct list_head lower_files;	/* shared lower files, see file.c */
+	struct xcfs_xattr_cache xattrs;
+	struct xcfs_range_lock ranges;	/* writers, see range.c */
+	unsigned long attr_time;	/* jiffies of the last lower getattr */
+	struct xcfs_link __rcu *link;	/* replaced under i_lock, see inode.c */
 	struct inode vfs_inode;
 };
 
@@ -85,11 +264,49 @@ struct xcfs_dentry_info {
 	struct path lower_path;
 };
 
+/* per-mount counters, reported through /proc/self/mountstats */
+struct xcfs_stats {
+	atomic64_t readpages;		/* upper page-cache fills */
+	atomic64_t lower_read_bytes;
+	atomic64_t lower_write_bytes;
+	atomic64_t lower_dropped;	/* lower pages dropped behind */
+	atomic64_t crypt_offloaded;	/* pieces run by crypto workers */
+};
+
 /* xcfs super-block data in memory */
 struct xcfs_sb_info {
+	struct super_block *sb;
 	struct super_block *lower_sb;
+	int format;		/* XCFS_FMT_* for newly created files */
+	int cache;		/* XCFS_CACHE_* */
+	bool integrity;		/* checksum newly created files */
+	bool compress;		/* compress newly created files */
+	mempool_t *bounce_pool;	/* pages for direct I/O encryption */
+	struct workqueue_struct *crypt_wq;	/* see crypto.c */
+	struct hlist_bl_head *inode_hash;	/* lower inode -> upper inode */
+	unsigned int inode_hash_bits;
+	wait_queue_head_t inode_wait;	/* evictions leaving inode_hash */
+	struct xcfs_fh_cache *fh_cache;	/* decoded NFS handles, export.c */
+	unsigned int crypt_threshold;	/* bytes; 0: always inline */
+	bool has_key;
+	u32 ctr_key[8];		/* ChaCha20 key of the ctr format */
+	unsigned int readahead_kb;	/* 0: the lower file's default */
+	unsigned int crypto_workers;	/* 0: one per cpu */
+	unsigned int bounce_pool_pages;
+	unsigned int attr_timeout;	/* ms to trust cached attributes */
+	int writeback;		/* XCFS_WB_* */
+	struct mutex opt_lock;	/* serializes option changes */
+	const struct cred *creator_cred;	/* for our own lower files */
+	struct mutex meta_lock;	/* protects meta_dir */
+	struct path meta_dir;	/* XCFS_META_DIR, once looked up */
+	struct kobject kobj;	/* /sys/fs/xcfs/<dev>/, see sysfs.c */
+	struct completion kobj_unregister;
+	struct xcfs_stats stats;
 };
 
+#define xcfs_stat_add(sb, field, n) \
+	atomic64_add((n), &XCFS_SB(sb)->stats.field)
+
 /*
  * inode to private data
  *
@@ -146,6 +363,99 @@ static inline void xcfs_set_lower_super(struct super_block *sb,
 	XCFS_SB(sb)->lower_sb = val;
 }
 
+/* on-disk format of an inode's data */
+static inline int xcfs_format(const struct inode *inode)
+{
+	return XCFS_I(inode)->hdr.format;
+}
+
+/* this function grows i_size, never shrinks it: writers end in any order */
+static inline void xcfs_size_extend(struct inode *inode, loff_t size)
+{
+	spin_lock(&inode->i_lock);
+	if (size > i_size_read(inode))
+		i_size_write(inode, size);
+	spin_unlock(&inode->i_lock);
+}
+
+/* formats whose transform needs the mount key and a per-file nonce */
+static inline bool xcfs_format_keyed(int format)
+{
+	return format == XCFS_FMT_CTR || format == XCFS_FMT_BLOCK;
+}
+
+/*
+ * whether the data of an inode is only ever rewritten a unit at a time;
+ * writes then read back around them, through the upper page cache
+ */
+static inline bool xcfs_is_block(const struct inode *inode)
+{
+	return xcfs_format(inode) == XCFS_FMT_BLOCK;
+}
+
+/* whether the data of an inode carries block checksums */
+static inline bool xcfs_has_integrity(const struct inode *inode)
+{
+	return XCFS_I(inode)->hdr.flags & XCFS_HDR_INTEGRITY;
+}
+
+/* whether the data of an inode is stored in compressed extents */
+static inline bool xcfs_has_compression(const struct inode *inode)
+{
+	return XCFS_I(inode)->hdr.flags & XCFS_HDR_COMPRESS;
+}
+
+/*
+ * lower holes read back as zeros only in the sparse format; the holes
+ * behind compressed extents are not holes of the upper file
+ */
+static inline bool xcfs_has_holes(const struct inode *inode)
+{
+	return xcfs_format(inode) == XCFS_FMT_SPARSE &&
+	       !xcfs_has_compression(inode);
+}
+
+/*
+ * whether buffered reads go through the upper page cache; checksummed
+ * files always do, so every block is verified on its way in, and so do
+ * compressed ones, which are only ever decompressed a whole extent at once
+ */
+static inline bool xcfs_use_upper_cache(const struct inode *inode)
+{
+	return XCFS_SB(inode->i_sb)->cache == XCFS_CACHE_UPPER ||
+	       xcfs_has_integrity(inode) || xcfs_has_compression(inode) ||
+	       xcfs_is_block(inode);
+}
+
+/*
+ * Ciphertext may be moved between two files as-is (lower copy or clone)
+ * only when both use the same position-independent transform.  Both byte
+ * transforms are position independent, the keyed ones are not;
+ * checksums and extent maps would go stale.
+ */
+static inline bool xcfs_can_share_ciphertext(const struct inode *a,
+					     const struct inode *b)
+{
+	return xcfs_format(a) == xcfs_format(b) &&
+	       !xcfs_format_keyed(xcfs_format(a)) &&
+	       !(XCFS_I(a)->hdr.flags | XCFS_I(b)->hdr.flags);
+}
+
+/* our own lower directory, at the top of the lower tree, is hidden */
+static inline bool xcfs_is_meta_dir(const struct dentry *dir,
+				    const char *name, int len)
+{
+	return IS_ROOT(dir) && len == sizeof(XCFS_META_DIR) - 1 &&
+	       !memcmp(name, XCFS_META_DIR, len);
+}
+
+/* our own lower xattrs are never visible through xcfs */
+static inline bool xcfs_is_private_xattr(const char *name)
+{
+	return !strncmp(name, XCFS_XATTR_PREFIX,
+			sizeof(XCFS_XATTR_PREFIX) - 1);
+}
+
 /* path based (dentry/mnt) macros */
 static inline void pathcpy(struct path *dst, const struct path *src)
 {
@@ -0,0 +1,161 @@
+#ifndef _XCFS_FORMAT_H_
+#define _XCFS_FORMAT_H_
+
+/*
+ * What a lower file holds: the on-disk header and the data transforms of
+ * every format.  Shared by the module and tools/xcfsctl, so that both
+ * read and write the same ciphertext; it needs nothing but the __u8
+ * style types of <linux/types.h> and size_t.
+ */
+
+/* on-disk formats */
+#define XCFS_FMT_SHIFT		0	/* every byte shifted by one */
+#define XCFS_FMT_SPARSE		1	/* zero-preserving shift, holes allowed */
+#define XCFS_FMT_CTR		2	/* ChaCha20 keystream xor, see crypto.c */
+#define XCFS_FMT_BLOCK		3	/* whole-unit transform, see crypto.c */
+#define XCFS_FMT_MAX		XCFS_FMT_BLOCK
+#define XCFS_FMT_UNKNOWN	0xff	/* written by a newer xcfs */
+
+#define XCFS_BLOCK_SIZE		4096	/* crypto unit of the block format */
+
+/* per-file header, stored in a lower xattr */
+#define XCFS_XATTR_PREFIX	"user.xcfs."	/* hidden from users */
+#define XCFS_HDR_XATTR		XCFS_XATTR_PREFIX "header"
+#define XCFS_HDR_MAGIC		0x53464358	/* "XCFS" */
+#define XCFS_HDR_VERSION	1
+#define XCFS_HDR_INTEGRITY	0x0001	/* per-block checksums, integrity.c */
+#define XCFS_HDR_COMPRESS	0x0002	/* LZ4 extents in frames, compress.c */
+#define XCFS_HDR_KNOWN_FLAGS	(XCFS_HDR_INTEGRITY | XCFS_HDR_COMPRESS)
+
+/*
+ * Lower files of our own live in XCFS_META_DIR at the top of the lower
+ * tree, which xcfs hides.  The checksums of a file are in its sidecar
+ * there, named by the csum_id of its header so that renames and hard
+ * links of the file need nothing done to it.
+ */
+#define XCFS_META_DIR		".xcfs"
+#define XCFS_CSUM_NAME		"csum.%016llx"	/* csum_id */
+
+/*
+ * A checksum leaf holds the crc32c of XCFS_CSUM_PER_LEAF consecutive
+ * blocks, then the crc32c of those entries.  Leaf n is at
+ * XCFS_CSUM_LEAF_POS(n) of the sidecar; before the leaves, the index has
+ * the crc32c that ends each leaf, or 0 for a leaf never stored.  The
+ * index is summed XCFS_CSUM_INDEX_BLOCK entries at a time, and the
+ * crc32c of those sums is the csum_root of the header, which covers the
+ * first csum_leaves entries: no leaf can go missing, or the sidecar be
+ * swapped for an older one, without the root giving it away.
+ */
+#define XCFS_CSUM_LEAF_SIZE	1024
+#define XCFS_CSUM_PER_LEAF	(XCFS_CSUM_LEAF_SIZE / 4 - 1)
+#define XCFS_CSUM_MAX_LEAVES	(1UL << 20)	/* about 1 TiB of blocks */
+#define XCFS_CSUM_INDEX_BLOCK	1024
+#define XCFS_CSUM_LEAF_POS(n)	(XCFS_CSUM_MAX_LEAVES * 4 + \
+				 (__u64)(n) * XCFS_CSUM_LEAF_SIZE)
+
+struct xcfs_disk_header {
+	__le32 magic;
+	__u8 version;
+	__u8 format;		/* XCFS_FMT_* */
+	__le16 flags;		/* optional features */
+	__u8 extent_shift;	/* log2 of the transform unit */
+	__u8 nonce[7];		/* ctr format, zero otherwise */
+	__le64 csum_id;		/* names the sidecar, with integrity */
+	__le32 csum_root;	/* crc32c of the index sums */
+	__le32 csum_leaves;	/* index entries the root covers */
+} __attribute__((packed));
+
+/* start of a compressed extent, followed by clen bytes of LZ4 data */
+#define XCFS_FRAME_MAGIC	0x5a4c4358	/* "XCLZ" */
+
+struct xcfs_frame {
+	__le32 magic;
+	__le32 clen;		/* bytes of compressed data */
+	__le32 index;		/* low bits of the extent number */
+	__le32 crc;		/* crc32c of the stored compressed data */
+} __attribute__((packed));
+
+/* shift format, and files without a header */
+static inline void xcfs_shift_encrypt(__u8 *p, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		p[i]++;
+}
+
+static inline void xcfs_shift_decrypt(__u8 *p, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		p[i]--;
+}
+
+/* sparse format: zeros (holes) stay zero, 1..255 rotate */
+static inline void xcfs_sparse_encrypt(__u8 *p, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (p[i])
+			p[i] = p[i] == 255 ? 1 : p[i] + 1;
+	}
+}
+
+static inline void xcfs_sparse_decrypt(__u8 *p, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (p[i])
+			p[i] = p[i] == 1 ? 255 : p[i] - 1;
+	}
+}
+
+/*
+ * ctr format: keystream block n is ChaCha20 of this input, the 256-bit
+ * mount key with the file's nonce and n as its 64-bit counter
+ */
+static inline void xcfs_ctr_state(__u32 state[16], const __u32 key[8],
+				  __u64 nonce, __u64 n)
+{
+	int i;
+
+	state[0] = 0x61707865;	/* "expand 32-byte k" */
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (i = 0; i < 8; i++)
+		state[4 + i] = key[i];
+	state[12] = (__u32)n;
+	state[13] = (__u32)(n >> 32);
+	state[14] = (__u32)nonce;
+	state[15] = (__u32)(nonce >> 32);
+}
+
+/*
+ * block format: running sums forwards and then backwards spread every
+ * byte of a unit over all of it; the ctr keystream goes over the result
+ */
+static inline void xcfs_block_mix(__u8 *p, size_t len)
+{
+	size_t i;
+
+	for (i = 1; i < len; i++)
+		p[i] += p[i - 1];
+	for (i = len - 1; i > 0; i--)
+		p[i - 1] += p[i];
+}
+
+static inline void xcfs_block_unmix(__u8 *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i++)
+		p[i] -= p[i + 1];
+	for (i = len - 1; i > 0; i--)
+		p[i] -= p[i - 1];
+}
+
+#endif	/* not _XCFS_FORMAT_H_ */